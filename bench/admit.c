@@ -0,0 +1,169 @@
+/****************************************
+** admit.c - admission table lookups at a million distinct sources
+****************************************/
+
+// admit_bench [sources] [threads]
+//
+// Every thread runs admit_check() over the same sources, half IPv4 and half
+// IPv6 /64s in random order: once when the table sees them first, then twice
+// as known sources. Prints each pass's CPU time per check and the checks per
+// second of all threads together.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "admit.h"
+
+union addr {
+    struct sockaddr sa;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+};
+
+struct run {
+    struct admit *a;
+    const union addr *addrs;
+    size_t n, start;
+    unsigned long ok, refused;
+    uint64_t began, ended;
+    pthread_t thread;
+};
+
+static struct admit table;
+static union addr *addrs;
+static pthread_barrier_t barrier;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// each thread starts somewhere else in the list, the first pass still inserts every source once
+static void *pass(void *arg) {
+    struct run *r = arg;
+    uint64_t now = 0;
+    size_t i, k;
+
+    pthread_barrier_wait(&barrier);
+    r->began = now_ns();
+    for (k = 0; k < r->n; k++) {
+        i = (r->start + k) % r->n;
+
+        // the server reads the clock at accept anyway, it is not the table's cost
+        if (k % 1024 == 0) {
+            now = now_ns();
+        }
+        if (admit_check(r->a, &r->addrs[i].sa, now) == ADMIT_OK) {
+            r->ok++;
+        } else {
+            r->refused++;
+        }
+    }
+    r->ended = now_ns();
+    return NULL;
+}
+
+static void run_pass(const char *name, struct run *runs, int threads, size_t n) {
+    unsigned long ok = 0, refused = 0;
+    uint64_t start, end;
+    int t;
+
+    pthread_barrier_init(&barrier, NULL, (unsigned) threads + 1);
+    for (t = 0; t < threads; t++) {
+        runs[t].ok = runs[t].refused = 0;
+        pthread_create(&runs[t].thread, NULL, pass, &runs[t]);
+    }
+    pthread_barrier_wait(&barrier);
+
+    // from the first thread starting to the last one done, the threads may well share a core
+    start = UINT64_MAX;
+    end = 0;
+    for (t = 0; t < threads; t++) {
+        pthread_join(runs[t].thread, NULL);
+        start = runs[t].began < start ? runs[t].began : start;
+        end = runs[t].ended > end ? runs[t].ended : end;
+        ok += runs[t].ok;
+        refused += runs[t].refused;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    printf("%-8s %8.1f ns/check %10.2f M checks/s  %lu admitted, %lu refused\n", name,
+           (double) (end - start) / n, (double) n * threads / ((end - start) / 1e3), ok, refused);
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    struct run *runs;
+    uint64_t seed = 0x2545f4914f6cdd1dULL, x;
+    size_t i;
+    int t;
+
+    if (n == 0 || threads < 1) {
+        fprintf(stderr, "usage: admit_bench [sources] [threads]\n");
+        return 1;
+    }
+    if ((addrs = calloc(n, sizeof *addrs)) == NULL || (runs = calloc(threads, sizeof *runs)) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    // random addresses, distinct by construction: the index is part of each
+    for (i = 0; i < n; i++) {
+        x = xorshift(&seed);
+        if (i % 2 == 0) {
+            addrs[i].v4.sin_family = AF_INET;
+            addrs[i].v4.sin_addr.s_addr = htonl((uint32_t) (i / 2) ^ (uint32_t) (x >> 32));
+        } else {
+            addrs[i].v6.sin6_family = AF_INET6;
+            addrs[i].v6.sin6_addr.s6_addr[0] = 0x20;
+            memcpy(&addrs[i].v6.sin6_addr.s6_addr[1], &i, 7);
+            memcpy(&addrs[i].v6.sin6_addr.s6_addr[8], &x, 8);
+        }
+    }
+    for (i = n - 1; i > 0; i--) {
+        union addr tmp = addrs[i];
+        size_t j = xorshift(&seed) % (i + 1);
+
+        addrs[i] = addrs[j];
+        addrs[j] = tmp;
+    }
+
+    // 1000 per second in bursts of 1000: the passes below stay within every bucket
+    if (admit_init(&table, n, 1000, 1000, 0) == -1) {
+        perror("admit_init");
+        return 1;
+    }
+    printf("%zu sources, %zu slots (%zu MiB), %d thread%s\n", n, table.mask + 1,
+           (table.mask + 1) * sizeof(struct admit_slot) >> 20, threads, threads > 1 ? "s" : "");
+
+    for (t = 0; t < threads; t++) {
+        runs[t].a = &table;
+        runs[t].addrs = addrs;
+        runs[t].n = n;
+        runs[t].start = n / threads * t;
+    }
+    run_pass("insert", runs, threads, n);
+    run_pass("hit", runs, threads, n);
+    run_pass("hit", runs, threads, n);
+    printf("%lu sources untracked, %lu evicted\n", table.overflows, table.evicted);
+
+    admit_destroy(&table);
+    free(addrs);
+    free(runs);
+    return 0;
+}
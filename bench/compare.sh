@@ -0,0 +1,86 @@
+#!/bin/sh
+# Compare a bench/suite.sh result against a baseline.
+#
+#   bench/compare.sh baseline.json current.json [threshold %]
+#
+# A result is a regression when it got worse than the baseline by more than
+# THRESHOLD percent, in whichever direction is worse for it. A run that had
+# errors counts as one too. Results only one of the files has are listed
+# but not judged. Exits 1 on any regression, 0 without a baseline.
+
+BASELINE=$1
+CURRENT=$2
+THRESHOLD=${3:-10}
+
+if [ -z "$CURRENT" ] || [ ! -f "$CURRENT" ]; then
+    echo "usage: bench/compare.sh baseline.json current.json [threshold %]" >&2
+    exit 2
+fi
+if [ ! -f "$BASELINE" ]; then
+    echo "no baseline at $BASELINE, nothing to compare; make one with the bench-baseline target" >&2
+    exit 0
+fi
+
+awk -v threshold="$THRESHOLD" '
+    # the value of "key" in one result line as suite.sh writes them
+    function field(key,    re, s) {
+        re = "\"" key "\": \"?[^,\"}]*"
+        if (!match($0, re)) {
+            return ""
+        }
+        s = substr($0, RSTART, RLENGTH)
+        sub("^\"" key "\": \"?", "", s)
+        return s
+    }
+
+    !/"name":/ { next }
+    {
+        key = field("name") " " field("metric")
+    }
+    FNR == NR {
+        base[key] = field("value")
+        next
+    }
+    {
+        cur = field("value")
+        order[++n] = key
+        current[key] = cur
+        unit[key] = field("unit")
+        better[key] = field("better")
+        errors[key] = field("errors")
+    }
+
+    END {
+        printf "%-36s %14s %14s %9s\n", "benchmark", "baseline", "current", "change"
+        for (i = 1; i <= n; i++) {
+            key = order[i]
+            cur = current[key]
+            if (!(key in base)) {
+                printf "%-36s %14s %14s %9s  new\n", key, "-", cur " " unit[key], ""
+                continue
+            }
+            b = base[key]
+            change = b != 0 ? (cur - b) / b * 100 : 0
+            worse = better[key] == "higher" ? -change : change
+            status = ""
+            if (errors[key] > 0) {
+                status = "ERRORS"
+            } else if (cur == 0 && b != 0) {
+                status = "FAILED"
+            } else if (worse > threshold) {
+                status = "REGRESSION"
+            } else if (-worse > threshold) {
+                status = "better"
+            }
+            if (status == "ERRORS" || status == "FAILED" || status == "REGRESSION") {
+                bad++
+            }
+            printf "%-36s %14s %14s %+8.1f%%  %s\n", key, b " " unit[key], cur " " unit[key], change, status
+            delete base[key]
+        }
+        for (key in base) {
+            printf "%-36s %14s %14s %9s  gone\n", key, base[key], "-", ""
+        }
+        printf "%d of %d results worse than the baseline by more than %s%%\n", bad, n, threshold
+        exit bad > 0
+    }' "$BASELINE" "$CURRENT"
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Connect per request against the connection pool, over loopback.
+#
+#   bench/connpool.sh [build dir] [seconds]
+#
+# The first two runs pay a handshake for every request, once with the load
+# generator's own connections and once through the pool with -x 1. The others
+# keep CONNS connections open and multiplex up to DEPTH requests over each.
+
+BUILD=${1:-build}
+SECS=${2:-3}
+PORT=${PORT:-3499}
+CONNS=${CONNS:-4}
+DEPTH=${DEPTH:-32}
+
+"$BUILD/server" -m epoll -p "$PORT" >/dev/null 2>&1 &
+server=$!
+sleep 0.3
+
+printf '%-28s %10s %10s %10s %10s\n' mode req/s p50_us p99_us connects
+
+run() {
+    name=$1
+    shift
+    "$BUILD/client" -p "$PORT" -d "$SECS" -s 64 "$@" localhost 2>&1 |
+        awk -v name="$name" '
+            /req\/s/         { gsub(",", ""); rate = $(NF - 1) }
+            /connects/       { gsub(",", ""); for (i = 2; i < NF; i++) if ($(i + 1) ~ /^connects/) conns = $i }
+            /latency us p50/ { gsub(",", ""); p50 = $5; p99 = $9 }
+            END              { printf "%-28s %10s %10s %10s %10s\n", name, rate, p50, p99, conns }'
+}
+
+run "connect per request"          -c "$CONNS" -x 1
+run "pool, connect per request"    -k -c "$CONNS" -P 1 -x 1
+run "pool, keep-alive"             -k -c "$CONNS" -P 1
+run "pool, $DEPTH in flight"       -k -c "$CONNS" -P "$DEPTH"
+
+kill "$server"
+wait "$server" 2>/dev/null
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Restart the server under load and check that no client noticed.
+#
+#   bench/hotrestart.sh [build dir] [restarts] [mode]
+#
+# The load generator opens a new connection per request (-x 1) for the whole
+# run while the server is replaced RESTARTS times through its -H socket. Every
+# new process takes the listeners over from the one before, which drains and
+# exits. Exits 1 if any connect or request failed, or a server is left over.
+
+BUILD=${1:-build}
+RESTARTS=${2:-5}
+MODE=${3:-epoll}
+PORT=${PORT:-3499}
+CONNS=${CONNS:-32}
+WORKERS=${WORKERS:-2}
+EVERY=${EVERY:-1}
+
+sock=$(mktemp -u /tmp/hotrestart.XXXXXX)
+out=$(mktemp /tmp/hotrestart.XXXXXX)
+secs=$(( (RESTARTS + 2) * EVERY ))
+
+start_server() {
+    "$BUILD/server" -m "$MODE" -w "$WORKERS" -p "$PORT" -H "$sock" -T drain=5 >/dev/null 2>&1 &
+    server=$!
+}
+
+start_server
+sleep 0.3
+"$BUILD/client" -p "$PORT" -d "$secs" -c "$CONNS" -x 1 -s 64 localhost >"$out" 2>&1 &
+client=$!
+
+i=0
+old=
+while [ "$i" -lt "$RESTARTS" ]; do
+    sleep "$EVERY"
+    old="$old $server"
+    start_server
+    i=$((i + 1))
+done
+
+wait "$client"
+kill "$server"
+wait "$server" 2>/dev/null
+
+grep '^loadgen: [0-9.]* MB/s' "$out"
+errors=$(awk '/ errors$/ { print $(NF - 1) }' "$out")
+left=0
+for pid in $old; do
+    if kill -0 "$pid" 2>/dev/null; then
+        left=$((left + 1))
+        kill "$pid"
+    fi
+done
+rm -f "$out"
+
+echo "$RESTARTS restarts, $errors errors, $left old servers still running"
+[ "$errors" = 0 ] && [ "$left" = 0 ]
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Connection setup latency over loopback, one server -o knob at a time.
+#
+#   bench/sockopt.sh [build dir] [seconds]
+#
+# Every run opens a new connection per request (-x 1) in a closed loop on
+# CONNS connections, so "connect to first answer" is the handshake plus one
+# request and answer. TFO needs net.ipv4.tcp_fastopen=3.
+
+BUILD=${1:-build}
+SECS=${2:-3}
+PORT=${PORT:-3499}
+CONNS=${CONNS:-1}
+
+if [ "$(cat /proc/sys/net/ipv4/tcp_fastopen 2>/dev/null)" != 3 ]; then
+    echo "note: net.ipv4.tcp_fastopen is not 3, the fastopen run falls back to a normal handshake" >&2
+fi
+
+printf '%-28s %10s %10s %10s %10s\n' knob conn/s p50_us p90_us p99_us
+
+for knob in none backlog=10 backlog=4096 fastopen defer nodelay busypoll=50 \
+            sndbuf=64k,rcvbuf=64k sndbuf=4m,rcvbuf=4m; do
+    opt=
+    if [ "$knob" != none ]; then
+        opt="-o $knob"
+    fi
+
+    "$BUILD/server" -m epoll -p "$PORT" $opt >/dev/null 2>&1 &
+    server=$!
+    sleep 0.3
+
+    # the client side of the knob too, where it has one
+    copt=
+    case $knob in
+        fastopen|nodelay|busypoll*|sndbuf*) copt=$opt ;;
+    esac
+
+    "$BUILD/client" -p "$PORT" -d "$SECS" -c "$CONNS" -x 1 $copt localhost 2>&1 |
+        awk -v knob="$knob" -v secs="$SECS" '
+            /connect to first answer/ {
+                gsub("[,(]", "")
+                printf "%-28s %10.0f %10s %10s %10s\n", knob, $15 / secs, $8, $10, $12
+            }'
+
+    kill "$server"
+    wait "$server" 2>/dev/null
+done
@@ -0,0 +1,193 @@
+#!/bin/sh
+# The benchmark suite over loopback, results as JSON.
+#
+#   bench/suite.sh [build dir] [output.json]
+#
+# For every server mode in MODES:
+#   setup      connections per second, one request on each (-x 1)
+#   rtt        one 64-byte request at a time on one connection, p50 and p99
+#   pipelined  64-byte requests per second, PIPELINE in flight on 4 connections
+#   bulk       MB/s for a payload of every size in SIZES
+# udp has no connections and datagrams stop at 64 KiB, it runs rtt and
+# pipelined only. The admission table's lookup at a million sources comes last.
+#
+# Server and client run with one thread each, pinned to SERVER_CPU and
+# CLIENT_CPU (the same core on a single-CPU machine, the JSON says so). Every
+# load starts with WARMUP seconds whose numbers are thrown away, then runs
+# REPEAT times for SECS seconds; each result is the median of the repeats.
+# bench/compare.sh checks the output against a baseline.
+
+BUILD=${1:-build}
+OUT=${2:-bench.json}
+SECS=${SECS:-2}
+WARMUP=${WARMUP:-1}
+REPEAT=${REPEAT:-3}
+PORT=${PORT:-3499}
+MODES=${MODES:-"fork epoll uring coro udp"}
+SIZES=${SIZES:-"1k 64k 1m 16m 64m"}
+PIPELINE=${PIPELINE:-32}
+
+ncpus=$(nproc 2>/dev/null || echo 1)
+SERVER_CPU=${SERVER_CPU:-0}
+if [ -z "$CLIENT_CPU" ]; then
+    CLIENT_CPU=$(( ncpus > 1 ? 1 : 0 ))
+fi
+
+# 64 MiB of payload plus its frame header
+MAXFRAME=134217728
+
+results=$(mktemp /tmp/suite.XXXXXX)
+out=$(mktemp /tmp/suite.XXXXXX)
+trap 'rm -f "$results" "$out" "$out".*' EXIT
+
+server_start() {
+    mode=$1
+    shift
+    taskset -c "$SERVER_CPU" "$BUILD/server" -m "$mode" -w 1 -p "$PORT" "$@" >/dev/null 2>&1 &
+    server=$!
+
+    # a big payload takes a while to build before the server listens
+    tries=0
+    while [ "$tries" -lt 50 ] && [ -z "$(ss -Hltun "sport = :$PORT" 2>/dev/null)" ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    sleep 0.1
+}
+
+server_stop() {
+    kill "$server" 2>/dev/null
+    wait "$server" 2>/dev/null
+}
+
+# run a command REPEAT times, the outputs in $out.1, $out.2, ...
+repeat() {
+    i=1
+    while [ "$i" -le "$REPEAT" ]; do
+        "$@" >"$out.$i" 2>&1
+        i=$((i + 1))
+    done
+}
+
+# the client against the server, after a warmup of the same load
+load() {
+    taskset -c "$CLIENT_CPU" "$BUILD/client" -p "$PORT" -t 1 -d "$WARMUP" "$@" localhost >/dev/null 2>&1
+    repeat taskset -c "$CLIENT_CPU" "$BUILD/client" -p "$PORT" -t 1 -d "$SECS" "$@" localhost
+}
+
+# what an extractor finds in each output, one line per repeat
+each() {
+    i=1
+    while [ "$i" -le "$REPEAT" ]; do
+        "$@" "$out.$i"
+        i=$((i + 1))
+    done
+}
+
+median() {
+    each "$@" | sort -g | awk '{ v[NR] = $1 } END { if (NR) print NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# the number in front of the word matching pat
+number_before() {
+    awk -v pat="$1" '
+        { gsub(",", "") }
+        { for (i = 2; i <= NF; i++) if ($i ~ pat) { print $(i - 1); exit } }' "$2"
+}
+
+# the number after a label like p50, on the line matching line
+number_after() {
+    awk -v label="$1" -v line="$2" '
+        $0 ~ line { gsub(",", ""); for (i = 1; i < NF; i++) if ($i == label) { print $(i + 1); exit } }' "$3"
+}
+
+mb_in() {
+    awk '/MB\/s in/ { print $2; exit }' "$1"
+}
+
+# datagrams per second that came back, from the blaster
+pps_in() {
+    awk '/pps in/ { for (i = 2; i < NF; i++) if ($i == "pps" && $(i + 1) == "in,") print $(i - 1) }' "$1"
+}
+
+# one datagram in flight: the mean round trip is all the blaster can tell
+udp_rtt() {
+    pps_in "$1" | awk '$1 > 0 { printf "%.1f\n", 1e6 / $1 }'
+}
+
+admit_hit() {
+    awk '/^hit/ { v = $2 } END { print v }' "$1"
+}
+
+# name metric unit higher|lower extractor..., with the errors of all repeats
+result() {
+    name=$1 metric=$2 unit=$3 better=$4
+    shift 4
+    value=$(median "$@")
+    errors=$(each number_before '^errors$' | awk '{ n += $1 } END { print n + 0 }')
+    printf '    {"name": "%s", "metric": "%s", "unit": "%s", "better": "%s", "value": %s, "errors": %s}\n' \
+        "$name" "$metric" "$unit" "$better" "${value:-0}" "$errors" >>"$results"
+    printf '%-24s %-16s %14s %s%s\n' "$name" "$metric" "${value:-?}" "$unit" \
+        "$([ "$errors" = 0 ] || echo " ($errors errors)")" >&2
+}
+
+tcp_mode() {
+    mode=$1
+
+    server_start "$mode"
+    load -c 4 -x 1 -s 64
+    result "$mode/setup" conn_per_s "1/s" higher number_before '^req/s$'
+    load -c 1 -P 1 -s 64
+    result "$mode/rtt" p50 us lower number_after p50 latency
+    result "$mode/rtt" p99 us lower number_after p99 latency
+    load -c 4 -P "$PIPELINE" -s 64
+    result "$mode/pipelined" msg_per_s "1/s" higher number_before '^req/s$'
+    server_stop
+
+    for size in $SIZES; do
+        server_start "$mode" -b "$size"
+        load -c 1 -s 0 -M "$MAXFRAME"
+        result "$mode/bulk_$size" throughput MB/s higher mb_in
+        server_stop
+    done
+}
+
+udp_mode() {
+    server_start udp
+    load -u -c 1 -P 1 -s 64
+    result udp/rtt mean us lower udp_rtt
+    load -u -c 4 -P "$PIPELINE" -s 64
+    result udp/pipelined msg_per_s "1/s" higher pps_in
+    server_stop
+}
+
+echo "server on cpu $SERVER_CPU, client on cpu $CLIENT_CPU, ${WARMUP}s warmup, $REPEAT x ${SECS}s per load" >&2
+
+for mode in $MODES; do
+    case $mode in
+        udp) udp_mode ;;
+        *) tcp_mode "$mode" ;;
+    esac
+done
+
+if [ -x "$BUILD/admit_bench" ]; then
+    repeat taskset -c "$SERVER_CPU" "$BUILD/admit_bench" 1000000
+    result admit/lookup_1m hit ns lower admit_hit
+fi
+
+# one result per line, bench/compare.sh reads it with awk
+{
+    printf '{\n  "meta": {"date": "%s", "git": "%s", "kernel": "%s", "cpu": "%s", "cpus": %s,\n' \
+        "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+        "$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null)" \
+        "$(uname -r)" \
+        "$(awk -F': ' '/^model name/ { print $2; exit }' /proc/cpuinfo | tr -d '"')" \
+        "$ncpus"
+    printf '           "build_type": "%s", "server_cpu": %s, "client_cpu": %s, "warmup_s": %s, "seconds": %s, "repeat": %s},\n' \
+        "${BUILD_TYPE:-}" "$SERVER_CPU" "$CLIENT_CPU" "$WARMUP" "$SECS" "$REPEAT"
+    printf '  "results": [\n'
+    sed '$!s/$/,/' "$results"
+    printf '  ]\n}\n'
+} >"$OUT"
+
+echo "results in $OUT" >&2
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Plaintext against TLS in user space against kTLS, over loopback.
+#
+#   bench/tls.sh [build dir] [seconds]
+#
+# A self-signed P-256 certificate is made for the run. For every variant the
+# first line connects per request (-x 1), so it counts handshakes per second,
+# the other two fetch a SIZE payload on CONNS keep-alive connections, once
+# from memory (-b) and once from a file (-f, sendfile() where the socket allows).
+# Without the "tls" ULP in the kernel the kTLS runs stay in user space, the
+# server's "tls: ... with kTLS" line at the end says which it was.
+
+BUILD=${1:-build}
+SECS=${2:-3}
+PORT=${PORT:-3499}
+CONNS=${CONNS:-4}
+SIZE=${SIZE:-1m}
+
+dir=$(mktemp -d /tmp/tls.XXXXXX)
+trap 'rm -rf "$dir"' EXIT
+
+if ! openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 30 \
+        -subj /CN=localhost -keyout "$dir/key.pem" -out "$dir/cert.pem" >/dev/null 2>&1; then
+    echo "tls.sh: cannot make a certificate, is openssl installed?" >&2
+    exit 1
+fi
+head -c "$(( $(echo "$SIZE" | sed 's/k$/ * 1024/; s/m$/ * 1048576/') ))" /dev/zero >"$dir/payload"
+
+if ! grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp 2>/dev/null; then
+    echo "# no tls ULP in this kernel (modprobe tls), kTLS falls back to user space"
+fi
+
+printf '%-26s %10s %10s %10s\n' variant req/s MB/s p99_us
+
+run() {
+    name=$1
+    shift
+    "$BUILD/client" -p "$PORT" -d "$SECS" "$@" localhost 2>&1 |
+        awk -v name="$name" '
+            /req\/s/         { gsub(",", ""); rate = $(NF - 1) }
+            /MB\/s in/       { mb = $2 }
+            /latency us p50/ { gsub(",", ""); p99 = $9 }
+            END              { printf "%-26s %10s %10s %10s\n", name, rate, mb, p99 }'
+}
+
+# label, server flags, client flags
+variant() {
+    label=$1
+    server_tls=$2
+    client_tls=$3
+
+    for payload in "-b $SIZE" "-f $dir/payload"; do
+        "$BUILD/server" -m epoll -p "$PORT" $payload $server_tls >"$dir/server.log" 2>&1 &
+        server=$!
+        sleep 0.3
+        case $payload in
+            -b*)
+                run "$label handshakes" -c "$CONNS" -x 1 -s 64 $client_tls
+                run "$label bulk" -c "$CONNS" -s 0 $client_tls
+                ;;
+            *)
+                run "$label sendfile" -c "$CONNS" -s 0 $client_tls
+                ;;
+        esac
+        kill "$server"
+        wait "$server" 2>/dev/null
+    done
+    grep '^tls:' "$dir/server.log" | sed 's/^/# /'
+}
+
+variant plaintext "" ""
+variant "tls user" "-S $dir/cert.pem,$dir/key.pem,noktls" -S
+variant ktls "-S $dir/cert.pem,$dir/key.pem" -S
@@ -0,0 +1,202 @@
+/****************************************
+** admit.c - per-source connection rate limits and a global connection cap
+****************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include "admit.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1
+
+// spinning on another core's store, without hogging the core's other thread
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+int admit_init(struct admit *a, size_t sources, double rate, unsigned burst, unsigned long max_conns) {
+    size_t n = 1;
+
+    memset(a, 0, sizeof *a);
+    a->max_conns = max_conns;
+    if (rate <= 0) {
+        return 0;
+    }
+    a->interval_ns = (uint64_t) (1e9 / rate);
+    if (a->interval_ns == 0) {
+        a->interval_ns = 1;
+    }
+    a->burst_ns = (burst > 1 ? burst - 1 : 0) * a->interval_ns;
+
+    // at most three quarters full, linear probing gets slow beyond that
+    while (n < sources + sources / 3) {
+        n <<= 1;
+    }
+
+    // a lookup is one random access, at a million sources a TLB miss on top with small pages
+    a->size = n * sizeof *a->slots;
+    a->slots = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (a->slots == MAP_FAILED) {
+        a->slots = NULL;
+        return -1;
+    }
+    madvise(a->slots, a->size, MADV_HUGEPAGE);
+    a->mask = n - 1;
+    if (getrandom(a->seed, sizeof a->seed, 0) != sizeof a->seed) {
+        a->seed[0] = (uint64_t) time(NULL) ^ (uint64_t) getpid() << 32;
+        a->seed[1] = a->seed[0] * 0x9e3779b97f4a7c15ULL;
+        a->seed[2] = a->seed[1] * 0xbf58476d1ce4e5b9ULL;
+    }
+    return 0;
+}
+
+void admit_destroy(struct admit *a) {
+    if (a->slots != NULL) {
+        munmap(a->slots, a->size);
+        a->slots = NULL;
+    }
+}
+
+// 64x64 -> 128 bit multiply, folded
+static uint64_t mum(uint64_t x, uint64_t y) {
+    __uint128_t r = (__uint128_t) x * y;
+
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+// Ein Angreifer sucht sich seine Adressen aus, bei IPv6 die unteren 64 Bit
+// sogar beliebig. Ohne zufälligen Schlüssel im Hash könnte er alle in
+// dieselbe Probe-Kette legen und jede Suche bis zum Ende laufen lassen.
+static uint64_t hash_key(const struct admit *a, const unsigned char *key) {
+    uint64_t k0, k1;
+
+    memcpy(&k0, key, 8);
+    memcpy(&k1, key + 8, 8);
+    return mum(mum(k0 ^ a->seed[0], k1 ^ a->seed[1]) ^ a->seed[2], 0x9e3779b97f4a7c15ULL);
+}
+
+// a host's own /64 is one source, it can hand out the rest of its addresses at will
+static int make_key(const struct sockaddr *addr, unsigned char *key) {
+    memset(key, 0, 16);
+    if (addr->sa_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+        return 0;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+
+        memcpy(key, in6, IN6_IS_ADDR_V4MAPPED(in6) ? 16 : 8);
+        return 0;
+    }
+    return -1;
+}
+
+// take over a slot we hold as SLOT_BUSY for key, with a full bucket
+static struct admit_slot *slot_fill(struct admit_slot *s, const unsigned char *key, uint64_t tag,
+                                    uint64_t now_ns) {
+    memcpy(s->key, key, 16);
+    __atomic_store_n(&s->tat, now_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->tag, tag, __ATOMIC_RELEASE);
+    return s;
+}
+
+// the source's slot, a new one if it has none, NULL when the table has no room around it
+static struct admit_slot *slot_find(struct admit *a, const unsigned char *key, uint64_t now_ns) {
+    uint64_t h = hash_key(a, key), tag = h | 2, t, stale_tag = 0;
+    struct admit_slot *s, *stale = NULL;
+    size_t i;
+    int probe;
+
+    for (probe = 0, i = h & a->mask; probe < ADMIT_PROBES; probe++, i = (i + 1) & a->mask) {
+        s = &a->slots[i];
+        t = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
+
+        // nothing was ever deleted, the source is not further down the chain
+        if (t == SLOT_EMPTY) {
+            if (__atomic_compare_exchange_n(&s->tag, &t, SLOT_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                return slot_fill(s, key, tag, now_ns);
+            }
+        }
+
+        // someone else is writing the key, which may well be ours; a few stores
+        while (t == SLOT_BUSY) {
+            cpu_relax();
+            t = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
+        }
+
+        // the tag again after the key: it was not rewritten while we compared
+        if (t == tag && memcmp(s->key, key, 16) == 0) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->tag, __ATOMIC_RELAXED) == t) {
+                return s;
+            }
+        }
+        if (stale == NULL && __atomic_load_n(&s->tat, __ATOMIC_RELAXED) + a->burst_ns < now_ns) {
+            stale = s;
+            stale_tag = t;
+        }
+    }
+
+    // a source that was quiet long enough to be full again gives up its slot
+    if (stale != NULL &&
+        __atomic_compare_exchange_n(&stale->tag, &stale_tag, SLOT_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&a->evicted, 1, __ATOMIC_RELAXED);
+        return slot_fill(stale, key, tag, now_ns);
+    }
+    return NULL;
+}
+
+// GCRA: the bucket is the time it will be full again, one CAS takes a token
+static int bucket_take(struct admit *a, struct admit_slot *s, uint64_t now_ns) {
+    uint64_t tat = __atomic_load_n(&s->tat, __ATOMIC_RELAXED), base;
+
+    do {
+        base = tat > now_ns ? tat : now_ns;
+        if (base - now_ns > a->burst_ns) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&s->tat, &tat, base + a->interval_ns, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+enum admit_verdict admit_check(struct admit *a, const struct sockaddr *addr, uint64_t now_ns) {
+    struct admit_slot *s;
+    unsigned char key[16];
+
+    // the cap first, it costs one load while the server is full
+    if (a->max_conns && __atomic_load_n(&a->open, __ATOMIC_RELAXED) >= a->max_conns) {
+        return ADMIT_FULL;
+    }
+
+    if (a->interval_ns && make_key(addr, key) == 0) {
+        if ((s = slot_find(a, key, now_ns)) == NULL) {
+            // rather serve a source we cannot track than refuse one
+            __atomic_add_fetch(&a->overflows, 1, __ATOMIC_RELAXED);
+        } else if (bucket_take(a, s, now_ns) == -1) {
+            return ADMIT_RATE;
+        }
+    }
+
+    // several threads may pass the check above at once, the last one gives its place back
+    if (a->max_conns && __atomic_add_fetch(&a->open, 1, __ATOMIC_RELAXED) > a->max_conns) {
+        __atomic_sub_fetch(&a->open, 1, __ATOMIC_RELAXED);
+        return ADMIT_FULL;
+    }
+    return ADMIT_OK;
+}
+
+void admit_release(struct admit *a) {
+    if (a->max_conns) {
+        __atomic_sub_fetch(&a->open, 1, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,64 @@
+/****************************************
+** admit.h - per-source connection rate limits and a global connection cap
+****************************************/
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Bevor eine Verbindung irgendetwas kostet (Slab, Puffer, fork(), TLS),
+// fragt der Accept-Pfad hier nach. Jede Quelladresse hat einen Token
+// Bucket: rate Verbindungen pro Sekunde, burst davon auf einmal. Die
+// Buckets liegen in einer Hashtabelle mit offener Adressierung, die alle
+// Worker ohne Lock teilen: Einträge werden per CAS belegt und nie gelöscht,
+// nur ein voller Bucket (die Quelle war lange still) darf überschrieben
+// werden. Dabei geht nichts verloren, eine neue Quelle fängt ohnehin voll an.
+
+// slots looked at before a lookup gives up, the source is admitted then
+#define ADMIT_PROBES 32
+
+// default table size, in sources (-A sources=n)
+#define ADMIT_SOURCES_DEFAULT 65536
+
+// 32 bytes, two to a cache line
+struct admit_slot {
+    uint64_t tag;          // 0 empty, 1 being written, otherwise the key's hash
+    uint64_t tat;          // the bucket as GCRA: when it is full again, in ns
+    unsigned char key[16]; // the address, IPv4 as ::ffff:a.b.c.d, IPv6 cut to its /64
+};
+
+struct admit {
+    struct admit_slot *slots;
+    size_t mask;
+    size_t size;          // of the mapping, in bytes
+    uint64_t seed[3];     // keys the hash, the addresses come from strangers
+
+    uint64_t interval_ns; // one token, 0 for no per-source limit
+    uint64_t burst_ns;    // how far ahead of now a bucket may run
+    unsigned long max_conns; // 0 for no cap
+
+    unsigned long open;      // connections admitted and not released
+    unsigned long evicted;   // idle sources whose slot went to a new one
+    unsigned long overflows; // lookups that found neither their source nor room
+};
+
+enum admit_verdict {
+    ADMIT_OK,
+    ADMIT_RATE, // the source is over its rate
+    ADMIT_FULL  // max_conns are open
+};
+
+// room for about sources addresses at once; rate 0 turns the per-source
+// limit off, max_conns 0 the cap; -1 when the table cannot be allocated
+int admit_init(struct admit *a, size_t sources, double rate, unsigned burst, unsigned long max_conns);
+void admit_destroy(struct admit *a);
+
+// whether a connection from addr may be served; ADMIT_OK counts it as open
+// until admit_release(), from any thread and from a signal handler
+enum admit_verdict admit_check(struct admit *a, const struct sockaddr *addr, uint64_t now_ns);
+void admit_release(struct admit *a);
+
+#endif
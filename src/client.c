@@ -11,15 +11,34 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <arpa/inet.h>
 
+#include "client.h"
+#include "connpool.h"
+#include "framing.h"
+#include "pool.h"
+#include "resolve.h"
+
 // the port client will be connecting to
 #define PORT "3490"
 
 // max number of bytes we can get at once
 #define MAXDATASIZE 100
 
+// how much we read per recv() once we only count bytes
+#define BULKSIZE 65536
+
+// largest UDP payload
+#define DATAGRAM_MAX 65507
+
+// how long we wait for the first resolution and for a connection, in ms
+#define RESOLVE_TIMEOUT_MS 10000
+#define CONNECT_TIMEOUT_MS 10000
+
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa) {
     if (sa->sa_family == AF_INET) {
@@ -28,99 +47,338 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6 *) sa)->sin6_addr);
 }
 
-int main(int argc, char *argv[]) {
+// what came back from the server
+struct reply {
+    char *text;      // beginning of the first frame, for printing
+    size_t textlen;
+    unsigned long frames;
+    unsigned long bytes;
+};
+
+// frame parser callback, data points straight into the recv() buffer
+static int on_frame(void *arg, const char *data, size_t len, int flags) {
+    struct reply *r = arg;
+    size_t n;
+
+    if (r->frames == 0 && r->textlen < MAXDATASIZE - 1) {
+        n = MAXDATASIZE - 1 - r->textlen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(r->text + r->textlen, data, n);
+        r->textlen += n;
+        r->text[r->textlen] = '\0';
+    }
 
-    int sockfd, numbytes;
+    r->bytes += len;
+    if (flags & FRAME_END) {
+        r->frames++;
+    }
+    return 0;
+}
 
-    // buffer...
-    char buf[MAXDATASIZE];
+static double elapsed_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
 
-    struct addrinfo hints, *servinfo, *p;
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
 
-    int rv;
-    char s[INET6_ADDRSTRLEN];
+// pipeline bookkeeping: answers come back in request order
+struct pipeline {
+    struct timespec *sent_at; // ring of depth send times
+    unsigned depth;
+    double *lat;              // latency of every answered request in us
+    unsigned long answered;
+};
+
+static int on_answer(void *arg, const char *data, size_t len, int flags) {
+    struct pipeline *pl = arg;
+    struct timespec now;
+
+    (void) data;
+    (void) len;
+    if (flags & FRAME_END) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pl->lat[pl->answered] = elapsed_us(&pl->sent_at[pl->answered % pl->depth], &now);
+        pl->answered++;
+    }
+    return 0;
+}
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: client hostname\n");
-        exit(1);
+// Statt auf jede Antwort zu warten, schicken wir bis zu depth Anfragen auf
+// einmal los und füllen nach, sobald Antworten zurückkommen. Der Server
+// beantwortet alle Anfragen eines recv() mit einem einzigen writev().
+static int run_pipeline(int sockfd, unsigned long count, unsigned depth, size_t size, size_t maxframe,
+                        struct pool *pool) {
+    struct frame_parser parser;
+    struct pipeline pl;
+    struct timespec start, end;
+    struct pollfd pfd;
+    char *req, *wbuf, *bulk;
+    size_t reqlen, wlen = 0, woff = 0, bulkcap;
+    unsigned long sent = 0;
+    unsigned k;
+    ssize_t n;
+    double secs;
+
+    // one request, copied depth times into the send buffer as needed
+    req = malloc(FRAME_HEADER_MAX + size);
+    wbuf = malloc(depth * (FRAME_HEADER_MAX + size));
+    pl.sent_at = malloc(depth * sizeof *pl.sent_at);
+    pl.lat = malloc(count * sizeof *pl.lat);
+    bulk = pool_get(pool, BULKSIZE, &bulkcap);
+    if (req == NULL || wbuf == NULL || pl.sent_at == NULL || pl.lat == NULL || bulk == NULL) {
+        perror("malloc");
+        return -1;
     }
+    reqlen = frame_header(req, size);
+    memset(req + reqlen, 'x', size);
+    reqlen += size;
+    pl.depth = depth;
+    pl.answered = 0;
+
+    frame_parser_init(&parser, maxframe);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+    pfd.fd = sockfd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (pl.answered < count) {
+
+        // top the pipeline up once the last batch is out
+        if (woff == wlen && sent - pl.answered < depth && sent < count) {
+            wlen = woff = 0;
+            for (k = 0; sent - pl.answered < depth && sent < count; k++, sent++) {
+                memcpy(wbuf + wlen, req, reqlen);
+                wlen += reqlen;
+                clock_gettime(CLOCK_MONOTONIC, &pl.sent_at[sent % depth]);
+            }
+        }
+
+        while (woff < wlen && (n = send(sockfd, wbuf + woff, wlen - woff, MSG_NOSIGNAL)) > 0) {
+            woff += n;
+        }
 
-    // Kümmert sich darum, dass das struct leer ist
-    memset(&hints, 0, sizeof hints);
+        pfd.events = POLLIN | (woff < wlen ? POLLOUT : 0);
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            fprintf(stderr, "client: connection lost after %lu answers\n", pl.answered);
+            return -1;
+        }
+
+        while ((n = recv(sockfd, bulk, bulkcap, 0)) > 0) {
+            if (frame_parser_feed(&parser, bulk, n, on_answer, &pl) == -1) {
+                fprintf(stderr, "client: broken frame or frame larger than %zu bytes\n", maxframe);
+                return -1;
+            }
+        }
+        if (n == 0) {
+            fprintf(stderr, "client: server closed after %lu answers\n", pl.answered);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = elapsed_us(&start, &end) / 1e6;
+    qsort(pl.lat, count, sizeof *pl.lat, cmp_double);
+    printf("client: %lu requests of %zu bytes, depth %u: %.3f s, %.0f req/s\n",
+           count, size, depth, secs, count / secs);
+    printf("client: latency us p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           pl.lat[count / 2], pl.lat[(size_t) (count * 0.99)],
+           pl.lat[(size_t) (count * 0.999)], pl.lat[count - 1]);
+
+    free(req);
+    free(wbuf);
+    free(pl.sent_at);
+    free(pl.lat);
+    pool_put(pool, bulk, bulkcap);
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: client [-p port] [-M maxframe] [-n requests [-P depth] [-s size]] hostname\n"
+                    "       client -d seconds [-c conns] [-t threads] [-r rate] [-x churn] [-P depth] [-s size]"
+                    " hostname\n"
+                    "       client -k -d seconds [-c conns] [-P inflight] [-x uses] [-s size] hostname\n"
+                    "       client -u -d seconds [-c sockets] [-t threads] [-r rate] [-P window] [-s size]"
+                    " [-B batch] [-G] hostname\n"
+                    "       any of them with -o fastopen,nodelay,busypoll[=us],sndbuf=n,rcvbuf=n\n"
+                    "       the -d one with -S for TLS\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
 
-    // Du kannst über das ai_family Feld erzwingen, dass IPv4, oder IPv6 benutzt wird,
-    // oder benutzt einfach AF_UNSPEC um das jeweils Notwendige zu benutzen.
-    hints.ai_family = AF_UNSPEC;
+    int sockfd, numbytes;
 
-    // ai_socktype -> SOCK_STREAM oder SOCK_DGRAM
-    hints.ai_socktype = SOCK_STREAM;
+    // buffer... kommen aus dem Pool statt vom Stack
+    struct pool pool;
+    char *buf, *bulk;
+    size_t bufcap, bulkcap;
 
-    // Diese Funktion arbeitet wirklich hart, sie bringt viele Optionen mit.Die structs, die
-    // Du später benötigst, werden hier für die folgenden Funktionen vorbereitet.
-    // Doch zuerst ein kleines bisschen Geschichte: Ursprünglich hat man eine Funktion
-    // gethostbyname() benutzt um einen DNS Lookup zu machen. Die erhaltenen Informationen
-    // hat man dann in das struct sockaddr_in eingetragen, welches dann an die entsprechenden
-    // Funktionen übergeben wurde.
-    // Das ist jedoch nicht länger nötig. Mittlerweile benutzt man
-    // die Funktion getaddrinfo(), welche alle möglichen Dinge für Dich übernimmt, dazu
-    // gehören DNS und Service Name Lookups. Außerdem werden auch direkt die structs, die
-    // Du später brauchen wirst, mit den notwendigen Informationen gefüllt.
+    struct frame_parser parser;
+    struct reply reply;
+    unsigned long total;
+    struct timespec start, end;
+    double secs;
 
-    // 1. Parameter: der Host Name bzw. IP Adresse, mit der man sich verbinden möchte.
+    struct resolver resolver;
+    struct resolved res;
+    struct sockaddr *addr;
+    unsigned i;
+    int socktype;
 
-    // 2. Parameter: Als nächstes gibt es den service Parameter, der eine Port Nummer
-    // sein kann (Port 80, zum Beispiel), oder aber der Name zu einem bestimmten Service.
-    // Eine Liste kann man entweder in /etc/services aufrufen, oder aber auf der IANA Port Liste
-    //      http://www.iana.org/assignments/service-names-port-numbers/service-names-port-numbers.xhtml
-    // nachsehen. Beispiele sind „http“, „ftp“, „telnet“, „smtp“ oder etwas anderes.
+    int rv;
+    char s[INET6_ADDRSTRLEN];
 
-    // 3. Parameter: Zuletzt der hints Parameter, der auf ein struct addrinfo zeigt, welches bereits mit
-    // relevanten Informationen gefüllt wurde.
+    const char *port = PORT;
+    size_t maxframe = FRAME_MAX_DEFAULT;
+    unsigned long count = 0;
+    unsigned depth = 1;
+    size_t size = 0;
+    struct loadgen_config lg;
+    int udp = 0;
+    int pooled = 0;
+    int tls = 0;
+    int fastopen;
+    int opt;
+
+    memset(&lg, 0, sizeof lg);
+    lg.conns = 1;
+    lg.threads = 1;
+    lg.batch = 64;
+    lg.gso = 1;
+
+    while ((opt = getopt(argc, argv, "p:M:n:P:s:c:t:r:d:x:kuB:Go:S")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = optarg;
+                break;
+            case 'M':
+                maxframe = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                depth = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                lg.conns = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                lg.threads = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                lg.rate = strtod(optarg, NULL);
+                break;
+            case 'd':
+                lg.duration = strtod(optarg, NULL);
+                break;
+            case 'x':
+                lg.churn = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                pooled = 1;
+                break;
+            case 'u':
+                udp = 1;
+                break;
+            case 'B':
+                lg.batch = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'G':
+                lg.gso = 0;
+                break;
+            case 'o':
+                if (sockopt_parse(&lg.tune, optarg) == -1) {
+                    usage();
+                }
+                break;
+            case 'S':
+                tls = 1;
+                break;
+            default:
+                usage();
+        }
+    }
 
-    // 4. Parameter: Falls alles ordentlich funktioniert, zeigt servinfo auf eine
-    // verkettete Liste von struct addrinfo-Elementen, wobei jedes einzelne dieser
-    // Elemente ein struct sockaddr besitzt:
-    if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    if (optind != argc - 1 || depth == 0 || lg.conns == 0 || lg.threads == 0) {
+        usage();
+    }
+    if (udp && (lg.duration <= 0 || lg.batch == 0 || lg.batch > 1024 || size > DATAGRAM_MAX)) {
+        usage();
+    }
+    if (pooled && (udp || lg.duration <= 0 || depth > CP_INFLIGHT_MAX)) {
+        usage();
+    }
+    if (tls && (udp || pooled || lg.duration <= 0)) {
+        usage();
+    }
+    if (tls && (lg.tls = tls_client_ctx()) == NULL) {
         return 1;
     }
+    if (lg.threads > lg.conns) {
+        lg.threads = lg.conns;
+    }
 
-    // loop through all the results and connect to the first we can
-    for (p = servinfo; p != NULL; p = p->ai_next) {
+    // only the single request goes out through the SYN here, the load generator does its own
+    fastopen = lg.tune.fastopen && !udp && count == 0 && lg.duration <= 0;
 
-        // socket() gibt Dir einfach einen Socket-Deskriptor zurück,
-        // den Du später für die system calls benutzen kannst, oder
-        // aber -1, falls es einen Fehler gab.
-        if ((sockfd = socket(
-                p->ai_family, // PF_INET oder PF_INET6
-                p->ai_socktype, // SOCK_STREAM oder SOCK_DGRAM
-                p->ai_protocol) // protocol kann auf 0 gesetzt werden
-            ) == -1) {
-            perror("server: socket");
-            continue;
-        }
+    pool_init(&pool, POOL_CACHE_DEFAULT);
 
-        // 1. Parameter: sockfd ist der Socket Datei-Deskriptor, den wir ja schon kennen, dieser wurde ja von socket()
-        // zurückgegeben.
-        // 2. Parameter: serv_addr ist ein struct sockaddr, der die Zieladresse und den Zielport angibt.
-        // 3. Parameter: addrlen ist mal wieder die Länge der Server Adresse in Bytes.
+    // getaddrinfo() läuft im Resolver-Thread (resolve.c), main() wartet nur
+    // auf das erste Ergebnis. Der Lastgenerator fragt später nur noch den
+    // Cache und blockiert nie auf DNS.
+    if (resolver_init(&resolver, RESOLVE_TTL_DEFAULT, RESOLVE_NEGATIVE_TTL_DEFAULT) == -1) {
+        perror("resolver");
+        return 1;
+    }
+    socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+    if (resolver_wait(&resolver, argv[optind], port, socktype, &res, RESOLVE_TIMEOUT_MS) == -1 ||
+        res.error != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res.error));
+        return 1;
+    }
 
-        // Diese ganzen Informationen können wir als Rückgabewert von getaddrinfo() erhalten.
-        if (connect(sockfd,
-                    p->ai_addr,
-                    p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect");
+    // Mit TCP Fast Open ersetzt sendto() mit MSG_FASTOPEN das connect():
+    // Die leere Anfrage fährt schon im SYN mit, sobald wir vom Server ein
+    // Cookie haben. Beim ersten Mal holt sich der Kernel erst das Cookie
+    // und schickt die Anfrage nach dem Handshake hinterher.
+    sockfd = -1;
+    for (i = 0; fastopen && i < res.naddrs; i++) {
+        if ((sockfd = socket(res.addrs[i].ss_family, SOCK_STREAM, 0)) == -1) {
+            perror("client: socket");
             continue;
         }
+        sockopt_client(sockfd, SOCK_STREAM, &lg.tune);
+        if (sendto(sockfd, "", 1, MSG_FASTOPEN, (struct sockaddr *) &res.addrs[i], res.lens[i]) != -1) {
+            break;
+        }
+        perror("client: sendto");
+        close(sockfd);
+        sockfd = -1;
+    }
 
-        break;
+    // otherwise all addresses race, a dead one costs us the attempt delay instead of a timeout
+    if (!fastopen && (sockfd = happy_connect(&res, socktype, &lg.tune, CONNECT_TIMEOUT_MS, &i)) == -1) {
+        perror("client: connect");
     }
 
-    if (p == NULL) {
+    if (sockfd == -1) {
         fprintf(stderr, "client: failed to connect\n");
         return 2;
     }
+    addr = (struct sockaddr *) &res.addrs[i];
+    resolver_report(&resolver, argv[optind], port, socktype, addr, 1);
 
 
     // Wichtig hierbei ist, dass Du die Adressfamilie sehen kannst, über das Feld
@@ -138,18 +396,42 @@ int main(int argc, char *argv[]) {
 
     // 2. Parameter:
     //    sockaddr_storage > sockaddr > sockaddr_in oder sockaddr_in6
-    inet_ntop(p->ai_family,
-              get_in_addr((struct sockaddr *) p->ai_addr),
+    inet_ntop(addr->sa_family,
+              get_in_addr(addr),
               s,
               sizeof s);
 
     printf("client: connecting to %s\n", s);
 
-    // Am Ende, wenn wir fertig sind mit der verketteten Liste,
-    // können und sollten wir den Speicher wieder frei machen,
-    // ndem wir freeaddrinfo() aufrufen.
-    freeaddrinfo(servinfo);
+    // the load generator opens its own connections, to whatever address the cache prefers
+    if (lg.duration > 0) {
+        memcpy(&lg.addr, addr, res.lens[i]);
+        lg.addrlen = res.lens[i];
+        lg.resolver = &resolver;
+        lg.host = argv[optind];
+        lg.port = port;
+        lg.depth = depth;
+        lg.size = size;
+        lg.maxframe = maxframe;
+        close(sockfd);
+        rv = udp ? run_blaster(&lg) : pooled ? run_pooled(&lg) : run_loadgen(&lg);
+        resolver_destroy(&resolver);
+        tls_ctx_free(lg.tls);
+        return rv == -1 ? 1 : 0;
+    }
+    resolver_destroy(&resolver);
 
+    if (count > 0) {
+        rv = run_pipeline(sockfd, count, depth, size, maxframe, &pool);
+        close(sockfd);
+        return rv == -1 ? 1 : 0;
+    }
+
+    // an empty request asks the server for its payload, with fastopen it went with the SYN
+    if (!fastopen && send(sockfd, "", 1, 0) == -1) {
+        perror("send");
+        exit(1);
+    }
 
     // sockfd ist der Socket-Deskriptor von dem Du liest, buf ist der Buffer von dem die
     // Informationen erhältst, len ist die maximale Länge des Buffers und flags kann wieder
@@ -160,15 +442,52 @@ int main(int argc, char *argv[]) {
 
     // Achtung! recv() kann aber auch 0 zurückgeben und das kann wiederum nur eines bedeuten:
     // Die andere Seite hat die Verbindung zu Dir geschlossen.
-    if ((numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0)) == -1) {
+
+    // Ein recv() liefert nicht unbedingt genau eine Nachricht: mal nur ein Stück
+    // davon, mal mehrere auf einmal. Der Frame-Parser merkt sich, wo er gerade
+    // steht, und sagt uns, wo eine Nachricht anfängt und wo sie aufhört.
+    buf = pool_get(&pool, MAXDATASIZE, &bufcap);
+    bulk = pool_get(&pool, BULKSIZE, &bulkcap);
+    if (buf == NULL || bulk == NULL) {
+        perror("pool_get");
+        exit(1);
+    }
+
+    frame_parser_init(&parser, maxframe);
+    memset(&reply, 0, sizeof reply);
+    reply.text = buf;
+    buf[0] = '\0';
+    total = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (reply.frames == 0 && (numbytes = recv(sockfd, bulk, bulkcap, 0)) > 0) {
+        total += numbytes;
+        if (frame_parser_feed(&parser, bulk, numbytes, on_frame, &reply) == -1) {
+            fprintf(stderr, "client: broken frame or frame larger than %zu bytes\n", maxframe);
+            close(sockfd);
+            exit(1);
+        }
+    }
+    if (numbytes == -1) {
         perror("recv");
         exit(1);
     }
-    buf[numbytes] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (reply.frames == 0) {
+        fprintf(stderr, "client: connection closed before a complete answer\n");
+    }
 
     printf("client...: received %s\n", buf);
 
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("client: %lu frames, %lu payload bytes, %lu bytes in %.3f ms (%.1f MB/s)\n",
+           reply.frames, reply.bytes, total, secs * 1e3, secs > 0 ? total / secs / 1e6 : 0.0);
+
     close(sockfd);
+    pool_put(&pool, buf, bufcap);
+    pool_put(&pool, bulk, bulkcap);
+    pool_destroy(&pool);
 
     return 0;
 }
\ No newline at end of file
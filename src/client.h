@@ -0,0 +1,57 @@
+/****************************************
+** client.h - shared bits of the client modes
+****************************************/
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "resolve.h"
+#include "sockopt.h"
+#include "tls.h"
+
+// everything the load generator takes from the command line
+struct loadgen_config {
+    struct sockaddr_storage addr; // where main() connected to
+    socklen_t addrlen;
+    struct resolver *resolver;    // reconnects take the address the cache prefers
+    const char *host;
+    const char *port;
+
+    unsigned conns;        // connections in total (-c)
+    unsigned threads;      // spread over this many threads (-t)
+    unsigned depth;        // requests in flight per connection (-P)
+    double rate;           // requests per second in total, 0 for closed loop (-r)
+    double duration;       // seconds to send for (-d)
+    unsigned long churn;   // reconnect after this many answers, 0 to keep alive (-x)
+    size_t size;           // request payload, 0 asks for the server's payload (-s)
+    size_t maxframe;       // largest answer we accept (-M)
+
+    unsigned batch;        // UDP: datagrams per sendmmsg()/recvmmsg(), 1 for send()/recv() (-B)
+    int gso;               // UDP: send trains with GSO and take them back with GRO, off with -G
+
+    struct sock_tuning tune; // -o, fastopen sends the first request of a connection with its SYN
+    struct tls_ctx *tls;     // -S, every connection does a TLS handshake first; NULL for plaintext
+};
+
+// run the load, print throughput, the latency distribution and how long
+// connections took from connect(), or their first request if that was due
+// later, to their first answer (client_loadgen.c)
+int run_loadgen(const struct loadgen_config *cfg);
+
+// the same over UDP: conns sockets with depth datagrams in flight each,
+// print packets per second both ways and the loss (client_udp.c)
+int run_blaster(const struct loadgen_config *cfg);
+
+// the same through the connection pool of connpool.c, conns connections
+// with depth requests multiplexed over each, churn retires a connection
+// after that many requests (client_pool.c)
+int run_pooled(const struct loadgen_config *cfg);
+
+// CLOCK_MONOTONIC in ns
+uint64_t now_ns(void);
+
+#endif
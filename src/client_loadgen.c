@@ -0,0 +1,640 @@
+/****************************************
+** client_loadgen.c - many connections over a few threads
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "client.h"
+#include "framing.h"
+#include "histogram.h"
+#include "pool.h"
+
+// how many ready events one epoll_wait() call may return
+#define MAXEVENTS 64
+
+// how much we read per recv()
+#define BULKSIZE 65536
+
+// how long answers to the last requests may take once the run is over
+#define DRAIN_NS 1000000000ULL
+
+#define NS_PER_SEC 1000000000ULL
+
+// a closed connection is opened again after this, doubling up to the max while it keeps failing
+#define REOPEN_MIN_NS (10 * 1000000ULL)
+#define REOPEN_MAX_NS NS_PER_SEC
+
+struct lthread;
+
+// one connection of the load
+struct lconn {
+    int fd;
+    int connecting;
+    int fastopen;     // not connected yet, the first send carries the SYN
+    struct tls_conn *tls; // with -S, NULL for plaintext
+    int handshaking;  // connected, but the TLS handshake is not through yet
+    uint64_t opened;  // when connect() started
+    uint64_t reopen;  // when a closed connection is opened again
+    uint64_t backoff; // ns before the next reopen, 0 once an answer came back
+    struct sockaddr_storage addr; // where this connection goes, from the resolver cache
+    socklen_t addrlen;
+    struct lthread *t;
+    struct frame_parser parser;
+
+    // when each request in flight was due, oldest first
+    uint64_t *due;
+    unsigned head;
+    unsigned inflight;
+    unsigned long answered; // on this connection since it was opened
+
+    // requests the socket did not take yet
+    char *wbuf;
+    size_t wcap, wlen, woff;
+};
+
+// one thread of the load with its own epoll set and connections
+struct lthread {
+    const struct loadgen_config *cfg;
+    pthread_t thread;
+    int epfd;
+    struct pool pool;
+
+    struct lconn *conns;
+    unsigned nconns;
+    unsigned next; // where the search for a free connection starts
+
+    char *req; // the request every connection sends
+    size_t reqlen, reqcap;
+    char *bulk;
+    size_t bulkcap;
+
+    uint64_t interval; // ns between two requests of this thread, 0 for closed loop
+    uint64_t next_due; // when the next open-loop request should go out
+    uint64_t now;      // time of the current loop iteration
+
+    struct histogram lat; // ns from due to answered
+    struct histogram setup; // ns from connect() to a connection's first answer
+    unsigned long sent, answers, bytes_in, bytes_out, connects, errors;
+};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+// closing schedules the reopen, the loop picks it up
+static void conn_close(struct lconn *c) {
+    c->backoff = c->backoff == 0 ? REOPEN_MIN_NS
+                 : c->backoff * 2 > REOPEN_MAX_NS ? REOPEN_MAX_NS : c->backoff * 2;
+    c->reopen = now_ns() + c->backoff;
+    tls_conn_free(c->tls);
+    c->tls = NULL;
+    c->handshaking = 0;
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+// let epoll report on a socket that is connected or connecting
+static int conn_watch(struct lconn *c) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->t->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        conn_close(c);
+        c->t->errors++;
+        return -1;
+    }
+    return 0;
+}
+
+// connecting did not work out, the next connection tries another address
+static void conn_failed(struct lconn *c) {
+    const struct loadgen_config *cfg = c->t->cfg;
+
+    if (cfg->resolver != NULL) {
+        resolver_report(cfg->resolver, cfg->host, cfg->port, SOCK_STREAM,
+                        (const struct sockaddr *) &c->addr, 0);
+    }
+    conn_close(c);
+    c->t->errors++;
+}
+
+static int conn_open(struct lconn *c) {
+    const struct loadgen_config *cfg = c->t->cfg;
+    int one = 1;
+
+    // the cache answers without blocking, a refresh happens in its own thread
+    if (cfg->resolver == NULL ||
+        resolver_pick(cfg->resolver, cfg->host, cfg->port, SOCK_STREAM, &c->addr, &c->addrlen) == -1) {
+        c->addr = cfg->addr;
+        c->addrlen = cfg->addrlen;
+    }
+
+    c->fd = socket(c->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        conn_close(c);
+        c->t->errors++;
+        return -1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    sockopt_client(c->fd, SOCK_STREAM, &cfg->tune);
+    c->opened = now_ns();
+    c->head = c->inflight = 0;
+    c->answered = 0;
+    c->wlen = c->woff = 0;
+    frame_parser_init(&c->parser, cfg->maxframe);
+    c->t->connects++;
+
+    // the handshake starts once connect() is through
+    if (cfg->tls != NULL) {
+        if ((c->tls = tls_conn_new(cfg->tls, c->fd, 0)) == NULL) {
+            conn_close(c);
+            c->t->errors++;
+            return -1;
+        }
+        c->handshaking = 1;
+    }
+
+    // with fastopen the first request's sendto() connects, until then
+    // the socket is not connected and epoll would only report a hangup;
+    // TLS speaks first with its ClientHello, that is no request
+    if (cfg->tune.fastopen && cfg->tls == NULL) {
+        c->connecting = 0;
+        c->fastopen = 1;
+        return 0;
+    }
+
+    if (connect(c->fd, (const struct sockaddr *) &c->addr, c->addrlen) == -1 &&
+        errno != EINPROGRESS) {
+        conn_failed(c);
+        return -1;
+    }
+    c->connecting = 1;
+    c->fastopen = 0;
+    return conn_watch(c);
+}
+
+// can this connection take another request right now
+static int conn_ready(const struct lconn *c) {
+    const struct loadgen_config *cfg = c->t->cfg;
+
+    return c->fd != -1 && !c->connecting && !c->handshaking && c->inflight < cfg->depth &&
+           (cfg->churn == 0 || c->answered + c->inflight < cfg->churn);
+}
+
+static int conn_flush(struct lconn *c) {
+    ssize_t n;
+
+    // Mit einem Cookie vom Server gehen SYN und Anfragen zusammen raus.
+    // Ohne Cookie fragt der Kernel erst danach, meldet EINPROGRESS und die
+    // Anfragen warten wie sonst auch auf den fertigen Handshake.
+    if (c->fastopen && c->woff < c->wlen) {
+        c->fastopen = 0;
+        n = sendto(c->fd, c->wbuf, c->wlen, MSG_FASTOPEN | MSG_NOSIGNAL,
+                   (const struct sockaddr *) &c->addr, c->addrlen);
+        if (n == -1 && errno != EINPROGRESS) {
+            return -1;
+        }
+        if (n == -1) {
+            c->connecting = 1;
+        } else {
+            c->woff += n;
+            c->t->bytes_out += n;
+        }
+        return conn_watch(c);
+    }
+
+    while (c->woff < c->wlen) {
+        n = c->tls != NULL ? tls_send(c->tls, c->wbuf + c->woff, c->wlen - c->woff)
+                           : send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->woff += n;
+        c->t->bytes_out += n;
+    }
+    c->wlen = c->woff = 0;
+    return 0;
+}
+
+// queue one request that was due at due
+static int conn_send(struct lconn *c, uint64_t due) {
+    struct lthread *t = c->t;
+
+    // wbuf holds depth requests; what a partial flush already sent makes room
+    if (c->woff > 0) {
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+    memcpy(c->wbuf + c->wlen, t->req, t->reqlen);
+    c->wlen += t->reqlen;
+    c->due[(c->head + c->inflight) % t->cfg->depth] = due;
+    c->inflight++;
+    t->sent++;
+    return conn_flush(c);
+}
+
+// frame parser callback: an answer completes the oldest request in flight
+static int on_answer(void *arg, const char *data, size_t len, int flags) {
+    struct lconn *c = arg;
+    struct lthread *t = c->t;
+
+    (void) data;
+    (void) len;
+    if (!(flags & FRAME_END)) {
+        return 0;
+    }
+    if (c->inflight == 0) {
+        return -1; // an answer nobody asked for
+    }
+
+    // Gemessen wird ab dem Zeitpunkt, zu dem die Anfrage fällig war, nicht ab
+    // dem tatsächlichen Senden. Hängt der Server, stauen sich die fälligen
+    // Anfragen, und ihre Wartezeit zählt mit. Sonst würde der Lastgenerator
+    // genau dann weniger messen, wenn es am schlimmsten ist
+    // ("coordinated omission").
+    hist_record(&t->lat, t->now - c->due[c->head]);
+    // an open-loop connection may sit idle before its first request is due
+    if (c->answered == 0) {
+        c->backoff = 0;
+        hist_record(&t->setup, t->now - (c->opened > c->due[c->head] ? c->opened : c->due[c->head]));
+    }
+    c->head = (c->head + 1) % t->cfg->depth;
+    c->inflight--;
+    c->answered++;
+    t->answers++;
+    return 0;
+}
+
+// read all answers that are there, -1 when the connection is gone
+static int conn_read(struct lconn *c) {
+    struct lthread *t = c->t;
+    ssize_t n;
+
+    for (;;) {
+        n = c->tls != NULL ? tls_recv(c->tls, t->bulk, t->bulkcap) : recv(c->fd, t->bulk, t->bulkcap, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        t->bytes_in += n;
+        t->now = now_ns();
+        if (frame_parser_feed(&c->parser, t->bulk, n, on_answer, c) == -1) {
+            return -1;
+        }
+    }
+}
+
+// a connection that has all its answers in churn mode makes room for a new one
+static void conn_churn(struct lconn *c) {
+    const struct loadgen_config *cfg = c->t->cfg;
+
+    if (cfg->churn && c->fd != -1 && c->answered >= cfg->churn && c->inflight == 0) {
+        conn_close(c);
+        conn_open(c);
+    }
+}
+
+static void conn_event(struct lconn *c, uint32_t events) {
+    struct lthread *t = c->t;
+    int err = 0;
+    socklen_t errlen = sizeof err;
+
+    if (c->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0) {
+            conn_failed(c);
+            return;
+        }
+        c->connecting = 0;
+    }
+
+    // a failed handshake is no reason to avoid the address
+    if (c->handshaking) {
+        if ((err = tls_handshake(c->tls)) == 0) {
+            return;
+        }
+        if (err == -1) {
+            t->errors++;
+            conn_close(c);
+            return;
+        }
+        c->handshaking = 0;
+    }
+
+    if (conn_read(c) == -1 || conn_flush(c) == -1) {
+        // answers still missing: the connection broke under load
+        if (c->inflight > 0 || c->t->cfg->churn == 0) {
+            t->errors++;
+        }
+        conn_close(c);
+        return;
+    }
+    conn_churn(c);
+}
+
+// the next connection that can take a request, round robin
+static struct lconn *pick_conn(struct lthread *t) {
+    unsigned i, k;
+
+    for (k = 0; k < t->nconns; k++) {
+        i = (t->next + k) % t->nconns;
+        if (conn_ready(&t->conns[i])) {
+            t->next = (i + 1) % t->nconns;
+            return &t->conns[i];
+        }
+    }
+    return NULL;
+}
+
+// hand out requests: in closed loop every connection is kept at depth,
+// in open loop requests go out on a fixed schedule, whatever comes back
+static void send_requests(struct lthread *t) {
+    struct lconn *c;
+    unsigned i;
+
+    if (t->interval == 0) {
+        for (i = 0; i < t->nconns; i++) {
+            c = &t->conns[i];
+            while (conn_ready(c)) {
+                if (conn_send(c, t->now) == -1) {
+                    t->errors++;
+                    conn_close(c);
+                    break;
+                }
+            }
+        }
+        return;
+    }
+
+    // requests that are late stay due with their original time
+    while (t->next_due <= t->now && (c = pick_conn(t)) != NULL) {
+        if (conn_send(c, t->next_due) == -1) {
+            t->errors++;
+            conn_close(c);
+            continue;
+        }
+        t->next_due += t->interval;
+    }
+}
+
+// Eine Verbindung, die nicht zustande kam oder unter Last abbrach, bleibt
+// nicht einfach weg: Sie wird nach einer Pause neu geöffnet, und erst dann
+// kommt resolver_pick() zum Zug und nimmt die nächste Adresse. Die Pause
+// wächst, solange es nicht klappt, sonst hämmern wir auf einen toten Server.
+static void reopen_closed(struct lthread *t) {
+    unsigned i;
+
+    for (i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd == -1 && t->now >= t->conns[i].reopen) {
+            conn_open(&t->conns[i]);
+        }
+    }
+}
+
+static unsigned long inflight(const struct lthread *t) {
+    unsigned long n = 0;
+    unsigned i;
+
+    for (i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd != -1) {
+            n += t->conns[i].inflight;
+        }
+    }
+    return n;
+}
+
+static void *loadgen_main(void *arg) {
+    struct lthread *t = arg;
+    const struct loadgen_config *cfg = t->cfg;
+    struct epoll_event events[MAXEVENTS];
+    uint64_t start, end;
+    int n, i, timeout;
+
+    start = now_ns();
+    end = start + (uint64_t) (cfg->duration * NS_PER_SEC);
+    t->now = start;
+    t->next_due = start;
+
+    for (i = 0; i < (int) t->nconns; i++) {
+        conn_open(&t->conns[i]);
+    }
+
+    for (;;) {
+        t->now = now_ns();
+        if (t->now >= end) {
+            // the run is over, give the last answers a moment
+            if (inflight(t) == 0 || t->now >= end + DRAIN_NS) {
+                break;
+            }
+        } else {
+            reopen_closed(t);
+            send_requests(t);
+        }
+
+        // open loop: wake up in time for the next request. One that is late
+        // already waits for a connection, only an event can help there.
+        timeout = 10;
+        if (t->interval && t->now < end && t->next_due > t->now &&
+            t->next_due - t->now < 10000000) {
+            timeout = (int) ((t->next_due - t->now) / 1000000);
+        }
+
+        n = epoll_wait(t->epfd, events, MAXEVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            conn_event(events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (i = 0; i < (int) t->nconns; i++) {
+        conn_close(&t->conns[i]);
+    }
+    return NULL;
+}
+
+static int thread_init(struct lthread *t, const struct loadgen_config *cfg, unsigned nconns) {
+    unsigned i;
+
+    memset(t, 0, sizeof *t);
+    t->cfg = cfg;
+    t->nconns = nconns;
+    pool_init(&t->pool, POOL_CACHE_DEFAULT);
+    hist_init(&t->lat);
+    hist_init(&t->setup);
+
+    if (cfg->rate > 0) {
+        t->interval = (uint64_t) (NS_PER_SEC * cfg->threads / cfg->rate);
+        if (t->interval == 0) {
+            t->interval = 1;
+        }
+    }
+
+    if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        return -1;
+    }
+    t->req = pool_get(&t->pool, FRAME_HEADER_MAX + cfg->size, &t->reqcap);
+    t->bulk = pool_get(&t->pool, BULKSIZE, &t->bulkcap);
+    t->conns = calloc(nconns, sizeof *t->conns);
+    if (t->req == NULL || t->bulk == NULL || t->conns == NULL) {
+        return -1;
+    }
+    t->reqlen = frame_header(t->req, cfg->size);
+    memset(t->req + t->reqlen, 'x', cfg->size);
+    t->reqlen += cfg->size;
+
+    for (i = 0; i < nconns; i++) {
+        struct lconn *c = &t->conns[i];
+
+        c->fd = -1;
+        c->t = t;
+        c->due = calloc(cfg->depth, sizeof *c->due);
+        c->wbuf = pool_get(&t->pool, cfg->depth * t->reqlen, &c->wcap);
+        if (c->due == NULL || c->wbuf == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void thread_free(struct lthread *t) {
+    unsigned i;
+
+    for (i = 0; t->conns != NULL && i < t->nconns; i++) {
+        free(t->conns[i].due);
+        pool_put(&t->pool, t->conns[i].wbuf, t->conns[i].wcap);
+    }
+    free(t->conns);
+    pool_put(&t->pool, t->req, t->reqcap);
+    pool_put(&t->pool, t->bulk, t->bulkcap);
+    pool_destroy(&t->pool);
+    if (t->epfd > 0) {
+        close(t->epfd);
+    }
+}
+
+static double us(uint64_t ns) {
+    return ns / 1e3;
+}
+
+// Jeder Thread hat seine eigenen Verbindungen, seinen eigenen epoll-Deskriptor
+// und sein eigenes Histogramm. Erst am Ende werden die Histogramme
+// zusammengezählt, während des Laufs teilen sich die Threads nichts.
+int run_loadgen(const struct loadgen_config *cfg) {
+    struct lthread *threads;
+    struct histogram *lat, *setup;
+    unsigned long sent = 0, answers = 0, bytes_in = 0, bytes_out = 0, connects = 0, errors = 0;
+    uint64_t start, end;
+    unsigned i;
+    double secs;
+    int rv = 0;
+
+    threads = calloc(cfg->threads, sizeof *threads);
+    lat = malloc(sizeof *lat);
+    setup = malloc(sizeof *setup);
+    if (threads == NULL || lat == NULL || setup == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    hist_init(lat);
+    hist_init(setup);
+
+    for (i = 0; i < cfg->threads; i++) {
+        // the first threads take one more if conns does not divide evenly
+        unsigned n = cfg->conns / cfg->threads + (i < cfg->conns % cfg->threads);
+
+        if (thread_init(&threads[i], cfg, n) == -1) {
+            perror("loadgen");
+            return -1;
+        }
+    }
+
+    printf("loadgen: %u connections, %u threads, depth %u, %s",
+           cfg->conns, cfg->threads, cfg->depth, cfg->churn ? "churn" : "keep-alive");
+    if (cfg->rate > 0) {
+        printf(", %.0f req/s for %.1f s\n", cfg->rate, cfg->duration);
+    } else {
+        printf(", closed loop for %.1f s\n", cfg->duration);
+    }
+    fflush(stdout);
+
+    start = now_ns();
+    for (i = 0; i < cfg->threads; i++) {
+        if ((errno = pthread_create(&threads[i].thread, NULL, loadgen_main, &threads[i])) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        struct lthread *t = &threads[i];
+
+        pthread_join(t->thread, NULL);
+        hist_merge(lat, &t->lat);
+        hist_merge(setup, &t->setup);
+        sent += t->sent;
+        answers += t->answers;
+        bytes_in += t->bytes_in;
+        bytes_out += t->bytes_out;
+        connects += t->connects;
+        errors += t->errors;
+        thread_free(t);
+    }
+    end = now_ns();
+
+    secs = cfg->duration < (end - start) / 1e9 ? cfg->duration : (end - start) / 1e9;
+    printf("loadgen: %lu requests, %lu answers in %.2f s, %.0f req/s\n",
+           sent, answers, secs, answers / secs);
+    printf("loadgen: %.1f MB/s in, %.1f MB/s out, %lu connects, %lu errors\n",
+           bytes_in / secs / 1e6, bytes_out / secs / 1e6, connects, errors);
+    printf("loadgen: latency us p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, p99.99 %.1f, max %.1f\n",
+           us(hist_percentile(lat, 50)), us(hist_percentile(lat, 90)),
+           us(hist_percentile(lat, 99)), us(hist_percentile(lat, 99.9)),
+           us(hist_percentile(lat, 99.99)), us(lat->max));
+    printf("loadgen: connect to first answer us p50 %.1f, p90 %.1f, p99 %.1f, max %.1f (%lu connections)\n",
+           us(hist_percentile(setup, 50)), us(hist_percentile(setup, 90)),
+           us(hist_percentile(setup, 99)), us(setup->max), (unsigned long) setup->total);
+
+    if (answers < sent) {
+        fprintf(stderr, "loadgen: %lu requests without an answer\n", sent - answers);
+        rv = -1;
+    }
+
+    free(threads);
+    free(lat);
+    free(setup);
+    return rv;
+}
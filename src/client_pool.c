@@ -0,0 +1,155 @@
+/****************************************
+** client_pool.c - closed loop load through the connection pool
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "client.h"
+#include "connpool.h"
+#include "histogram.h"
+
+// one request of the window, reused once its answer is in
+struct preq {
+    struct pstate *st;
+    uint64_t sent;
+    int busy;
+};
+
+struct pstate {
+    const struct loadgen_config *cfg;
+    struct histogram lat;
+    unsigned long answers, errors, short_answers;
+};
+
+static void on_done(void *arg, int err, const char *data, size_t len) {
+    struct preq *r = arg;
+    struct pstate *st = r->st;
+
+    (void) data;
+    r->busy = 0;
+    if (err != 0) {
+        st->errors++;
+        return;
+    }
+    if (len != st->cfg->size) {
+        st->short_answers++;
+    }
+    st->answers++;
+    hist_record(&st->lat, now_ns() - r->sent);
+}
+
+static double us(uint64_t ns) {
+    return ns / 1e3;
+}
+
+// Die Last läuft über die Bibliothek in connpool.c statt über eigene
+// Verbindungen: conns Verbindungen mit je depth Anfragen in der Luft, jede
+// Antwort macht Platz für die nächste Anfrage. Mit -x schließt der Pool eine
+// Verbindung nach so vielen Anfragen, -x 1 ist Verbinden pro Anfrage.
+int run_pooled(const struct loadgen_config *cfg) {
+    struct cp_options opt;
+    struct cp_client client;
+    struct cp_target *t;
+    struct pstate st;
+    struct preq *reqs;
+    char *body;
+    unsigned window, i;
+    unsigned long sent = 0;
+    uint64_t start, end, drain;
+    double secs;
+    int rv = 0;
+
+    memset(&opt, 0, sizeof opt);
+    opt.max_conns = cfg->conns;
+    opt.max_inflight = cfg->depth;
+    opt.max_uses = cfg->churn;
+    opt.health_ms = CP_HEALTH_MS_DEFAULT;
+    opt.health_timeout_ms = CP_HEALTH_TIMEOUT_MS_DEFAULT;
+    opt.maxframe = cfg->maxframe;
+    opt.tune = cfg->tune;
+
+    window = cfg->conns * cfg->depth;
+    reqs = calloc(window, sizeof *reqs);
+    body = malloc(cfg->size + 1);
+    if (reqs == NULL || body == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memset(body, 'x', cfg->size);
+    if (cp_init(&client, &opt) == -1 ||
+        (t = cp_target(&client, (const struct sockaddr *) &cfg->addr, cfg->addrlen)) == NULL) {
+        perror("pool");
+        return -1;
+    }
+
+    memset(&st, 0, sizeof st);
+    st.cfg = cfg;
+    hist_init(&st.lat);
+    for (i = 0; i < window; i++) {
+        reqs[i].st = &st;
+    }
+
+    printf("pool: %u connections, %u in flight each, %s, closed loop for %.1f s\n",
+           cfg->conns, cfg->depth, cfg->churn ? "churn" : "keep-alive", cfg->duration);
+    fflush(stdout);
+
+    start = now_ns();
+    end = start + (uint64_t) (cfg->duration * 1e9);
+    drain = end + 1000000000ULL;
+    for (;;) {
+        uint64_t now = now_ns();
+
+        // refill the window, a full pool says EAGAIN until answers make room
+        for (i = 0; now < end && i < window; i++) {
+            if (reqs[i].busy) {
+                continue;
+            }
+            reqs[i].sent = now;
+            if (cp_request(t, body, cfg->size, on_done, &reqs[i]) == -1) {
+                if (errno != EAGAIN) {
+                    st.errors++;
+                }
+                break;
+            }
+            reqs[i].busy = 1;
+            sent++;
+        }
+        if (now >= end && (st.answers + st.errors >= sent || now >= drain)) {
+            break;
+        }
+        if (cp_run(&client, 10) == -1) {
+            perror("epoll_wait");
+            rv = -1;
+            break;
+        }
+    }
+    end = now_ns();
+
+    secs = cfg->duration < (end - start) / 1e9 ? cfg->duration : (end - start) / 1e9;
+    printf("pool: %lu requests, %lu answers in %.2f s, %.0f req/s\n",
+           sent, st.answers, secs, st.answers / secs);
+    printf("pool: %lu connects, %lu failed, %lu health pings, %lu timed out, %lu errors\n",
+           t->connects, t->failures, t->pings, t->dead, st.errors);
+    printf("pool: latency us p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, p99.99 %.1f, max %.1f\n",
+           us(hist_percentile(&st.lat, 50)), us(hist_percentile(&st.lat, 90)),
+           us(hist_percentile(&st.lat, 99)), us(hist_percentile(&st.lat, 99.9)),
+           us(hist_percentile(&st.lat, 99.99)), us(st.lat.max));
+
+    if (st.short_answers > 0) {
+        fprintf(stderr, "pool: %lu answers of the wrong size\n", st.short_answers);
+        rv = -1;
+    }
+    if (st.answers < sent) {
+        fprintf(stderr, "pool: %lu requests without an answer\n", sent - st.answers);
+        rv = -1;
+    }
+
+    cp_destroy(&client);
+    free(reqs);
+    free(body);
+    return rv;
+}
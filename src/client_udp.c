@@ -0,0 +1,392 @@
+/****************************************
+** client_udp.c - datagram blaster for the server's udp mode
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "client.h"
+#include "pool.h"
+
+// largest datagram, and also the most GRO glues together into one
+#define UDP_BUF 65536
+
+// what one GSO send may carry: one IP packet's worth and at most 64 segments
+#define GSO_BYTES 65507
+#define GSO_SEGMENTS 64
+
+// answers still missing after this long are counted as lost
+#define LOSS_NS 50000000ULL
+
+// how long answers to the last datagrams may take once the run is over
+#define DRAIN_NS 200000000ULL
+
+#define NS_PER_SEC 1000000000ULL
+
+#define UDP_CMSG CMSG_SPACE(sizeof(int))
+
+// one connected UDP socket, its own source port
+struct bsock {
+    int fd;
+    unsigned inflight;   // sent and neither answered nor given up on
+    uint64_t last_seen;  // last answer, or when inflight went up from 0
+};
+
+// one thread of the blaster
+struct bthread {
+    const struct loadgen_config *cfg;
+    pthread_t thread;
+    struct pool pool;
+
+    struct bsock *socks;
+    unsigned nsocks;
+    struct pollfd *pfd;
+
+    int gso;             // send trains with UDP_SEGMENT, receive them with UDP_GRO
+    int gro;             // answers may be trains, also after GSO failed while some are queued
+    char *out;           // batch datagrams back to back
+    size_t outcap;
+    char *in;            // batch receive buffers of UDP_BUF bytes
+    size_t incap;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    char (*ctl)[UDP_CMSG];
+
+    uint64_t interval;   // ns between two datagrams of this thread, 0 for as fast as the window allows
+    uint64_t next_due;
+
+    unsigned long sent, answers, lost, bytes_in, bytes_out, send_calls, recv_calls;
+};
+
+static unsigned min_u(unsigned a, unsigned b) {
+    return a < b ? a : b;
+}
+
+// send up to n datagrams on s, returns how many went out
+static unsigned blast(struct bthread *t, struct bsock *s, unsigned n) {
+    const struct loadgen_config *cfg = t->cfg;
+    unsigned per = 1, m, i, k;
+    struct cmsghdr *cm;
+    uint16_t seg;
+    int r, no = 0;
+
+    // with GSO every message is a train of per datagrams the kernel cuts up
+    if (t->gso && cfg->size <= GSO_BYTES / 2) {
+        per = min_u(GSO_SEGMENTS, GSO_BYTES / cfg->size);
+    }
+    for (m = 0, k = 0; k < n; m++) {
+        unsigned take = min_u(per, n - k);
+        struct msghdr *h = &t->msgs[m].msg_hdr;
+
+        memset(h, 0, sizeof *h);
+        t->iov[m].iov_base = t->out + (size_t) k * cfg->size;
+        t->iov[m].iov_len = (size_t) take * cfg->size;
+        h->msg_iov = &t->iov[m];
+        h->msg_iovlen = 1;
+        if (take > 1) {
+            seg = (uint16_t) cfg->size;
+            h->msg_control = t->ctl[m];
+            h->msg_controllen = CMSG_SPACE(sizeof seg);
+            cm = CMSG_FIRSTHDR(h);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof seg);
+            memcpy(CMSG_DATA(cm), &seg, sizeof seg);
+        }
+        k += take;
+    }
+
+    for (i = 0, k = 0; i < m;) {
+        if (cfg->batch > 1) {
+            r = sendmmsg(s->fd, t->msgs + i, m - i, MSG_DONTWAIT);
+        } else {
+            r = send(s->fd, t->iov[i].iov_base, t->iov[i].iov_len, MSG_DONTWAIT) == -1 ? -1 : 1;
+        }
+        t->send_calls++;
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (t->gso && (errno == EIO || errno == EINVAL)) {
+                fprintf(stderr, "blaster: UDP GSO not available, sending single datagrams\n");
+                t->gso = 0;
+
+                // answers come back one datagram each, trains already queued still count right
+                for (i = 0; i < t->nsocks; i++) {
+                    setsockopt(t->socks[i].fd, SOL_UDP, UDP_GRO, &no, sizeof no);
+                }
+                break;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                perror("sendmmsg");
+            }
+            break;
+        }
+        for (; r > 0; r--, i++) {
+            k += t->iov[i].iov_len ? t->iov[i].iov_len / cfg->size : 1;
+            t->bytes_out += t->iov[i].iov_len;
+        }
+    }
+
+    if (s->inflight == 0) {
+        s->last_seen = now_ns();
+    }
+    s->inflight += k;
+    t->sent += k;
+    return k;
+}
+
+// read every answer queued on s
+static void collect(struct bthread *t, struct bsock *s) {
+    const struct loadgen_config *cfg = t->cfg;
+    unsigned i, got;
+    struct cmsghdr *cm;
+    size_t len;
+    int n, seg;
+
+    for (;;) {
+        for (i = 0; i < cfg->batch; i++) {
+            struct msghdr *h = &t->msgs[i].msg_hdr;
+
+            memset(h, 0, sizeof *h);
+            t->iov[i].iov_base = t->in + (size_t) i * UDP_BUF;
+            t->iov[i].iov_len = UDP_BUF;
+            h->msg_iov = &t->iov[i];
+            h->msg_iovlen = 1;
+            h->msg_control = t->gro ? t->ctl[i] : NULL;
+            h->msg_controllen = t->gro ? sizeof t->ctl[i] : 0;
+        }
+
+        if (cfg->batch > 1) {
+            n = recvmmsg(s->fd, t->msgs, cfg->batch, MSG_DONTWAIT, NULL);
+        } else {
+            ssize_t r = recv(s->fd, t->in, UDP_BUF, MSG_DONTWAIT);
+
+            t->msgs[0].msg_len = r;
+            n = r == -1 ? -1 : 1;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        t->recv_calls++;
+
+        for (i = 0; i < (unsigned) n; i++) {
+            len = t->msgs[i].msg_len;
+            seg = 0;
+            for (cm = CMSG_FIRSTHDR(&t->msgs[i].msg_hdr); t->gro && cm != NULL;
+                 cm = CMSG_NXTHDR(&t->msgs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    memcpy(&seg, CMSG_DATA(cm), sizeof seg);
+                }
+            }
+            got = seg > 0 ? (unsigned) ((len + seg - 1) / seg) : 1;
+
+            t->answers += got;
+            t->bytes_in += len;
+            s->inflight -= min_u(got, s->inflight);
+        }
+        s->last_seen = now_ns();
+    }
+}
+
+// Jeder Socket hat ein Fenster von depth Datagrammen, die unterwegs sein
+// dürfen. UDP sagt uns nicht, wenn eines verloren geht: Kommt eine Weile
+// nichts zurück, zählen wir den Rest des Fensters als verloren und fangen
+// wieder von vorne an.
+static void *blaster_main(void *arg) {
+    struct bthread *t = arg;
+    const struct loadgen_config *cfg = t->cfg;
+    uint64_t now, start = now_ns(), stop, end;
+    unsigned i, n;
+
+    stop = start + (uint64_t) (cfg->duration * NS_PER_SEC);
+    end = stop + DRAIN_NS;
+    t->next_due = start;
+
+    for (now = start; now < end; now = now_ns()) {
+        for (i = 0; i < t->nsocks && now < stop; i++) {
+            struct bsock *s = &t->socks[i];
+
+            n = cfg->depth > s->inflight ? min_u(cfg->batch, cfg->depth - s->inflight) : 0;
+            if (t->interval) {
+                n = now >= t->next_due ? min_u(n, (now - t->next_due) / t->interval + 1) : 0;
+            }
+            if (n > 0) {
+                t->next_due += (uint64_t) blast(t, s, n) * t->interval;
+            }
+        }
+
+        if (poll(t->pfd, t->nsocks, 1) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        now = now_ns();
+        for (i = 0; i < t->nsocks; i++) {
+            struct bsock *s = &t->socks[i];
+
+            if (t->pfd[i].revents & POLLIN) {
+                collect(t, s);
+            } else if (s->inflight && now - s->last_seen > LOSS_NS) {
+                t->lost += s->inflight;
+                s->inflight = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < t->nsocks; i++) {
+        t->lost += t->socks[i].inflight;
+    }
+    return NULL;
+}
+
+static int thread_init(struct bthread *t, const struct loadgen_config *cfg, unsigned nsocks) {
+    size_t size = cfg->size ? cfg->size : 1;
+    int yes = 1;
+    unsigned i;
+
+    memset(t, 0, sizeof *t);
+    t->cfg = cfg;
+    t->nsocks = nsocks;
+    t->gso = cfg->gso && cfg->batch > 1 && cfg->size > 0;
+    t->gro = t->gso;
+    pool_init(&t->pool, POOL_CACHE_DEFAULT);
+
+    if (cfg->rate > 0) {
+        t->interval = (uint64_t) (NS_PER_SEC * cfg->threads / cfg->rate);
+        if (t->interval == 0) {
+            t->interval = 1;
+        }
+    }
+
+    t->out = pool_get(&t->pool, cfg->batch * size, &t->outcap);
+    t->in = pool_get(&t->pool, (size_t) cfg->batch * UDP_BUF, &t->incap);
+    t->msgs = calloc(cfg->batch, sizeof *t->msgs);
+    t->iov = calloc(cfg->batch, sizeof *t->iov);
+    t->ctl = calloc(cfg->batch, sizeof *t->ctl);
+    t->socks = calloc(nsocks, sizeof *t->socks);
+    t->pfd = calloc(nsocks, sizeof *t->pfd);
+    if (t->out == NULL || t->in == NULL || t->msgs == NULL || t->iov == NULL ||
+        t->ctl == NULL || t->socks == NULL || t->pfd == NULL) {
+        return -1;
+    }
+    memset(t->out, 'x', cfg->batch * size);
+
+    for (i = 0; i < nsocks; i++) {
+        struct bsock *s = &t->socks[i];
+
+        s->fd = socket(cfg->addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (s->fd == -1) {
+            return -1;
+        }
+        sockopt_client(s->fd, SOCK_DGRAM, &cfg->tune);
+        if (connect(s->fd, (const struct sockaddr *) &cfg->addr, cfg->addrlen) == -1) {
+            return -1;
+        }
+        if (t->gso) {
+            setsockopt(s->fd, SOL_UDP, UDP_GRO, &yes, sizeof yes);
+        }
+        t->pfd[i].fd = s->fd;
+        t->pfd[i].events = POLLIN;
+    }
+    return 0;
+}
+
+static void thread_free(struct bthread *t) {
+    unsigned i;
+
+    for (i = 0; t->socks != NULL && i < t->nsocks; i++) {
+        if (t->socks[i].fd > 0) {
+            close(t->socks[i].fd);
+        }
+    }
+    free(t->socks);
+    free(t->pfd);
+    free(t->msgs);
+    free(t->iov);
+    free(t->ctl);
+    pool_put(&t->pool, t->out, t->outcap);
+    pool_put(&t->pool, t->in, t->incap);
+    pool_destroy(&t->pool);
+}
+
+int run_blaster(const struct loadgen_config *cfg) {
+    struct bthread *threads;
+    unsigned long sent = 0, answers = 0, lost = 0, bytes_in = 0, bytes_out = 0;
+    unsigned long send_calls = 0, recv_calls = 0;
+    int gso = 1;
+    uint64_t start, end;
+    unsigned i;
+    double secs;
+
+    if ((threads = calloc(cfg->threads, sizeof *threads)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        unsigned n = cfg->conns / cfg->threads + (i < cfg->conns % cfg->threads);
+
+        if (thread_init(&threads[i], cfg, n) == -1) {
+            perror("blaster");
+            return -1;
+        }
+    }
+
+    printf("blaster: %u sockets, %u threads, window %u, %zu-byte datagrams, %u per call%s",
+           cfg->conns, cfg->threads, cfg->depth, cfg->size, cfg->batch,
+           threads[0].gso ? ", GSO/GRO" : "");
+    if (cfg->rate > 0) {
+        printf(", %.0f datagrams/s for %.1f s\n", cfg->rate, cfg->duration);
+    } else {
+        printf(", for %.1f s\n", cfg->duration);
+    }
+    fflush(stdout);
+
+    start = now_ns();
+    for (i = 0; i < cfg->threads; i++) {
+        if ((errno = pthread_create(&threads[i].thread, NULL, blaster_main, &threads[i])) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        struct bthread *t = &threads[i];
+
+        pthread_join(t->thread, NULL);
+        sent += t->sent;
+        answers += t->answers;
+        lost += t->lost;
+        bytes_in += t->bytes_in;
+        bytes_out += t->bytes_out;
+        send_calls += t->send_calls;
+        recv_calls += t->recv_calls;
+        gso &= t->gso;
+        thread_free(t);
+    }
+    end = now_ns();
+
+    secs = cfg->duration < (end - start) / 1e9 ? cfg->duration : (end - start) / 1e9;
+    printf("blaster: %lu datagrams out, %lu back in %.2f s: %.0f pps out, %.0f pps in, %.2f%% lost\n",
+           sent, answers, secs, sent / secs, answers / secs, sent ? 100.0 * lost / sent : 0.0);
+    printf("blaster: %.1f MB/s out, %.1f MB/s in, %.1f datagrams per send call, %.1f per receive call%s\n",
+           bytes_out / secs / 1e6, bytes_in / secs / 1e6,
+           send_calls ? (double) sent / send_calls : 0.0,
+           recv_calls ? (double) answers / recv_calls : 0.0,
+           gso || !cfg->gso || cfg->batch == 1 || cfg->size == 0 ? "" : " (GSO fell back)");
+
+    free(threads);
+    return answers > 0 ? 0 : -1;
+}
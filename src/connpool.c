@@ -0,0 +1,523 @@
+/****************************************
+** connpool.c - pooled client connections with multiplexed requests
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "connpool.h"
+#include "framing.h"
+
+// how many ready events one epoll_wait() call may return
+#define MAXEVENTS 64
+
+// what a connection reads into at first, it grows up to one whole answer
+#define RBUF_INITIAL 16384
+
+// marks the end of a free slot list
+#define NO_SLOT ((unsigned) -1)
+
+static uint64_t cp_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// a varint from the front of buf, the bytes it took or -1
+static int varint_decode(const char *buf, size_t n, uint64_t *value) {
+    unsigned shift = 0;
+    size_t i;
+
+    *value = 0;
+    for (i = 0; i < n && i < FRAME_HEADER_MAX; i++, shift += 7) {
+        *value |= (uint64_t) ((unsigned char) buf[i] & 0x7f) << shift;
+        if (!((unsigned char) buf[i] & 0x80)) {
+            return (int) i + 1;
+        }
+    }
+    return -1;
+}
+
+// hand back a buffer and forget it
+static void buf_put(struct pool *p, char **buf, size_t *cap) {
+    if (*buf != NULL) {
+        pool_put(p, *buf, *cap);
+        *buf = NULL;
+        *cap = 0;
+    }
+}
+
+// make room for n more bytes behind len, keeping what is there
+static int buf_reserve(struct pool *p, char **buf, size_t *cap, size_t len, size_t n) {
+    size_t newcap;
+    char *data;
+
+    if (len + n <= *cap) {
+        return 0;
+    }
+    if ((data = pool_get(p, len + n, &newcap)) == NULL) {
+        return -1;
+    }
+    if (*buf != NULL) {
+        memcpy(data, *buf, len);
+        pool_put(p, *buf, *cap);
+    }
+    *buf = data;
+    *cap = newcap;
+    return 0;
+}
+
+static void slots_reset(struct cp_conn *conn, unsigned n) {
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        conn->slots[i].busy = 0;
+        conn->slots[i].next_free = i + 1 < n ? i + 1 : NO_SLOT;
+    }
+    conn->free_slot = 0;
+    conn->inflight = 0;
+}
+
+// Schließt die Verbindung. Steht noch etwas aus, bekommt jeder Aufrufer
+// seinen Fehler. Das fd ist da schon zu und closing gesetzt: Ein Callback,
+// der gleich eine neue Anfrage stellt, landet auf einer anderen Verbindung
+// und nicht in den Slots, über die wir gerade laufen.
+static void conn_close(struct cp_conn *conn, int err) {
+    struct cp_client *c = conn->target->client;
+    struct cp_slot *s;
+    unsigned i;
+
+    if (conn->fd == -1) {
+        return;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->closing = 1;
+    conn->wlen = conn->woff = conn->rlen = 0;
+    buf_put(&c->pool, &conn->wbuf, &conn->wcap);
+    buf_put(&c->pool, &conn->rbuf, &conn->rcap);
+    if (err) {
+        conn->target->failures++;
+    }
+
+    for (i = 0; i < c->opt.max_inflight && conn->inflight > 0; i++) {
+        s = &conn->slots[i];
+        if (!s->busy) {
+            continue;
+        }
+        s->busy = 0;
+        conn->inflight--;
+        if (s->done != NULL) {
+            c->completed++;
+            s->done(s->arg, err ? err : ECONNRESET, NULL, 0);
+        }
+    }
+    conn->closing = 0;
+}
+
+static int conn_open(struct cp_conn *conn) {
+    struct cp_target *t = conn->target;
+    struct cp_client *c = t->client;
+    struct epoll_event ev;
+
+    if (conn->slots == NULL &&
+        (conn->slots = calloc(c->opt.max_inflight, sizeof *conn->slots)) == NULL) {
+        return -1;
+    }
+    slots_reset(conn, c->opt.max_inflight);
+    conn->uses = 0;
+    conn->retiring = 0;
+    conn->last_active = cp_now();
+
+    conn->fd = socket(t->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1) {
+        return -1;
+    }
+    sockopt_client(conn->fd, SOCK_STREAM, &c->opt.tune);
+    if (connect(conn->fd, (const struct sockaddr *) &t->addr, t->addrlen) == -1 &&
+        errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        t->failures++;
+        return -1;
+    }
+    conn->connecting = 1;
+    t->connects++;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// put one request with a fresh id behind the others, done == NULL is a health ping
+static int conn_enqueue(struct cp_conn *conn, const void *data, size_t len, cp_done done, void *arg) {
+    struct cp_client *c = conn->target->client;
+    char hdr[FRAME_HEADER_MAX], id[FRAME_HEADER_MAX];
+    size_t hdrlen, idlen;
+    struct cp_slot *s;
+    unsigned slot;
+
+    // everything sent is gone from the front, start over there
+    if (conn->woff == conn->wlen) {
+        conn->wlen = conn->woff = 0;
+    }
+    slot = conn->free_slot;
+    s = &conn->slots[slot];
+    idlen = frame_header(id, ((uint64_t) (s->gen + 1) << CP_SLOT_BITS) | slot);
+    hdrlen = frame_header(hdr, idlen + len);
+    if (buf_reserve(&c->pool, &conn->wbuf, &conn->wcap, conn->wlen, hdrlen + idlen + len) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(conn->wbuf + conn->wlen, hdr, hdrlen);
+    memcpy(conn->wbuf + conn->wlen + hdrlen, id, idlen);
+    memcpy(conn->wbuf + conn->wlen + hdrlen + idlen, data, len);
+    conn->wlen += hdrlen + idlen + len;
+
+    conn->free_slot = s->next_free;
+    s->gen++;
+    s->busy = 1;
+    s->done = done;
+    s->arg = arg;
+
+    // the clock for a stuck connection starts with its oldest unanswered request
+    if (conn->inflight++ == 0) {
+        conn->last_active = cp_now();
+    }
+    return 0;
+}
+
+// send what the socket takes, the rest waits for EPOLLOUT
+static int conn_flush(struct cp_conn *conn) {
+    ssize_t n;
+
+    while (conn->woff < conn->wlen) {
+        n = send(conn->fd, conn->wbuf + conn->woff, conn->wlen - conn->woff, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->woff += n;
+    }
+    conn->wlen = conn->woff = 0;
+    return 0;
+}
+
+// match one answer to its request by the id in front of it
+static int conn_answer(struct cp_conn *conn, const char *data, size_t len) {
+    struct cp_client *c = conn->target->client;
+    struct cp_slot *s;
+    uint64_t id;
+    unsigned slot;
+    int idlen;
+
+    if ((idlen = varint_decode(data, len, &id)) == -1) {
+        return -1;
+    }
+    slot = (unsigned) (id & (CP_INFLIGHT_MAX - 1));
+    if (slot >= c->opt.max_inflight) {
+        return -1;
+    }
+    s = &conn->slots[slot];
+    if (!s->busy || s->gen != (uint32_t) (id >> CP_SLOT_BITS)) {
+        return -1; // an answer nobody asked for
+    }
+
+    // the slot is free again before the callback, which may want it right away
+    s->busy = 0;
+    s->next_free = conn->free_slot;
+    conn->free_slot = slot;
+    conn->inflight--;
+    if (s->done != NULL) {
+        conn->target->answers++;
+        c->completed++;
+        s->done(s->arg, 0, data + idlen, len - idlen);
+    }
+    return 0;
+}
+
+// read until EAGAIN and answer every complete frame, -1 with errno when the connection is done for
+static int conn_read(struct cp_conn *conn) {
+    struct cp_client *c = conn->target->client;
+    const char *payload;
+    size_t pos, len;
+    ssize_t n, used;
+
+    for (;;) {
+        // room for the rest of a large answer, or at least a decent read
+        if (conn->rlen == conn->rcap &&
+            buf_reserve(&c->pool, &conn->rbuf, &conn->rcap, conn->rlen,
+                        conn->rcap ? conn->rcap : RBUF_INITIAL) == -1) {
+            errno = ENOMEM;
+            return -1;
+        }
+        n = recv(conn->fd, conn->rbuf + conn->rlen, conn->rcap - conn->rlen, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        conn->rlen += n;
+        conn->last_active = cp_now();
+
+        for (pos = 0; pos < conn->rlen; pos += used) {
+            used = frame_decode(conn->rbuf + pos, conn->rlen - pos, c->opt.maxframe, &payload, &len);
+            if (used == 0) {
+                break;
+            }
+            if (used == -1 || conn_answer(conn, payload, len) == -1) {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+        conn->rlen -= pos;
+
+        // an idle connection gives its read buffer back to the pool
+        if (conn->rlen == 0 && conn->inflight == 0) {
+            buf_put(&c->pool, &conn->rbuf, &conn->rcap);
+        }
+    }
+}
+
+static void conn_event(struct cp_conn *conn, uint32_t events) {
+    int err = 0;
+    socklen_t errlen = sizeof err;
+
+    if (conn->fd == -1) {
+        return;
+    }
+    if (conn->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0) {
+            conn_close(conn, err ? err : errno);
+            return;
+        }
+        conn->connecting = 0;
+    }
+
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && conn_read(conn) == -1) {
+        // the server may close a connection that has nothing to do, that is no failure
+        conn_close(conn, conn->inflight > 0 || errno != ECONNRESET ? errno : 0);
+        return;
+    }
+    if (conn_flush(conn) == -1) {
+        conn_close(conn, errno);
+        return;
+    }
+    if (conn->retiring && conn->inflight == 0) {
+        conn_close(conn, 0);
+    }
+}
+
+// push out what cp_request() and the callbacks queued
+static void flush_all(struct cp_client *c) {
+    struct cp_target *t;
+    struct cp_conn *conn;
+    unsigned i;
+
+    for (t = c->targets; t != NULL; t = t->next) {
+        for (i = 0; i < c->opt.max_conns; i++) {
+            conn = &t->conns[i];
+            if (conn->fd != -1 && !conn->connecting && conn->woff < conn->wlen && conn_flush(conn) == -1) {
+                conn_close(conn, errno);
+            }
+        }
+    }
+}
+
+// Eine Verbindung, auf der eine Antwort länger als health_timeout_ms
+// ausbleibt, gilt als tot, auch wenn TCP davon noch nichts weiß. Eine, die
+// nur herumliegt, bekommt alle health_ms einen Ping: eine Anfrage ohne
+// Inhalt, nur mit ID. Bleibt die Antwort aus, greift wieder der Timeout.
+static void check_health(struct cp_client *c, uint64_t now) {
+    const struct cp_options *o = &c->opt;
+    struct cp_target *t;
+    struct cp_conn *conn;
+    unsigned i;
+
+    for (t = c->targets; t != NULL; t = t->next) {
+        for (i = 0; i < o->max_conns; i++) {
+            conn = &t->conns[i];
+            if (conn->fd == -1) {
+                continue;
+            }
+            if (o->health_timeout_ms && conn->inflight > 0 &&
+                now - conn->last_active > (uint64_t) o->health_timeout_ms * 1000000) {
+                t->dead++;
+                conn_close(conn, ETIMEDOUT);
+            } else if (o->health_ms && conn->inflight == 0 && !conn->connecting && !conn->retiring &&
+                       now - conn->last_active > (uint64_t) o->health_ms * 1000000 &&
+                       conn_enqueue(conn, "", 0, NULL, NULL) == 0) {
+                t->pings++;
+            }
+        }
+    }
+}
+
+int cp_init(struct cp_client *c, const struct cp_options *opt) {
+    memset(c, 0, sizeof *c);
+    c->opt = *opt;
+    if (c->opt.max_conns == 0 || c->opt.max_inflight == 0 || c->opt.max_inflight > CP_INFLIGHT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (c->opt.maxframe == 0) {
+        c->opt.maxframe = FRAME_MAX_DEFAULT;
+    }
+    pool_init(&c->pool, POOL_CACHE_DEFAULT);
+    c->next_check = cp_now();
+    if ((c->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void cp_destroy(struct cp_client *c) {
+    struct cp_target *t, *next;
+    unsigned i;
+
+    for (t = c->targets; t != NULL; t = next) {
+        next = t->next;
+        for (i = 0; i < c->opt.max_conns; i++) {
+            conn_close(&t->conns[i], ECANCELED);
+            free(t->conns[i].slots);
+        }
+        free(t->conns);
+        free(t);
+    }
+    c->targets = NULL;
+    pool_destroy(&c->pool);
+    close(c->epfd);
+}
+
+struct cp_target *cp_target(struct cp_client *c, const struct sockaddr *addr, socklen_t len) {
+    struct cp_target *t;
+    unsigned i;
+
+    for (t = c->targets; t != NULL; t = t->next) {
+        if (t->addrlen == len && memcmp(&t->addr, addr, len) == 0) {
+            return t;
+        }
+    }
+
+    if ((t = calloc(1, sizeof *t)) == NULL) {
+        return NULL;
+    }
+    if ((t->conns = calloc(c->opt.max_conns, sizeof *t->conns)) == NULL) {
+        free(t);
+        return NULL;
+    }
+    for (i = 0; i < c->opt.max_conns; i++) {
+        t->conns[i].fd = -1;
+        t->conns[i].target = t;
+    }
+    t->client = c;
+    memcpy(&t->addr, addr, len);
+    t->addrlen = len;
+    t->next = c->targets;
+    c->targets = t;
+    return t;
+}
+
+int cp_request(struct cp_target *t, const void *data, size_t len, cp_done done, void *arg) {
+    const struct cp_options *o = &t->client->opt;
+    struct cp_conn *conn, *best = NULL, *unused = NULL;
+    unsigned i;
+
+    // the least busy connection that has room; a new one only when all are full
+    for (i = 0; i < o->max_conns; i++) {
+        conn = &t->conns[i];
+        if (conn->fd == -1) {
+            if (unused == NULL && !conn->closing) {
+                unused = conn;
+            }
+            continue;
+        }
+        if (!conn->retiring && conn->inflight < o->max_inflight &&
+            (best == NULL || conn->inflight < best->inflight)) {
+            best = conn;
+        }
+    }
+    if (best == NULL) {
+        if (unused == NULL) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (conn_open(unused) == -1) {
+            return -1;
+        }
+        best = unused;
+    }
+
+    if (conn_enqueue(best, data, len, done, arg) == -1) {
+        return -1;
+    }
+    t->requests++;
+    if (o->max_uses && ++best->uses >= o->max_uses) {
+        best->retiring = 1;
+    }
+    return 0;
+}
+
+int cp_fd(const struct cp_client *c) {
+    return c->epfd;
+}
+
+int cp_run(struct cp_client *c, int timeout_ms) {
+    struct epoll_event events[MAXEVENTS];
+    unsigned long completed = c->completed;
+    uint64_t now;
+    int i, n, wait;
+
+    flush_all(c);
+
+    // wake up in time for the next health check
+    now = cp_now();
+    wait = timeout_ms;
+    if (c->opt.health_ms || c->opt.health_timeout_ms) {
+        int until = now < c->next_check ? (int) ((c->next_check - now) / 1000000) : 0;
+
+        if (wait < 0 || until < wait) {
+            wait = until;
+        }
+    }
+
+    n = epoll_wait(c->epfd, events, MAXEVENTS, wait);
+    if (n == -1 && errno != EINTR) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        conn_event(events[i].data.ptr, events[i].events);
+    }
+    flush_all(c);
+
+    now = cp_now();
+    if (now >= c->next_check) {
+        check_health(c, now);
+        c->next_check = now + CP_CHECK_MS * 1000000ULL;
+    }
+    return (int) (c->completed - completed);
+}
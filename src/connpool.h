@@ -0,0 +1,117 @@
+/****************************************
+** connpool.h - pooled client connections with multiplexed requests
+****************************************/
+
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+#include "sockopt.h"
+
+// a request id keeps its slot in the low bits, the rest tells reuses apart
+#define CP_SLOT_BITS 16
+#define CP_INFLIGHT_MAX (1U << CP_SLOT_BITS)
+
+#define CP_HEALTH_MS_DEFAULT 1000
+#define CP_HEALTH_TIMEOUT_MS_DEFAULT 3000
+
+// how often cp_run() looks after idle and stuck connections
+#define CP_CHECK_MS 50
+
+// Verbindungsaufbau kostet einen Round Trip, mit TLS noch mehr. Die
+// Bibliothek hält deshalb pro Serveradresse ein paar Verbindungen offen und
+// schickt beliebig viele Anfragen gleichzeitig über jede davon. Jede Anfrage
+// bekommt eine ID vorne in ihren Frame, als Varint. Der Server schickt
+// Nachrichten unverändert zurück, also kommt die ID mit der Antwort wieder
+// und sagt, zu welcher Anfrage sie gehört, auch wenn die Reihenfolge einmal
+// nicht stimmt. Das leere Frame, mit dem man den Payload des Servers
+// anfordert, hat keinen Platz für eine ID; über den Pool gehen nur Echos.
+
+// called once per request: err 0 and the answer without its id, or an errno
+// value when the connection failed, data is only valid during the call
+typedef void (*cp_done)(void *arg, int err, const char *data, size_t len);
+
+struct cp_options {
+    unsigned max_conns;     // per target
+    unsigned max_inflight;  // per connection, a new one opens when all are full
+    unsigned long max_uses; // retire a connection after this many requests, 0 keeps it
+    int health_ms;          // ping connections idle for this long, 0 for never
+    int health_timeout_ms;  // a connection that owes an answer this long is dead, 0 waits forever
+    size_t maxframe;        // largest answer we accept
+    struct sock_tuning tune;
+};
+
+struct cp_slot {
+    cp_done done; // NULL for a health ping
+    void *arg;
+    uint32_t gen; // bumped on every use, stale ids do not match
+    int busy;
+    unsigned next_free;
+};
+
+struct cp_target;
+
+struct cp_conn {
+    struct cp_target *target;
+    int fd;
+    int connecting;
+    int retiring;          // took max_uses requests, closes once they are answered
+    int closing;           // failing its requests, not to be reopened from their callbacks
+    unsigned long uses;
+    uint64_t last_active;  // ns, last request out or bytes in
+
+    struct cp_slot *slots; // max_inflight of them
+    unsigned free_slot;
+    unsigned inflight;
+
+    char *wbuf;            // requests the socket did not take yet
+    size_t wcap, wlen, woff;
+    char *rbuf;            // answers still incomplete
+    size_t rcap, rlen;
+};
+
+// all connections to one server address
+struct cp_target {
+    struct cp_client *client;
+    struct cp_target *next;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct cp_conn *conns; // max_conns, fd -1 when not open
+
+    unsigned long requests, answers, connects, failures, pings, dead;
+};
+
+// one event loop, used by one thread
+struct cp_client {
+    struct cp_options opt;
+    int epfd;
+    struct pool pool;
+    struct cp_target *targets;
+    uint64_t next_check;
+    unsigned long completed; // done callbacks so far
+};
+
+int cp_init(struct cp_client *c, const struct cp_options *opt);
+
+// close everything, requests still in flight complete with ECANCELED
+void cp_destroy(struct cp_client *c);
+
+// the pool for an address, created on first use; NULL when out of memory
+struct cp_target *cp_target(struct cp_client *c, const struct sockaddr *addr, socklen_t len);
+
+// queue a request, never blocks; -1 with EAGAIN when every connection is
+// full, the answer or the failure arrives through done from cp_run()
+int cp_request(struct cp_target *t, const void *data, size_t len, cp_done done, void *arg);
+
+// the epoll descriptor, for callers that wait in their own loop
+int cp_fd(const struct cp_client *c);
+
+// send what is queued, wait up to timeout_ms for events, handle them and the
+// health checks; returns the number of completed requests or -1
+int cp_run(struct cp_client *c, int timeout_ms);
+
+#endif
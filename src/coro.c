@@ -0,0 +1,406 @@
+/****************************************
+** coro.c - stackful coroutines scheduled by epoll
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include "coro.h"
+
+
+// the coroutine running on this thread, NULL in the scheduler
+static __thread struct coro *current;
+
+#ifdef CORO_ASM
+
+// Ein Kontextwechsel nach der SysV-ABI: Nur rbx, rbp und r12 bis r15 muss
+// der Aufgerufene erhalten, alles andere darf ein Funktionsaufruf sowieso
+// zerstören. Die sechs kommen auf den alten Stack, dessen Zeiger nach *from,
+// dann geht es auf dem neuen Stack weiter. MXCSR und das x87-Kontrollwort
+// ändert hier niemand, die bleiben, wie sie sind.
+void coro_switch(void **from, void *to);
+void coro_trampoline(void);
+
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".hidden coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n"
+
+    // a new coroutine "returns" here with itself in rbx
+    ".globl coro_trampoline\n"
+    ".hidden coro_trampoline\n"
+    ".type coro_trampoline, @function\n"
+    "coro_trampoline:\n"
+    "    movq %rbx, %rdi\n"
+    "    call coro_entry\n"
+    "    ud2\n"
+    ".size coro_trampoline, .-coro_trampoline\n");
+
+#endif
+
+// where every coroutine starts, finishing means switching away for good
+__attribute__((visibility("hidden"), used)) void coro_entry(struct coro *co) {
+    co->fn(co->arg);
+    co->done = 1;
+#ifdef CORO_ASM
+    coro_switch(&co->sp, co->sched->sp);
+#else
+    swapcontext(&co->ctx, &co->sched->ctx);
+#endif
+    abort();
+}
+
+#ifndef CORO_ASM
+// makecontext() only passes ints
+static void coro_entry_ints(unsigned hi, unsigned lo) {
+    coro_entry((struct coro *) (((uintptr_t) hi << 32) | lo));
+}
+#endif
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// guard pages that leave the mapping whole, the headers may not know them yet
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+static char *stack_get(struct coro_sched *s) {
+    long page = sysconf(_SC_PAGESIZE);
+    struct coro_chunk *chunk;
+    char **more;
+    int i;
+
+    if (s->nfree == 0) {
+        more = realloc(s->free_stacks, (s->stacks + CORO_STACK_CHUNK) * sizeof *more);
+        if (more == NULL) {
+            return NULL;
+        }
+        s->free_stacks = more;
+        if ((chunk = malloc(sizeof *chunk)) == NULL) {
+            return NULL;
+        }
+        chunk->base = mmap(NULL, s->stack_size * CORO_STACK_CHUNK, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (chunk->base == MAP_FAILED) {
+            free(chunk);
+            return NULL;
+        }
+        for (i = 0; s->guard && i < CORO_STACK_CHUNK; i++) {
+            if (madvise(chunk->base + (size_t) i * s->stack_size, page, MADV_GUARD_INSTALL) == -1) {
+                munmap(chunk->base, s->stack_size * CORO_STACK_CHUNK);
+                free(chunk);
+                return NULL;
+            }
+        }
+        chunk->next = s->chunks;
+        s->chunks = chunk;
+        for (i = CORO_STACK_CHUNK - 1; i >= 0; i--) {
+            s->free_stacks[s->nfree++] = chunk->base + (size_t) i * s->stack_size;
+        }
+        s->stacks += CORO_STACK_CHUNK;
+    }
+    return s->free_stacks[--s->nfree];
+}
+
+static void stack_put(struct coro_sched *s, char *stack) {
+    s->free_stacks[s->nfree++] = stack;
+}
+
+// run co until it waits or finishes
+static void resume(struct coro *co) {
+    struct coro_sched *s = co->sched;
+
+    current = co;
+    s->switches++;
+#ifdef CORO_ASM
+    coro_switch(&s->sp, co->sp);
+#else
+    swapcontext(&s->ctx, &co->ctx);
+#endif
+    current = NULL;
+
+    if (!s->guard && *(uint64_t *) co->stack != 0) {
+        fprintf(stderr, "coro: stack overflow, raise the stack size above %zu\n", s->stack_size);
+        abort();
+    }
+    if (co->done) {
+        stack_put(s, co->stack);
+        slab_free(s->coros, co);
+        s->live--;
+    }
+}
+
+int co_sched_init(struct coro_sched *s, int epfd, struct slab *coros, size_t stack_size) {
+    long page = sysconf(_SC_PAGESIZE);
+    void *probe;
+
+    memset(s, 0, sizeof *s);
+    s->epfd = epfd;
+    s->coros = coros;
+
+    // a kernel without guard regions says EINVAL, the canary takes over
+    probe = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (probe != MAP_FAILED) {
+        s->guard = madvise(probe, page, MADV_GUARD_INSTALL) == 0;
+        munmap(probe, page);
+    }
+
+    // whole pages, so every stack starts page aligned
+    s->stack_size = (stack_size + page - 1) / page * page;
+    if (s->stack_size < (size_t) page * 2) {
+        s->stack_size = page * 2;
+    }
+    return 0;
+}
+
+void co_sched_destroy(struct coro_sched *s) {
+    struct coro_chunk *chunk, *next;
+
+    for (chunk = s->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        munmap(chunk->base, s->stack_size * CORO_STACK_CHUNK);
+        free(chunk);
+    }
+    s->chunks = NULL;
+    free(s->free_stacks);
+    s->free_stacks = NULL;
+    s->nfree = 0;
+}
+
+int co_spawn(struct coro_sched *s, int fd, coro_fn fn, void *arg) {
+    struct epoll_event ev;
+    struct coro *co;
+
+    if ((co = slab_alloc(s->coros)) == NULL) {
+        return -1;
+    }
+    memset(co, 0, sizeof *co);
+    if ((co->stack = stack_get(s)) == NULL) {
+        slab_free(s->coros, co);
+        return -1;
+    }
+    co->sched = s;
+    co->fn = fn;
+    co->arg = arg;
+    co->fd = fd;
+
+#ifdef CORO_ASM
+    {
+        // what coro_switch() pops: r15, r14, r13, r12, rbx = co, rbp, return address
+        uintptr_t *sp = (uintptr_t *) ((uintptr_t) (co->stack + s->stack_size) & ~(uintptr_t) 15) - 7;
+
+        memset(sp, 0, 6 * sizeof *sp);
+        sp[4] = (uintptr_t) co;
+        sp[6] = (uintptr_t) coro_trampoline;
+        co->sp = sp;
+    }
+#else
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = s->stack_size;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, (void (*)(void)) coro_entry_ints, 2,
+                (unsigned) ((uintptr_t) co >> 32), (unsigned) (uintptr_t) co);
+#endif
+
+    // both directions edge-triggered, the coroutine retries its call before it waits
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = co;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        stack_put(s, co->stack);
+        slab_free(s->coros, co);
+        return -1;
+    }
+    s->live++;
+    resume(co);
+    return 0;
+}
+
+void co_event(struct coro *co, uint32_t events) {
+
+    // errors and hangups wake any waiter, its next call sees what happened
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        events |= EPOLLIN | EPOLLOUT;
+    }
+    if (events & EPOLLRDHUP) {
+        events |= EPOLLIN;
+    }
+    if (co->waiting & events) {
+        resume(co);
+    }
+}
+
+void co_timeout(uint64_t ns) {
+    if (current != NULL) {
+        current->timeout = ns;
+    }
+}
+
+int co_expired(void) {
+    return current != NULL && current->expired;
+}
+
+unsigned long co_expire(struct coro_sched *s) {
+    struct timer *t, *next;
+    struct coro *co;
+    unsigned long n = 0;
+
+    if (s->wheel == NULL) {
+        return 0;
+    }
+
+    // a resumed coroutine only touches its own timer, the others in the list stay valid
+    for (t = wheel_advance(s->wheel, clock_ns()); t != NULL; t = next) {
+        next = t->next;
+        co = (struct coro *) ((char *) t - offsetof(struct coro, timer));
+        co->timed_out = 1;
+        resume(co);
+        n++;
+    }
+    return n;
+}
+
+int co_wait(int fd, uint32_t events) {
+    struct coro *co = current;
+    struct epoll_event ev;
+    struct pollfd pfd;
+    int other, timeout;
+
+    if (co == NULL) {
+        pfd.fd = fd;
+        pfd.events = (short) events;
+        return poll(&pfd, 1, -1) == -1 && errno != EINTR ? -1 : 0;
+    }
+
+    // some other descriptor than its own is watched just for this one wait
+    other = fd != co->fd;
+    if (other) {
+        ev.events = events | EPOLLONESHOT;
+        ev.data.ptr = co;
+        if (epoll_ctl(co->sched->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            return -1;
+        }
+    }
+
+    timeout = co->timeout != 0 && co->sched->wheel != NULL;
+    if (timeout) {
+        timer_arm(co->sched->wheel, &co->timer, clock_ns(), co->timeout);
+    }
+
+    co->waiting = events;
+#ifdef CORO_ASM
+    coro_switch(&co->sp, co->sched->sp);
+#else
+    swapcontext(&co->ctx, &co->sched->ctx);
+#endif
+    co->waiting = 0;
+
+    if (timeout) {
+        timer_cancel(co->sched->wheel, &co->timer);
+    }
+    if (other) {
+        epoll_ctl(co->sched->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    if (co->timed_out) {
+        co->timed_out = 0;
+        co->expired = 1;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t co_recv(int fd, void *buf, size_t len, int flags) {
+    ssize_t n;
+
+    for (;;) {
+        if ((n = recv(fd, buf, len, flags | MSG_DONTWAIT)) != -1) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || co_wait(fd, EPOLLIN) == -1) {
+            return -1;
+        }
+    }
+}
+
+ssize_t co_send(int fd, const void *buf, size_t len, int flags) {
+    ssize_t n;
+
+    for (;;) {
+        if ((n = send(fd, buf, len, flags | MSG_DONTWAIT)) != -1) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || co_wait(fd, EPOLLOUT) == -1) {
+            return -1;
+        }
+    }
+}
+
+ssize_t co_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    ssize_t n;
+
+    for (;;) {
+        if ((n = sendmsg(fd, msg, flags | MSG_DONTWAIT)) != -1) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || co_wait(fd, EPOLLOUT) == -1) {
+            return -1;
+        }
+    }
+}
+
+int co_sendall(int fd, const char *buf, unsigned long *len) {
+    unsigned long total = 0;
+    ssize_t n = 0;
+
+    while (total < *len) {
+        if ((n = co_send(fd, buf + total, *len - total, MSG_NOSIGNAL)) == -1) {
+            break;
+        }
+        total += n;
+    }
+    *len = total;
+    return n == -1 ? -1 : 0;
+}
@@ -0,0 +1,126 @@
+/****************************************
+** coro.h - stackful coroutines scheduled by epoll
+****************************************/
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+#include "timewheel.h"
+
+// the hand-written switch saves six registers, elsewhere ucontext does the work
+#if defined(__x86_64__) && !defined(CORO_UCONTEXT)
+#define CORO_ASM 1
+#else
+#include <ucontext.h>
+#endif
+
+// Stacks are mapped but only the pages a coroutine really touches cost
+// memory, a handler that waits in co_recv() needs about one of them. The
+// lowest page of each is a guard, a coroutine may use one page less.
+#define CORO_STACK_DEFAULT (32 * 1024)
+
+// Stacks per mmap(): one mapping per stack would hit vm.max_map_count long
+// before 100k connections, and so would an mprotect() guard page, it splits
+// the mapping. MADV_GUARD_INSTALL (Linux 6.13) guards a page without
+// splitting, an overflow faults right there. Older kernels only get a canary:
+// the lowest word of a stack has to stay zero, checked whenever its coroutine
+// yields, which catches an overflow only after it hit the stack below.
+#define CORO_STACK_CHUNK 64
+
+typedef void (*coro_fn)(void *arg);
+
+struct coro_sched;
+
+struct coro {
+#ifdef CORO_ASM
+    void *sp;          // saved stack pointer, the registers are on the stack
+#else
+    ucontext_t ctx;
+#endif
+    struct coro_sched *sched;
+    char *stack;
+    coro_fn fn;
+    void *arg;
+    int fd;            // registered with the scheduler's epoll set for its whole life
+    uint32_t waiting;  // epoll events it is waiting for, 0 while it runs
+    int done;
+
+    struct timer timer; // armed while it waits, if it set a timeout
+    uint64_t timeout;   // ns for each wait, 0 for none
+    int timed_out;
+    int expired;        // some wait timed out, stays set for co_expired()
+};
+
+// a list of stack mappings
+struct coro_chunk {
+    struct coro_chunk *next;
+    char *base;
+};
+
+// Ein Coroutine-Handler liest sich wie der Code im Kindprozess nach fork():
+// recv(), antworten, wieder recv(). Nur blockiert co_recv() nicht den
+// Thread, sondern gibt bei EAGAIN an den Scheduler ab, und der setzt die
+// Coroutine fort, sobald epoll den Socket als bereit meldet. Ein Stack von
+// ein paar KiB statt eines Prozesses pro Verbindung.
+struct coro_sched {
+    int epfd;
+    size_t stack_size;
+    struct slab *coros;         // where struct coro comes from
+    char **free_stacks;         // kept apart, a stack's lowest page is never touched
+    unsigned long nfree;
+    struct coro_chunk *chunks;
+    int guard;                  // the lowest page of every stack faults, no canary to check
+    struct wheel *wheel;        // NULL unless waits may time out, see co_timeout()
+#ifdef CORO_ASM
+    void *sp;
+#else
+    ucontext_t ctx;
+#endif
+
+    unsigned long live;         // coroutines not finished yet
+    unsigned long stacks;       // stacks mapped
+    unsigned long switches;     // resumes
+};
+
+// coros must be a slab of sizeof(struct coro) objects
+int co_sched_init(struct coro_sched *s, int epfd, struct slab *coros, size_t stack_size);
+
+// unmap every stack, suspended coroutines are simply dropped
+void co_sched_destroy(struct coro_sched *s);
+
+// run fn(arg) as a coroutine that owns fd, right away until it first waits;
+// fd is added to the epoll set with the coroutine as its data.ptr
+int co_spawn(struct coro_sched *s, int fd, coro_fn fn, void *arg);
+
+// epoll reported events for co, resume it if that is what it waits for
+void co_event(struct coro *co, uint32_t events);
+
+// every later wait of the current coroutine gives up after ns with ETIMEDOUT,
+// 0 waits forever; needs the scheduler's wheel
+void co_timeout(uint64_t ns);
+
+// whether a wait of the current coroutine has timed out; errno can't tell,
+// every coroutine of the thread shares it
+int co_expired(void);
+
+// resume the coroutines whose wait timed out, returns how many
+unsigned long co_expire(struct coro_sched *s);
+
+// wait until fd has events: the current coroutine yields, outside of one it is poll()
+int co_wait(int fd, uint32_t events);
+
+// recv()/send()/sendmsg() that yield instead of returning EAGAIN
+ssize_t co_recv(int fd, void *buf, size_t len, int flags);
+ssize_t co_send(int fd, const void *buf, size_t len, int flags);
+ssize_t co_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+// send all of buf, *len returns the number of bytes sent, like sendall()
+int co_sendall(int fd, const char *buf, unsigned long *len);
+
+#endif
@@ -0,0 +1,14 @@
+/****************************************
+** counters.h - statistics shared between threads
+****************************************/
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+// counters are written by their owner thread only and read by anyone,
+// so a relaxed store is enough and no locked instruction is needed
+#define COUNTER_ADD(c, n) __atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define COUNTER_SET(c, v) __atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define COUNTER_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+#endif
@@ -0,0 +1,120 @@
+/****************************************
+** framing.c - varint length-prefixed messages
+****************************************/
+
+#include <string.h>
+
+#include "framing.h"
+
+size_t frame_header(char *out, uint64_t len) {
+    size_t n = 0;
+
+    while (len >= 0x80) {
+        out[n++] = (char) ((len & 0x7f) | 0x80);
+        len >>= 7;
+    }
+    out[n++] = (char) len;
+
+    return n;
+}
+
+ssize_t frame_decode(const char *buf, size_t n, size_t max, const char **payload, size_t *len) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        unsigned char b = (unsigned char) buf[i];
+
+        // the tenth byte holds bit 63 only, more would be cut off and wrap to a small length
+        if (shift == 63 && b > 1) {
+            return -1;
+        }
+        value |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            if (value > max) {
+                return -1;
+            }
+            if (n - (i + 1) < value) {
+                return 0;
+            }
+            *payload = buf + i + 1;
+            *len = (size_t) value;
+            return (ssize_t) (i + 1 + value);
+        }
+
+        shift += 7;
+        if (shift >= 7 * FRAME_HEADER_MAX) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void frame_parser_init(struct frame_parser *fp, size_t max) {
+    memset(fp, 0, sizeof *fp);
+    fp->max = max;
+}
+
+int frame_parser_feed(struct frame_parser *fp, const char *buf, size_t n, frame_cb cb, void *arg) {
+    const char *end = buf + n;
+    size_t chunk;
+    int flags;
+
+    while (buf < end) {
+
+        // header bytes, possibly split over several reads
+        if (!fp->in_payload) {
+            unsigned char b = (unsigned char) *buf++;
+
+            if (fp->shift == 63 && b > 1) {
+                return -1;
+            }
+            fp->hdr |= (uint64_t) (b & 0x7f) << fp->shift;
+            if (b & 0x80) {
+                fp->shift += 7;
+                if (fp->shift >= 7 * FRAME_HEADER_MAX) {
+                    return -1;
+                }
+                continue;
+            }
+            if (fp->hdr > fp->max) {
+                return -1;
+            }
+
+            fp->need = fp->hdr;
+            fp->hdr = 0;
+            fp->shift = 0;
+            fp->in_payload = 1;
+            fp->begun = 0;
+
+            // an empty frame is complete right away
+            if (fp->need == 0) {
+                fp->in_payload = 0;
+                if (cb(arg, buf, 0, FRAME_BEGIN | FRAME_END) == -1) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        // hand out whatever part of the payload this read holds
+        chunk = (size_t) (end - buf) < fp->need ? (size_t) (end - buf) : (size_t) fp->need;
+        fp->need -= chunk;
+
+        flags = fp->begun ? 0 : FRAME_BEGIN;
+        if (fp->need == 0) {
+            flags |= FRAME_END;
+            fp->in_payload = 0;
+        }
+        fp->begun = 1;
+
+        if (cb(arg, buf, chunk, flags) == -1) {
+            return -1;
+        }
+        buf += chunk;
+    }
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/****************************************
+** framing.h - varint length-prefixed messages
+****************************************/
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Jede Nachricht bekommt ihre Länge vorangestellt, als Varint: 7 Bit pro Byte,
+// das oberste Bit sagt "es kommt noch ein Byte". Kurze Nachrichten kosten so
+// nur ein Byte Header, und der Empfänger weiß immer, wo die nächste anfängt.
+
+// a 64-bit length never needs more than this
+#define FRAME_HEADER_MAX 10
+
+// default cap on the payload of one incoming frame
+#define FRAME_MAX_DEFAULT (64UL * 1024 * 1024)
+
+// flags handed to the frame callback
+#define FRAME_BEGIN 1 // first chunk of a frame
+#define FRAME_END   2 // last chunk of a frame
+
+// write the header for a len byte frame to out, returns its size
+size_t frame_header(char *out, uint64_t len);
+
+// one complete frame from the start of buf: returns the bytes it takes up
+// and points *payload/*len into buf, 0 if the frame is not complete yet,
+// -1 if the header is broken or announces more than max bytes
+ssize_t frame_decode(const char *buf, size_t n, size_t max, const char **payload, size_t *len);
+
+// called for every piece of payload, data points into the buffer that was
+// fed in, so nothing is copied. A frame that arrived in one read comes as a
+// single call with FRAME_BEGIN | FRAME_END. Returning -1 stops the parser.
+typedef int (*frame_cb)(void *arg, const char *data, size_t len, int flags);
+
+// incremental parser for a byte stream, survives frames split across reads
+struct frame_parser {
+    size_t max;     // largest payload we accept
+    uint64_t hdr;   // header being assembled
+    unsigned shift; // bits of it we have so far
+    int in_payload;
+    int begun;      // FRAME_BEGIN already reported
+    uint64_t need;  // payload bytes of the current frame still to come
+};
+
+void frame_parser_init(struct frame_parser *fp, size_t max);
+
+// run n bytes through the parser, -1 on a broken or oversized frame
+// or when the callback asked to stop
+int frame_parser_feed(struct frame_parser *fp, const char *buf, size_t n, frame_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,83 @@
+/****************************************
+** histogram.c - latency histograms with bounded relative error
+****************************************/
+
+#include <string.h>
+
+#include "counters.h"
+#include "histogram.h"
+
+// values below 2 * HIST_SUB are counted exactly, everything above by its
+// top HIST_SUB_BITS + 1 bits
+static unsigned bucket_of(uint64_t v) {
+    unsigned shift;
+
+    if (v < 2 * HIST_SUB) {
+        return (unsigned) v;
+    }
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (unsigned) (v >> shift);
+}
+
+// the largest value that lands in bucket i
+static uint64_t bucket_top(unsigned i) {
+    unsigned shift;
+
+    if (i < 2 * HIST_SUB) {
+        return i;
+    }
+    shift = i / HIST_SUB - 1;
+    return (((uint64_t) (i % HIST_SUB + HIST_SUB) + 1) << shift) - 1;
+}
+
+void hist_init(struct histogram *h) {
+    memset(h, 0, sizeof *h);
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+    unsigned i = bucket_of(value);
+
+    COUNTER_ADD(h->counts[i], 1);
+    COUNTER_ADD(h->total, 1);
+    COUNTER_ADD(h->sum, value);
+    if (value > h->max) {
+        COUNTER_SET(h->max, value);
+    }
+}
+
+void hist_merge(struct histogram *to, const struct histogram *from) {
+    uint64_t max = COUNTER_GET(from->max);
+    unsigned i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        to->counts[i] += COUNTER_GET(from->counts[i]);
+    }
+    to->total += COUNTER_GET(from->total);
+    to->sum += COUNTER_GET(from->sum);
+    if (max > to->max) {
+        to->max = max;
+    }
+}
+
+uint64_t hist_percentile(const struct histogram *h, double p) {
+    uint64_t want, seen = 0, top;
+    unsigned i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    want = (uint64_t) (h->total * p / 100.0 + 0.5);
+    if (want == 0) {
+        want = 1;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            // a bucket's upper end, but never above what was really recorded
+            top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,36 @@
+/****************************************
+** histogram.h - latency histograms with bounded relative error
+****************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Wie beim HdrHistogram werden die Werte nicht einzeln gespeichert, sondern
+// gezählt: Bis 127 hat jeder Wert seinen eigenen Zähler, danach wird jede
+// Zweierpotenz in 64 gleich breite Stücke geteilt. Der Fehler bleibt so unter
+// 1,6 %, egal ob es um Mikrosekunden oder Sekunden geht, und das Ganze
+// braucht immer gleich viel Speicher.
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// written by one thread, readable by others at any time (see counters.h)
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+void hist_init(struct histogram *h);
+void hist_record(struct histogram *h, uint64_t value);
+
+// add everything from into to
+void hist_merge(struct histogram *to, const struct histogram *from);
+
+// the value p percent of the recordings are at or below, 0 when empty
+uint64_t hist_percentile(const struct histogram *h, double p);
+
+#endif
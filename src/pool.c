@@ -0,0 +1,139 @@
+/****************************************
+** pool.c - connection slabs and buffer pools
+****************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define CACHE_LINE 64
+
+// where a free object or chunk keeps the link to the next one
+#define NEXT(obj) (*(void **) (obj))
+
+void slab_init(struct slab *s, size_t size, unsigned per_chunk) {
+    memset(s, 0, sizeof *s);
+
+    // neighbouring connections must not share a cache line
+    s->size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    s->per_chunk = per_chunk ? per_chunk : 1;
+}
+
+void *slab_alloc(struct slab *s) {
+    char *chunk, *obj;
+    unsigned i;
+
+    if (s->free == NULL) {
+        // the first cache line of a chunk only links it into s->chunks
+        if (posix_memalign((void **) &chunk, CACHE_LINE, CACHE_LINE + s->per_chunk * s->size) != 0) {
+            return NULL;
+        }
+        NEXT(chunk) = s->chunks;
+        s->chunks = chunk;
+
+        for (i = s->per_chunk; i-- > 0;) {
+            obj = chunk + CACHE_LINE + i * s->size;
+            NEXT(obj) = s->free;
+            s->free = obj;
+        }
+        COUNTER_ADD(s->misses, 1);
+    } else {
+        COUNTER_ADD(s->hits, 1);
+    }
+
+    obj = s->free;
+    s->free = NEXT(obj);
+
+    COUNTER_ADD(s->in_use, 1);
+    if (s->in_use > s->high_water) {
+        COUNTER_SET(s->high_water, s->in_use);
+    }
+    return obj;
+}
+
+void slab_free(struct slab *s, void *obj) {
+    NEXT(obj) = s->free;
+    s->free = obj;
+    COUNTER_ADD(s->in_use, -1);
+}
+
+void slab_destroy(struct slab *s) {
+    void *chunk;
+
+    while ((chunk = s->chunks) != NULL) {
+        s->chunks = NEXT(chunk);
+        free(chunk);
+    }
+    s->free = NULL;
+}
+
+void pool_init(struct pool *p, size_t max_cached) {
+    memset(p, 0, sizeof *p);
+    p->max_cached = max_cached;
+}
+
+// smallest class that holds size bytes, POOL_CLASSES if none does
+static unsigned size_class(size_t size) {
+    unsigned shift = POOL_MIN_SHIFT;
+
+    while (shift <= POOL_MAX_SHIFT && ((size_t) 1 << shift) < size) {
+        shift++;
+    }
+    return shift - POOL_MIN_SHIFT;
+}
+
+void *pool_get(struct pool *p, size_t size, size_t *cap) {
+    unsigned cls = size_class(size);
+    void *buf;
+
+    *cap = cls < POOL_CLASSES ? (size_t) 1 << (cls + POOL_MIN_SHIFT) : size;
+
+    if (cls < POOL_CLASSES && (buf = p->free[cls]) != NULL) {
+        p->free[cls] = NEXT(buf);
+        p->cached -= *cap;
+        COUNTER_ADD(p->hits, 1);
+    } else {
+        if ((buf = malloc(*cap)) == NULL) {
+            return NULL;
+        }
+        COUNTER_ADD(p->misses, 1);
+    }
+
+    COUNTER_ADD(p->in_use, *cap);
+    if (p->in_use > p->high_water) {
+        COUNTER_SET(p->high_water, p->in_use);
+    }
+    return buf;
+}
+
+void pool_put(struct pool *p, void *buf, size_t cap) {
+    unsigned cls = size_class(cap);
+
+    if (buf == NULL) {
+        return;
+    }
+    COUNTER_ADD(p->in_use, -cap);
+
+    // keep it for the next connection unless the cache is full
+    if (cls < POOL_CLASSES && p->cached + cap <= p->max_cached) {
+        NEXT(buf) = p->free[cls];
+        p->free[cls] = buf;
+        p->cached += cap;
+        return;
+    }
+    free(buf);
+}
+
+void pool_destroy(struct pool *p) {
+    void *buf;
+    unsigned cls;
+
+    for (cls = 0; cls < POOL_CLASSES; cls++) {
+        while ((buf = p->free[cls]) != NULL) {
+            p->free[cls] = NEXT(buf);
+            free(buf);
+        }
+    }
+    p->cached = 0;
+}
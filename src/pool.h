@@ -0,0 +1,70 @@
+/****************************************
+** pool.h - connection slabs and buffer pools
+****************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#include "counters.h"
+
+// Bei 100k offenen Verbindungen kostet malloc()/free() für jeden accept()
+// nicht nur Zeit, der Heap zerfasert auch. Deshalb kommen Verbindungen aus
+// einem Slab mit festen Objektgrößen und Puffer aus Freilisten mit
+// Zweierpotenzen. Beides gehört genau einem Thread und braucht kein Lock.
+
+// objects of one size, carved out of chunks that are never given back
+struct slab {
+    size_t size;        // object size, rounded up to a cache line
+    unsigned per_chunk; // objects per malloc()
+    void *free;         // freed objects, linked through their first word
+    void *chunks;       // every chunk, linked the same way
+
+    unsigned long in_use;
+    unsigned long high_water;
+    unsigned long hits;   // served from the free list
+    unsigned long misses; // needed a fresh chunk
+};
+
+void slab_init(struct slab *s, size_t size, unsigned per_chunk);
+
+// an uninitialised object, NULL when out of memory
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+
+// release all chunks, objects still in use included
+void slab_destroy(struct slab *s);
+
+// buffer size classes: 512 bytes up to 64 MiB, larger ones are not pooled
+#define POOL_MIN_SHIFT 9
+#define POOL_MAX_SHIFT 26
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+// how many bytes of free buffers a pool keeps around by default
+#define POOL_CACHE_DEFAULT (16UL * 1024 * 1024)
+
+// power-of-two buffers on per-class free lists
+struct pool {
+    void *free[POOL_CLASSES];
+    size_t max_cached; // free buffers beyond this go back to malloc()
+    size_t cached;
+
+    unsigned long hits;       // served from a free list
+    unsigned long misses;     // had to malloc()
+    unsigned long in_use;     // bytes handed out
+    unsigned long high_water; // most bytes handed out at once
+};
+
+void pool_init(struct pool *p, size_t max_cached);
+
+// a buffer of at least size bytes, *cap returns what it really holds
+void *pool_get(struct pool *p, size_t size, size_t *cap);
+
+// give back a buffer with the cap pool_get() returned for it
+void pool_put(struct pool *p, void *buf, size_t cap);
+
+// free the cached buffers
+void pool_destroy(struct pool *p);
+
+#endif
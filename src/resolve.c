@@ -0,0 +1,441 @@
+/****************************************
+** resolve.c - cached name resolution and Happy Eyeballs connects
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "client.h"
+#include "resolve.h"
+
+enum {
+    RESOLVE_EMPTY,
+    RESOLVE_PENDING,
+    RESOLVE_READY
+};
+
+// one getaddrinfo(), the results flattened into res
+static void resolve_now(const char *host, const char *port, int socktype, struct resolved *res) {
+    struct addrinfo hints, *servinfo, *p;
+
+    memset(res, 0, sizeof *res);
+
+    // Kümmert sich darum, dass das struct leer ist
+    memset(&hints, 0, sizeof hints);
+
+    // Du kannst über das ai_family Feld erzwingen, dass IPv4, oder IPv6 benutzt wird,
+    // oder benutzt einfach AF_UNSPEC um das jeweils Notwendige zu benutzen.
+    hints.ai_family = AF_UNSPEC;
+
+    // ai_socktype -> SOCK_STREAM oder SOCK_DGRAM
+    hints.ai_socktype = socktype;
+
+    // Diese Funktion arbeitet wirklich hart, sie bringt viele Optionen mit. Sie macht
+    // DNS und Service Name Lookups und füllt die structs, die Du später brauchst.
+    // Dafür kann sie aber auch blockieren, solange der DNS-Server nicht antwortet,
+    // deshalb läuft sie nur hier im Resolver-Thread.
+
+    // 4. Parameter: Falls alles ordentlich funktioniert, zeigt servinfo auf eine
+    // verkettete Liste von struct addrinfo-Elementen, wobei jedes einzelne dieser
+    // Elemente ein struct sockaddr besitzt:
+    if ((res->error = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+        return;
+    }
+
+    // getaddrinfo() sorts by RFC 6724 already, keep its order
+    for (p = servinfo; p != NULL && res->naddrs < RESOLVE_ADDRS; p = p->ai_next) {
+        memcpy(&res->addrs[res->naddrs], p->ai_addr, p->ai_addrlen);
+        res->lens[res->naddrs] = p->ai_addrlen;
+        res->naddrs++;
+    }
+    if (res->naddrs == 0) {
+        res->error = EAI_NONAME;
+    }
+
+    // Am Ende, wenn wir fertig sind mit der verketteten Liste,
+    // können und sollten wir den Speicher wieder frei machen,
+    // ndem wir freeaddrinfo() aufrufen.
+    freeaddrinfo(servinfo);
+}
+
+static struct resolve_entry *find(struct resolver *r, const char *host, const char *port, int socktype) {
+    unsigned i;
+
+    for (i = 0; i < RESOLVE_ENTRIES; i++) {
+        struct resolve_entry *e = &r->entries[i];
+
+        if (e->state != RESOLVE_EMPTY && e->socktype == socktype &&
+            strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// a fresh entry for the key, evicting the least recently used idle one
+static struct resolve_entry *claim(struct resolver *r, const char *host, const char *port, int socktype) {
+    struct resolve_entry *e, *victim = NULL;
+    unsigned i;
+
+    if (strlen(host) >= sizeof victim->host || strlen(port) >= sizeof victim->port) {
+        return NULL;
+    }
+    for (i = 0; i < RESOLVE_ENTRIES; i++) {
+        e = &r->entries[i];
+        if (e->state == RESOLVE_EMPTY) {
+            victim = e;
+            break;
+        }
+        if (!e->queued && !e->busy && (victim == NULL || e->used < victim->used)) {
+            victim = e;
+        }
+    }
+    if (victim == NULL) {
+        return NULL;
+    }
+
+    memset(victim, 0, sizeof *victim);
+    strcpy(victim->host, host);
+    strcpy(victim->port, port);
+    victim->socktype = socktype;
+    victim->state = RESOLVE_PENDING;
+    return victim;
+}
+
+static void *resolver_main(void *arg) {
+    struct resolver *r = arg;
+    struct resolve_entry *e;
+    struct resolved res;
+    unsigned i;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop) {
+        for (e = NULL, i = 0; i < RESOLVE_ENTRIES && e == NULL; i++) {
+            if (r->entries[i].queued) {
+                e = &r->entries[i];
+            }
+        }
+        if (e == NULL) {
+            pthread_cond_wait(&r->queue, &r->lock);
+            continue;
+        }
+
+        // the key cannot change while busy, claim() leaves busy entries alone
+        e->queued = 0;
+        e->busy = 1;
+        pthread_mutex_unlock(&r->lock);
+
+        resolve_now(e->host, e->port, e->socktype, &res);
+
+        pthread_mutex_lock(&r->lock);
+        e->busy = 0;
+        r->lookups++;
+
+        // a failed refresh does not throw away addresses that worked until now,
+        // and a successful one keeps preferring the address that connected
+        if (res.error == 0 || e->state != RESOLVE_READY || e->res.error != 0) {
+            for (i = 0; e->state == RESOLVE_READY && e->res.naddrs && i < res.naddrs; i++) {
+                if (memcmp(&res.addrs[i], &e->res.addrs[e->res.preferred], res.lens[i]) == 0) {
+                    res.preferred = i;
+                }
+            }
+            e->res = res;
+        }
+        e->expires = now_ns() + (uint64_t) (e->res.error ? r->negative_ttl : r->ttl);
+        e->state = RESOLVE_READY;
+        pthread_cond_broadcast(&r->done);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+int resolver_init(struct resolver *r, double ttl, double negative_ttl) {
+    memset(r, 0, sizeof *r);
+    r->ttl = (uint64_t) (ttl * 1e9);
+    r->negative_ttl = (uint64_t) (negative_ttl * 1e9);
+    if ((r->entries = calloc(RESOLVE_ENTRIES, sizeof *r->entries)) == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->queue, NULL);
+    pthread_cond_init(&r->done, NULL);
+    if ((errno = pthread_create(&r->thread, NULL, resolver_main, r)) != 0) {
+        free(r->entries);
+        return -1;
+    }
+    return 0;
+}
+
+void resolver_destroy(struct resolver *r) {
+    unsigned i;
+    int busy = 0;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    for (i = 0; i < RESOLVE_ENTRIES; i++) {
+        busy |= r->entries[i].busy;
+    }
+    pthread_cond_signal(&r->queue);
+    pthread_mutex_unlock(&r->lock);
+
+    // a lookup stuck in getaddrinfo() would hold us up here, it is left behind with its entries
+    if (busy) {
+        pthread_detach(r->thread);
+        return;
+    }
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->queue);
+    pthread_cond_destroy(&r->done);
+    free(r->entries);
+}
+
+// with the lock held: what is cached, queueing a lookup if there is nothing or it expired
+static struct resolve_entry *lookup_locked(struct resolver *r, const char *host, const char *port,
+                                           int socktype) {
+    struct resolve_entry *e = find(r, host, port, socktype);
+    uint64_t now = now_ns();
+
+    if (e == NULL) {
+        if ((e = claim(r, host, port, socktype)) == NULL) {
+            return NULL;
+        }
+        r->misses++;
+        e->queued = 1;
+        pthread_cond_signal(&r->queue);
+    } else if (e->state == RESOLVE_READY && now >= e->expires) {
+        r->stale++;
+        if (!e->queued && !e->busy) {
+            e->queued = 1;
+            pthread_cond_signal(&r->queue);
+        }
+    } else if (e->state == RESOLVE_READY) {
+        r->hits++;
+    }
+    e->used = now;
+    return e;
+}
+
+int resolver_lookup(struct resolver *r, const char *host, const char *port, int socktype,
+                    struct resolved *out) {
+    struct resolve_entry *e;
+    int rv = -1;
+
+    pthread_mutex_lock(&r->lock);
+    if ((e = lookup_locked(r, host, port, socktype)) != NULL && e->state == RESOLVE_READY) {
+        *out = e->res;
+        rv = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+int resolver_wait(struct resolver *r, const char *host, const char *port, int socktype,
+                  struct resolved *out, int timeout_ms) {
+    struct resolve_entry *e;
+    struct timespec deadline;
+    int rv = -1;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while ((e = lookup_locked(r, host, port, socktype)) != NULL && e->state != RESOLVE_READY) {
+        if (pthread_cond_timedwait(&r->done, &r->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (e != NULL && e->state == RESOLVE_READY) {
+        *out = e->res;
+        rv = 0;
+    } else {
+        memset(out, 0, sizeof *out);
+        out->error = EAI_AGAIN;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+int resolver_pick(struct resolver *r, const char *host, const char *port, int socktype,
+                  struct sockaddr_storage *addr, socklen_t *len) {
+    struct resolve_entry *e;
+    int rv = -1;
+
+    pthread_mutex_lock(&r->lock);
+    e = lookup_locked(r, host, port, socktype);
+    if (e != NULL && e->state == RESOLVE_READY && e->res.naddrs > 0) {
+        *addr = e->res.addrs[e->res.preferred];
+        *len = e->res.lens[e->res.preferred];
+        rv = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+void resolver_report(struct resolver *r, const char *host, const char *port, int socktype,
+                     const struct sockaddr *addr, int ok) {
+    struct resolve_entry *e;
+    unsigned i;
+
+    pthread_mutex_lock(&r->lock);
+    if ((e = find(r, host, port, socktype)) != NULL && e->state == RESOLVE_READY) {
+        for (i = 0; i < e->res.naddrs; i++) {
+            if (e->res.lens[i] && memcmp(&e->res.addrs[i], addr, e->res.lens[i]) == 0) {
+                break;
+            }
+        }
+        if (i < e->res.naddrs && ok) {
+            e->res.preferred = i;
+        } else if (i < e->res.naddrs && i == e->res.preferred) {
+            e->res.preferred = (i + 1) % e->res.naddrs;
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+// RFC 8305: the preferred address first, then the families take turns
+static unsigned interleave(const struct resolved *res, unsigned *order) {
+    unsigned used[RESOLVE_ADDRS] = {0};
+    unsigned n = 0, i;
+    int family;
+
+    order[n++] = res->preferred;
+    used[res->preferred] = 1;
+    family = res->addrs[res->preferred].ss_family;
+
+    while (n < res->naddrs) {
+        // the next unused one of the other family, or of any family if that ran out
+        for (i = 0; i < res->naddrs && (used[i] || res->addrs[i].ss_family == family); i++);
+        if (i == res->naddrs) {
+            for (i = 0; used[i]; i++);
+        }
+        order[n++] = i;
+        used[i] = 1;
+        family = res->addrs[i].ss_family;
+    }
+    return n;
+}
+
+static uint64_t ms_since(uint64_t t) {
+    return (now_ns() - t) / 1000000;
+}
+
+int happy_connect(const struct resolved *res, int socktype, const struct sock_tuning *tune,
+                  int timeout_ms, unsigned *which) {
+    unsigned order[RESOLVE_ADDRS], idx[RESOLVE_ADDRS];
+    struct pollfd pfd[RESOLVE_ADDRS];
+    unsigned n, next = 0, npending = 0, i;
+    uint64_t start = now_ns(), last = 0;
+    int fd = -1, err = ETIMEDOUT, wait;
+    socklen_t errlen;
+
+    if (res->naddrs == 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    n = interleave(res, order);
+
+    while (fd == -1 && (next < n || npending > 0) && ms_since(start) < (uint64_t) timeout_ms) {
+
+        // start the next attempt when the last one had its time or nothing is running
+        if (next < n && (npending == 0 || ms_since(last) >= CONNECT_ATTEMPT_DELAY_MS)) {
+            const struct sockaddr_storage *a = &res->addrs[order[next]];
+
+            // socket() gibt Dir einfach einen Socket-Deskriptor zurück,
+            // den Du später für die system calls benutzen kannst, oder
+            // aber -1, falls es einen Fehler gab.
+            int s = socket(a->ss_family, socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            last = now_ns();
+            if (s == -1) {
+                err = errno;
+                next++;
+                continue;
+            }
+            sockopt_client(s, socktype, tune);
+
+            // 1. Parameter: sockfd ist der Socket Datei-Deskriptor, den wir ja schon kennen,
+            // dieser wurde ja von socket() zurückgegeben.
+            // 2. Parameter: serv_addr ist ein struct sockaddr, der die Zieladresse und den Zielport angibt.
+            // 3. Parameter: addrlen ist mal wieder die Länge der Server Adresse in Bytes.
+            // Nicht-blockierend kehrt connect() sofort zurück, der Handshake läuft
+            // weiter, während wir schon die nächste Adresse versuchen.
+            if (connect(s, (const struct sockaddr *) a, res->lens[order[next]]) == 0) {
+                fd = s;
+                *which = order[next];
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                err = errno;
+                close(s);
+                next++;
+                continue;
+            }
+            pfd[npending].fd = s;
+            pfd[npending].events = POLLOUT;
+            idx[npending] = order[next];
+            npending++;
+            next++;
+        }
+
+        // until the next attempt is due, or the deadline if none is left
+        wait = next < n ? CONNECT_ATTEMPT_DELAY_MS - (int) ms_since(last) : timeout_ms - (int) ms_since(start);
+        if (wait < 0) {
+            wait = 0;
+        }
+        if (poll(pfd, npending, wait) == -1 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+
+        for (i = 0; i < npending; i++) {
+            if (pfd[i].revents == 0) {
+                continue;
+            }
+            errlen = sizeof err;
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0) {
+                fd = pfd[i].fd;
+                *which = idx[i];
+                pfd[i].fd = -1;
+                break;
+            }
+
+            // that one is out, the next attempt need not wait for the delay
+            close(pfd[i].fd);
+            pfd[i] = pfd[npending - 1];
+            idx[i] = idx[npending - 1];
+            npending--;
+            i--;
+            last = 0;
+        }
+    }
+
+    // the losers of the race
+    for (i = 0; i < npending; i++) {
+        if (pfd[i].fd != -1) {
+            close(pfd[i].fd);
+        }
+    }
+    if (fd == -1) {
+        errno = err;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return fd;
+}
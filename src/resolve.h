@@ -0,0 +1,95 @@
+/****************************************
+** resolve.h - cached name resolution and Happy Eyeballs connects
+****************************************/
+
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "sockopt.h"
+
+// how many addresses of one name we keep
+#define RESOLVE_ADDRS 16
+
+// names the cache holds, the least recently used one makes room
+#define RESOLVE_ENTRIES 32
+
+// getaddrinfo() tells us nothing about DNS TTLs, so a result is good for
+// this long; a failed lookup is remembered for a shorter while
+#define RESOLVE_TTL_DEFAULT 30.0
+#define RESOLVE_NEGATIVE_TTL_DEFAULT 5.0
+
+// wait between two connect attempts of Happy Eyeballs (RFC 8305 says 250 ms)
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+// a lookup's outcome
+struct resolved {
+    int error;          // getaddrinfo() error, 0 if there are addresses
+    unsigned naddrs;
+    unsigned preferred; // the address that connected last, try it first
+    struct sockaddr_storage addrs[RESOLVE_ADDRS];
+    socklen_t lens[RESOLVE_ADDRS];
+};
+
+struct resolve_entry {
+    char host[256];
+    char port[32];
+    int socktype;
+    int state;        // RESOLVE_EMPTY, RESOLVE_PENDING or RESOLVE_READY
+    int queued;       // waiting for the resolver thread
+    int busy;         // the resolver thread is on it right now
+    uint64_t expires; // READY: when to look it up again
+    uint64_t used;    // for the LRU
+    struct resolved res;
+};
+
+// Ein Aufruf von getaddrinfo() kann Sekunden dauern, wenn der DNS-Server
+// hängt. Der Cache hält deshalb die Ergebnisse, ein eigener Thread erledigt
+// die Auflösung, und wer eine Adresse braucht, bekommt sofort die letzte
+// bekannte: auch eine abgelaufene, dann wird im Hintergrund nachgefragt.
+// Nur wer noch gar nichts hat, muss warten.
+struct resolver {
+    pthread_mutex_t lock;
+    pthread_cond_t queue;  // an entry got queued, or stop
+    pthread_cond_t done;   // a lookup finished
+    pthread_t thread;
+    int stop;
+
+    uint64_t ttl;          // ns
+    uint64_t negative_ttl; // ns
+    struct resolve_entry *entries;
+
+    unsigned long hits, stale, misses, lookups;
+};
+
+int resolver_init(struct resolver *r, double ttl, double negative_ttl);
+void resolver_destroy(struct resolver *r);
+
+// never blocks: fills out with what is cached and returns 0, negative
+// results included (out->error), or queues the lookup and returns -1
+int resolver_lookup(struct resolver *r, const char *host, const char *port, int socktype,
+                    struct resolved *out);
+
+// the same, but waits up to timeout_ms for a first answer
+int resolver_wait(struct resolver *r, const char *host, const char *port, int socktype,
+                  struct resolved *out, int timeout_ms);
+
+// the address that connected last, a cheap copy for reconnect loops; -1 if none is cached
+int resolver_pick(struct resolver *r, const char *host, const char *port, int socktype,
+                  struct sockaddr_storage *addr, socklen_t *len);
+
+// tell the cache how connecting to addr went, a failure moves the preference on
+void resolver_report(struct resolver *r, const char *host, const char *port, int socktype,
+                     const struct sockaddr *addr, int ok);
+
+// Happy Eyeballs: non-blocking connects to the addresses, families
+// interleaved, a new one every CONNECT_ATTEMPT_DELAY_MS or as soon as one
+// fails; the first to connect wins. Returns the blocking socket and its
+// index in *which, -1 with errno from the last failure.
+int happy_connect(const struct resolved *res, int socktype, const struct sock_tuning *tune,
+                  int timeout_ms, unsigned *which);
+
+#endif
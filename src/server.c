@@ -14,15 +14,29 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
+
+#include "server.h"
 
 // the port users will be connecting to
 #define PORT "3490"
 
-// how many pending connections queue will hold
-#define BACKLOG 10
+// how many pending connections queue will hold, 10 dropped SYNs as soon
+// as a burst of clients came in; the kernel caps it at net.core.somaxconn
+#define BACKLOG SOMAXCONN
+
+// -A in fork mode: every child is an open connection until it is reaped
+static struct admit *children;
 
 void sigchld_handler(int s) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    int saved = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        if (children != NULL) {
+            admit_release(children);
+        }
+    }
+    errno = saved;
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -33,19 +47,27 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6 *) sa)->sin6_addr); // sin6_addr = Internet address (IPv6)
 }
 
+void conn_shed(int fd) {
+    struct linger rst = {.l_onoff = 1, .l_linger = 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &rst, sizeof rst);
+    close(fd);
+}
+
 // sockfd ist das Socket an das Du die Daten schicken willst, buf ist der Buffer, der die Daten enthält
 // und len ist ein Zeiger auf ein int, der die Anzahl an Byte im Buffer enthält.
 // Aber was passiert auf der Seite des Empfangenden, wenn nur der Teil eines Pakets ankommt?
 // Wenn die Pakete unterschiedlich lang sind, woher weiß dann der Empfänger, wo das eine Paket
 // aufhört und das nächste beginnt?
 int sendall(int sockfd, char *buffer, unsigned long *len) {
-    // how many bytes we've sent
-    int total = 0;
+    // how many bytes we've sent, an int would overflow past 2 GiB
+    unsigned long total = 0;
 
     // how many we have left to send
     unsigned long bytesleft = *len;
 
-    int n;
+    struct pollfd pfd;
+    ssize_t n = 0;
     while (total < *len) {
 
         // send() gibt die Anzahl an Bytes zurück, die auch tatsächlich rausgeschickt werden.
@@ -63,8 +85,21 @@ int sendall(int sockfd, char *buffer, unsigned long *len) {
         // Du kannst die flags einfach auf 0 setzen
         n = send(sockfd, buffer + total, bytesleft, 0);
 
-        // Es wird -1 zurückgegeben, falls ein Fehler aufgetreten ist
+        // Es wird -1 zurückgegeben, falls ein Fehler aufgetreten ist. Ein
+        // unterbrochener Aufruf oder ein voller nicht-blockierender Socket
+        // sind aber keine Fehler: im zweiten Fall warten wir mit poll(),
+        // bis der Socket wieder etwas annimmt.
         if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pfd.fd = sockfd;
+                pfd.events = POLLOUT;
+                if (poll(&pfd, 1, -1) != -1 || errno == EINTR) {
+                    continue;
+                }
+            }
             break;
         }
 
@@ -77,27 +112,15 @@ int sendall(int sockfd, char *buffer, unsigned long *len) {
     return n == -1 ? -1 : 0; // return -1 on failure, 0 on success
 }
 
-int main(void) {
+// bind a socket of socktype to port, tune it, stream sockets start listening on it,
+// returns the socket descriptor or -1 on error
+int get_listener_socket(const char *port, int socktype, int reuseport, const struct sock_tuning *tune) {
 
-    // listen on sock_fd, new connection on new_fd
-    int sockfd, new_fd;
+    // listen on sockfd
+    int sockfd;
 
     struct addrinfo hints, *servinfo, *p;
 
-    // struct sockaddr_storage, das groß genug ist um sowohl IPv4 als auch IPv6 structs
-    // zu halten. Es sieht nun mal so aus, dass Du bei manchen Aufrufen vorher nicht weißt,
-    // ob struct sockaddr mit IPv4, oder aber IPv6 Adressen gefüllt wird.
-    // Für diesen Fall übergibst Du einfach diese Struktur, die genau so aufgebaut ist
-    // wie struct sockaddr, nur dass diese größer ist, dann wandelst Du es zu dem Typ um,
-    // den Du brauchst. Wichtig hierbei ist, dass Du die Adressfamilie sehen kannst,
-    // über das Feld ss_family – Hierüber kannst Du dann sehen, ob es sich um eine AF_INET,
-    // oder aber eine AF_INET6 Adresse handelt. Dann kannst Du es zu einem struct sockaddr_in,
-    // oder einem struct sockaddr_in6 umwandeln, wenn Du willst.
-    struct sockaddr_storage their_addr;
-
-    socklen_t sin_size;
-    struct sigaction sa;
-
     // Startest Du ein Server Programm neu und rufst bind() auf, kann es sein, dass
     // dies nicht klappt. Es kommt die Fehlermeldung, dass der Port von einem anderen
     // Programm benutzt wird. Was hat das bitte zu bedeuten? Nun ja, das Socket, das
@@ -108,10 +131,6 @@ int main(void) {
     // Port benutzen kannst:
     int yes = 1;
 
-    // INET_ADDRSTRLEN > IPv4
-    // INET6_ADDRSTRLEN > IPv6
-    char s[INET6_ADDRSTRLEN];
-
     int rv;
 
     // Kümmert sich darum, dass das struct leer ist
@@ -122,7 +141,7 @@ int main(void) {
     hints.ai_family = AF_UNSPEC;
 
     // ai_socktype -> SOCK_STREAM oder SOCK_DGRAM
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = socktype;
 
     // Durch das benutzen des AI_PASSIVE Flags teilt man dem Programm mit, dass es sich
     // an die IP Adresse des Hosts binden soll, auf dem es läuft. Wenn Du das Programm
@@ -157,13 +176,13 @@ int main(void) {
     // 4. Parameter: Falls alles ordentlich funktioniert, zeigt servinfo auf eine
     // verkettete Liste von struct addrinfo-Elementen, wobei jedes einzelne dieser
     // Elemente ein struct sockaddr besitzt:
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
 
         // Dann machen wir den Aufruf. Falls ein Fehler auftritt (getaddrinfo() gibt
         // eine Zahl != 0 zurück), können wir das ausgeben, indem wir die Funktion
         // gai_strerror() benutzen.
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        return -1;
     }
 
     // loop through all the results and bind to the first we can
@@ -195,6 +214,15 @@ int main(void) {
             exit(1);
         }
 
+        // Mit SO_REUSEPORT dürfen sich mehrere Sockets an denselben Port binden.
+        // Der Kernel verteilt neue Verbindungen dann selbst auf alle Listener,
+        // jeder Worker hat so seine eigene Warteschlange und kein gemeinsames accept().
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+                                    sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(1);
+        }
+
         // Wenn Du dann erst mal das Socket hast, musst Du es erst einmal mit einem
         // Port auf Deinem Computer assoziieren. Dies wird üblicherweise gemacht,
         // wenn Du über die Funktion listen() auf eingehende Verbindungen
@@ -215,7 +243,8 @@ int main(void) {
 
     if (p == NULL) {
         fprintf(stderr, "server: failed to bind\n");
-        return 2;
+        freeaddrinfo(servinfo);
+        return -1;
     }
 
     // Am Ende, wenn wir fertig sind mit der verketteten Liste,
@@ -223,21 +252,183 @@ int main(void) {
     // ndem wir freeaddrinfo() aufrufen.
     freeaddrinfo(servinfo);
 
+    // a knob the kernel refuses is reported, the server runs without it
+    sockopt_listener(sockfd, socktype, tune);
+
     // backlog ist die Anzahl an eingehenden Verbindung in der Warteschleife,
     // die erlaubt werden. Das bedeutet, dass eingehende Verbindungen in einer
     // Warteschleife verweilen, bis sie akzeptiert werden (durch accept()) und
     // hierfür setzt man ein Limit an Verbindungen, die in dieser Warteschleife
     // verweilen dürfen. Die meisten Systeme setzen diesen Wert auf 20, aber
     // Du solltest auch mit 5 oder 10 zurecht kommen.
-    if (listen(sockfd, BACKLOG) == -1) {
+    // Ein Datagramm-Socket hat keine Verbindungen und damit auch nichts anzunehmen.
+    if (socktype == SOCK_STREAM && listen(sockfd, tune->backlog) == -1) {
         perror("listen");
-        exit(1);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// SO_RCVTIMEO or SO_SNDTIMEO, 0 ns waits forever
+static void set_timeout(int fd, int name, uint64_t ns) {
+    struct timeval tv;
+
+    tv.tv_sec = (time_t) (ns / 1000000000);
+    tv.tv_usec = (suseconds_t) (ns % 1000000000 / 1000);
+    if (setsockopt(fd, SOL_SOCKET, name, &tv, sizeof tv) == -1) {
+        perror("setsockopt");
     }
+}
+
+// the child's whole life: read requests and answer them until the client is done
+static void handle_client(int fd, const struct server_config *cfg) {
+    const struct payload *payload = &cfg->payload;
+    int big = payload->fd != -1 || (payload->zerocopy && cfg->tls == NULL);
+    struct tls_conn *tls = NULL;
+    struct pool pool;
+    struct inbuf in;
+    struct batch out;
+    unsigned long total = 0, len;
+    ssize_t n;
+    int answered = 0, plain = 1;
+    char desc[128];
+
+    // the child serves one connection, its pool only has to keep the
+    // buffer a growing request leaves behind
+    pool_init(&pool, cfg->max_request + FRAME_HEADER_MAX);
+    memset(&in, 0, sizeof in);
+    memset(&out, 0, sizeof out);
+
+    // Der Kindprozess hat keine Event-Loop, die Zeit hält hier der Kernel:
+    // recv() und send() geben nach Ablauf mit EAGAIN auf. Bis zur ersten
+    // Anfrage gilt der Handshake-Timeout, danach der für Leerlauf.
+    set_timeout(fd, SO_RCVTIMEO, cfg->handshake_timeout);
+    set_timeout(fd, SO_SNDTIMEO, cfg->write_timeout);
+
+    // blocking, the child has nothing else to do; with kTLS sendall() and sendfile() stay as they are
+    if (cfg->tls != NULL) {
+        if ((tls = tls_conn_new(cfg->tls, fd, 1)) == NULL || tls_handshake(tls) != 1) {
+            fprintf(stderr, "server: TLS handshake failed\n");
+            tls_conn_free(tls);
+            return;
+        }
+        plain = tls_ktls_send(tls);
+        tls_describe(tls, desc, sizeof desc);
+        printf("server: %s\n", desc);
+    }
+
+    for (;;) {
+        if (inbuf_reserve(&in, cfg->max_request, &pool) == -1) {
+            perror("server: request");
+            break;
+        }
+        n = tls != NULL ? tls_recv(tls, in.data + in.len, in.cap - in.len)
+                        : recv(fd, in.data + in.len, in.cap - in.len, 0);
+        if (n <= 0) {
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                fprintf(stderr, "server: client timed out\n");
+            } else if (n == -1) {
+                perror("recv");
+            }
+            break;
+        }
+        in.len += n;
+
+        // answer every complete request of this read, one writev() per batch
+        for (;;) {
+            if (batch_fill(&out, &in, payload, big, cfg->max_request) == -1) {
+                fprintf(stderr, "server: broken or oversized request\n");
+                goto done;
+            }
+            if (!batch_pending(&out)) {
+                break;
+            }
+
+            // the payload's frame header waits for the body instead of leaving alone
+            if (out.big && cfg->tune.cork) {
+                sockopt_cork(fd, 1);
+            }
+
+            while (out.head < out.niov) {
+                if ((n = plain ? batch_send(fd, &out) : batch_send_tls(tls, &out)) == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        fprintf(stderr, "server: client stopped reading\n");
+                    } else {
+                        perror("sendmsg");
+                    }
+                    goto done;
+                }
+                total += n;
+            }
+
+            // files go out with sendfile(), large buffers with MSG_ZEROCOPY
+            if (out.big) {
+                if ((plain ? payload_sendall(fd, payload, &len) : payload_sendall_tls(tls, payload, &len)) == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        fprintf(stderr, "server: client stopped reading\n");
+                    } else {
+                        perror("sendall");
+                    }
+                    printf("We only sent %lu bytes because of the error!\n", len);
+                    goto done;
+                }
+                total += len;
+            }
+            if (out.big && cfg->tune.cork) {
+                sockopt_cork(fd, 0);
+            }
+            batch_reset(&out);
+
+            // the first answer is out, from now on the client may only idle so long
+            if (total > 0 && !answered) {
+                set_timeout(fd, SO_RCVTIMEO, cfg->idle_timeout);
+                answered = 1;
+            }
+        }
+    }
+
+done:
+    printf("sent data...: %lu Bytes\n", total);
+    tls_conn_free(tls);
+    inbuf_free(&in, &pool);
+    pool_destroy(&pool);
+}
+
+// classic model: one child process per accepted connection
+static int serve_fork(int sockfd, const struct server_config *cfg) {
+
+    // new connection on new_fd
+    int new_fd;
+    pid_t pid;
+
+    // struct sockaddr_storage, das groß genug ist um sowohl IPv4 als auch IPv6 structs
+    // zu halten. Es sieht nun mal so aus, dass Du bei manchen Aufrufen vorher nicht weißt,
+    // ob struct sockaddr mit IPv4, oder aber IPv6 Adressen gefüllt wird.
+    // Für diesen Fall übergibst Du einfach diese Struktur, die genau so aufgebaut ist
+    // wie struct sockaddr, nur dass diese größer ist, dann wandelst Du es zu dem Typ um,
+    // den Du brauchst. Wichtig hierbei ist, dass Du die Adressfamilie sehen kannst,
+    // über das Feld ss_family – Hierüber kannst Du dann sehen, ob es sich um eine AF_INET,
+    // oder aber eine AF_INET6 Adresse handelt. Dann kannst Du es zu einem struct sockaddr_in,
+    // oder einem struct sockaddr_in6 umwandeln, wenn Du willst.
+    struct sockaddr_storage their_addr;
+
+    socklen_t sin_size;
+    struct sigaction sa;
+
+    // INET_ADDRSTRLEN > IPv4
+    // INET6_ADDRSTRLEN > IPv6
+    char s[INET6_ADDRSTRLEN];
 
     // der Aufruf von sigaction() ist neu. Der Code wird benutzt um Prozesse zu beenden,
     // die nutzlos sind, nachdem ein Kind-Prozess (erstellt über fork()) beendet wurde.
     // Wenn Du diese Zombie-Prozesse nicht beendest und den Platz wieder nicht frei machst,
     // bekommst Du Probleme mit Deinem System-Administrator.
+    children = cfg->admit;
     sa.sa_handler = sigchld_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
@@ -273,7 +464,15 @@ int main(void) {
         // der Wert von addrlen entsprechend verändert.
         new_fd = accept(sockfd, (struct sockaddr *) &their_addr, &sin_size);
         if (new_fd == -1) {
-            perror("accept");
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+
+        // before the printf() and the fork(), a flood should cost as little as possible
+        if (children != NULL && admit_check(children, (struct sockaddr *) &their_addr, now_ns()) != ADMIT_OK) {
+            conn_shed(new_fd);
             continue;
         }
 
@@ -305,15 +504,11 @@ int main(void) {
         // Clone the calling process, creating an exact copy.
         // Return -1 for errors, 0 to the new process,
         // and the process ID of the new process to the old process.
-        if (!fork()) {
+        if ((pid = fork()) == 0) {
 
             // this is the child process
             close(sockfd); // child doesn't need the listener
 
-            char *buf = "\n\nHello, world!\n\n";
-            unsigned long len, bytes_sent;
-            len = strlen(buf);
-
             // send() gibt die Anzahl an Bytes zurück, die auch tatsächlich rausgeschickt werden.
             // Es kann sein, dass diese Zahl kleiner ist als die von Dir angegebene Zahl!
             // Das liegt daran, dass Du der Funktion manchmal einfach zu viele Daten gibst,
@@ -335,18 +530,325 @@ int main(void) {
             printf("sent data: %lu Bytes\n", bytes_sent);
             */
 
-            if (sendall(new_fd, buf, &len) == -1) {
-                perror("sendall");
-                printf("We only sent %lu bytes because of the error!\n", len);
-            }
-            printf("sent data...: %lu Bytes\n", len);
+            handle_client(new_fd, cfg);
 
             close(new_fd);
             exit(0);
         }
+        if (pid == -1) {
+            perror("fork");
+            if (children != NULL) {
+                admit_release(children);
+            }
+        }
 
         close(new_fd);  // parent doesn't need this
     }
 
     return 0;
+}
+
+// "64k", "16m", "1g" -> bytes, 0 on garbage
+static size_t parse_size(const char *s) {
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'g': case 'G':
+            n <<= 10; // fall through
+        case 'm': case 'M':
+            n <<= 10; // fall through
+        case 'k': case 'K':
+            n <<= 10;
+            end++;
+    }
+    return *end == '\0' ? (size_t) n : 0;
+}
+
+// "handshake=5,idle=30,write=2.5,drain=10" in seconds -> the config's nanoseconds, 0 turns one off
+static int parse_timeouts(struct server_config *cfg, const char *spec) {
+    char *copy, *item, *save, *eq, *end;
+    uint64_t *slot;
+    double secs;
+    int rv = 0;
+
+    if ((copy = strdup(spec)) == NULL) {
+        return -1;
+    }
+    for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if ((eq = strchr(item, '=')) == NULL) {
+            rv = -1;
+            break;
+        }
+        *eq++ = '\0';
+        if (strcmp(item, "handshake") == 0) {
+            slot = &cfg->handshake_timeout;
+        } else if (strcmp(item, "idle") == 0) {
+            slot = &cfg->idle_timeout;
+        } else if (strcmp(item, "write") == 0) {
+            slot = &cfg->write_timeout;
+        } else if (strcmp(item, "drain") == 0) {
+            slot = &cfg->drain_timeout;
+        } else {
+            fprintf(stderr, "server: unknown timeout %s\n", item);
+            rv = -1;
+            break;
+        }
+        secs = strtod(eq, &end);
+        if (end == eq || *end != '\0' || secs < 0) {
+            rv = -1;
+            break;
+        }
+        *slot = (uint64_t) (secs * 1e9);
+    }
+    free(copy);
+    return rv;
+}
+
+// "rate=20,burst=40,max=10000,sources=1m" -> the admission table, NULL on errors;
+// rate is connections per second and source, burst defaults to one second of it
+static struct admit *parse_admit(const char *spec) {
+    char *copy, *item, *save, *eq, *end;
+    double rate = 0;
+    unsigned long burst = 0, max = 0;
+    size_t sources = ADMIT_SOURCES_DEFAULT;
+    struct admit *a = NULL;
+    int ok = 1;
+
+    if ((copy = strdup(spec)) == NULL) {
+        return NULL;
+    }
+    for (item = strtok_r(copy, ",", &save); ok && item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if ((eq = strchr(item, '=')) == NULL) {
+            ok = 0;
+            break;
+        }
+        *eq++ = '\0';
+        if (strcmp(item, "rate") == 0) {
+            rate = strtod(eq, &end);
+            ok = end != eq && *end == '\0' && rate >= 0;
+        } else if (strcmp(item, "burst") == 0) {
+            burst = strtoul(eq, &end, 10);
+            ok = end != eq && *end == '\0';
+        } else if (strcmp(item, "max") == 0) {
+            max = strtoul(eq, &end, 10);
+            ok = end != eq && *end == '\0';
+        } else if (strcmp(item, "sources") == 0) {
+            ok = (sources = parse_size(eq)) != 0;
+        } else {
+            fprintf(stderr, "server: unknown admission setting %s\n", item);
+            ok = 0;
+        }
+    }
+    free(copy);
+    if (!ok || (rate == 0 && max == 0)) {
+        return NULL;
+    }
+    if (burst == 0) {
+        burst = rate < 1 ? 1 : (unsigned long) (rate + 0.999);
+    }
+    if ((a = malloc(sizeof *a)) == NULL || admit_init(a, sources, rate, (unsigned) burst, max) == -1) {
+        fprintf(stderr, "server: no memory for %zu sources\n", sources);
+        free(a);
+        return NULL;
+    }
+    if (rate > 0) {
+        printf("server: admitting %g connections/s per source, bursts of %lu, %zu slots\n",
+               rate, burst, a->mask + 1);
+    }
+    if (max > 0) {
+        printf("server: at most %lu connections\n", max);
+    }
+    return a;
+}
+
+// "cert.pem,key.pem[,noktls]" -> the server's TLS context, NULL on errors
+static struct tls_ctx *parse_tls(const char *spec) {
+    char *copy, *cert, *key, *flag, *save;
+    struct tls_ctx *ctx = NULL;
+
+    if ((copy = strdup(spec)) == NULL) {
+        return NULL;
+    }
+    cert = strtok_r(copy, ",", &save);
+    key = strtok_r(NULL, ",", &save);
+    flag = strtok_r(NULL, ",", &save);
+    if (cert != NULL && key != NULL && (flag == NULL || strcmp(flag, "noktls") == 0)) {
+        ctx = tls_server_ctx(cert, key, flag == NULL);
+    }
+    free(copy);
+    return ctx;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: server [-m fork|epoll|uring|coro|udp] [-p port] [-w workers]\n"
+                    "              [-f file | -b bytes[k|m|g]] [-c] [-M maxrequest] [-q outqueue]\n"
+                    "              [-a adminport|/admin/socket] [-l loglines/s] [-u datagrams/call]\n"
+                    "              [-o backlog=n,fastopen[=n],defer[=s],nodelay,cork,busypoll[=us],sndbuf=n,rcvbuf=n]\n"
+                    "              [-T handshake=s,idle=s,write=s,drain=s] [-H /handoff/socket]\n"
+                    "              [-S cert.pem,key.pem[,noktls]] [-A rate=r,burst=n,max=n,sources=n]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+    // listen on sockfd
+    int sockfd;
+
+    struct server_config cfg;
+    const char *mode = "fork";
+    char opts[256];
+    const char *file = NULL;
+    size_t blob_size = 0;
+    const char *tls = NULL;
+    const char *admit = NULL;
+    int copy = 0;
+    int opt;
+
+    memset(&cfg, 0, sizeof cfg);
+    cfg.port = PORT;
+    cfg.nworkers = 1;
+    cfg.max_request = MAX_REQUEST_DEFAULT;
+    cfg.out_high = OUTQ_HIGH_DEFAULT;
+    cfg.udp_batch = UDP_BATCH_DEFAULT;
+    cfg.tune.backlog = BACKLOG;
+    cfg.handshake_timeout = HANDSHAKE_TIMEOUT_DEFAULT * 1000000000ULL;
+    cfg.idle_timeout = IDLE_TIMEOUT_DEFAULT * 1000000000ULL;
+    cfg.write_timeout = WRITE_TIMEOUT_DEFAULT * 1000000000ULL;
+    cfg.drain_timeout = DRAIN_TIMEOUT_DEFAULT * 1000000000ULL;
+
+    while ((opt = getopt(argc, argv, "m:p:w:f:b:cM:q:a:l:u:o:T:H:S:A:")) != -1) {
+        switch (opt) {
+            case 'm':
+                mode = optarg;
+                break;
+            case 'p':
+                cfg.port = optarg;
+                break;
+            case 'w':
+                cfg.nworkers = atoi(optarg);
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            case 'b':
+                if ((blob_size = parse_size(optarg)) == 0) {
+                    usage();
+                }
+                break;
+            case 'c':
+                copy = 1;
+                break;
+            case 'M':
+                if ((cfg.max_request = parse_size(optarg)) == 0) {
+                    usage();
+                }
+                break;
+            case 'q':
+                if ((cfg.out_high = parse_size(optarg)) == 0) {
+                    usage();
+                }
+                break;
+            case 'a':
+                cfg.admin = optarg;
+                break;
+            case 'l':
+                cfg.log_rate = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                cfg.udp_batch = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                if (sockopt_parse(&cfg.tune, optarg) == -1) {
+                    usage();
+                }
+                break;
+            case 'T':
+                if (parse_timeouts(&cfg, optarg) == -1) {
+                    usage();
+                }
+                break;
+            case 'H':
+                cfg.handoff = optarg;
+                break;
+            case 'S':
+                tls = optarg;
+                break;
+            case 'A':
+                admit = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (cfg.nworkers < 1 || (file != NULL && blob_size != 0) ||
+        cfg.udp_batch < 1 || cfg.udp_batch > UDP_BATCH_MAX) {
+        usage();
+    }
+
+    // a handoff passes one listener per worker, the new process takes at most HANDOFF_MAX
+    if (cfg.handoff != NULL && cfg.nworkers > HANDOFF_MAX) {
+        fprintf(stderr, "server: -H hands off at most %d workers\n", HANDOFF_MAX);
+        return 1;
+    }
+
+    // the handshake needs a loop that waits on the socket for it, uring and coro would need their own
+    if (tls != NULL) {
+        if (strcmp(mode, "epoll") != 0 && strcmp(mode, "fork") != 0) {
+            fprintf(stderr, "server: TLS needs -m epoll or fork\n");
+            return 1;
+        }
+        if ((cfg.tls = parse_tls(tls)) == NULL) {
+            usage();
+        }
+    }
+
+    // datagrams have no connection to refuse
+    if (admit != NULL) {
+        if (strcmp(mode, "udp") == 0) {
+            fprintf(stderr, "server: -A needs a TCP mode\n");
+            return 1;
+        }
+        if ((cfg.admit = parse_admit(admit)) == NULL) {
+            usage();
+        }
+    }
+
+    if (payload_init(&cfg.payload, file, blob_size, copy) == -1) {
+        return 1;
+    }
+
+    sockopt_describe(&cfg.tune, opts, sizeof opts);
+    printf("server: socket options %s\n", opts);
+
+    if (strcmp(mode, "epoll") == 0) {
+        cfg.backend = BACKEND_EPOLL;
+        return run_workers(&cfg);
+    }
+    if (strcmp(mode, "uring") == 0) {
+        cfg.backend = BACKEND_URING;
+        return run_workers(&cfg);
+    }
+    if (strcmp(mode, "coro") == 0) {
+        cfg.backend = BACKEND_CORO;
+        return run_workers(&cfg);
+    }
+    if (strcmp(mode, "udp") == 0) {
+        cfg.backend = BACKEND_UDP;
+        return run_workers(&cfg);
+    }
+    if (strcmp(mode, "fork") != 0) {
+        usage();
+    }
+    if (cfg.handoff != NULL) {
+        fprintf(stderr, "server: -H needs one of the worker modes, fork mode has no handoff\n");
+        return 1;
+    }
+
+    if ((sockfd = get_listener_socket(cfg.port, SOCK_STREAM, 0, &cfg.tune)) == -1) {
+        return 1;
+    }
+
+    return serve_fork(sockfd, &cfg);
 }
\ No newline at end of file
@@ -0,0 +1,410 @@
+/****************************************
+** server.h - shared bits of the server modes
+****************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+// what every connection gets sent unless -f or -b say otherwise
+#define GREETING "\n\nHello, world!\n\n"
+
+#include "admit.h"
+#include "framing.h"
+#include "histogram.h"
+#include "pool.h"
+#include "sockopt.h"
+#include "timewheel.h"
+#include "tls.h"
+
+// what the server sends as one frame (server_payload.c)
+struct payload {
+    const char *data; // in-memory frame, header included, NULL when file-backed
+    size_t len;       // bytes on the wire, header included
+    int fd;           // file served with sendfile(), -1 for in-memory content
+    int zerocopy;     // in-memory content large enough for MSG_ZEROCOPY
+
+    char hdr[FRAME_HEADER_MAX]; // the frame header on its own
+    size_t hdr_len;
+};
+
+// load the greeting, a file (-f) or a generated blob of blob_size bytes (-b),
+// copy forces today's send() copy path for all of them
+int payload_init(struct payload *p, const char *file, size_t blob_size, int copy);
+
+// turn SO_ZEROCOPY on for a connection when the payload wants it
+int payload_enable_zerocopy(const struct payload *p, int sockfd);
+
+// one sendfile()/send() of the framed payload starting at off,
+// every MSG_ZEROCOPY send that went out counts up *issued
+ssize_t payload_send(int sockfd, const struct payload *p, size_t off, int zerocopy, unsigned *issued);
+
+// read MSG_ZEROCOPY notifications off the error queue, counting finished
+// sends into *done and the ones the kernel copied anyway into *copied
+int payload_reap_zerocopy(int sockfd, unsigned *done, unsigned long *copied);
+
+// blocking send of the whole payload, *len returns the number of bytes sent
+int payload_sendall(int sockfd, const struct payload *p, unsigned long *len);
+
+// the same through user space TLS: one record of the payload starting at off,
+// and all of it on a blocking socket
+ssize_t payload_send_tls(struct tls_conn *t, const struct payload *p, size_t off);
+int payload_sendall_tls(struct tls_conn *t, const struct payload *p, unsigned long *len);
+
+// default cap on the size of one request (-M)
+#define MAX_REQUEST_DEFAULT (1024 * 1024)
+
+// what a connection has read and not answered yet (server_requests.c),
+// the buffer comes from the worker's pool and only while there is data
+struct inbuf {
+    char *data;
+    size_t cap;
+    size_t len; // bytes in the buffer
+    size_t pos; // bytes of it already answered
+};
+
+// make room for the next read, growing up to one max_request frame
+int inbuf_reserve(struct inbuf *in, size_t max_request, struct pool *pool);
+
+// append n bytes, growing the same way
+int inbuf_append(struct inbuf *in, const char *data, size_t n, size_t max_request, struct pool *pool);
+
+// hand the buffer back to the pool once every request in it is answered
+void inbuf_release(struct inbuf *in, struct pool *pool);
+void inbuf_free(struct inbuf *in, struct pool *pool);
+
+// how many iovecs one writev() of responses may carry
+#define BATCH_IOV 256
+
+// the responses to every complete request of one read
+struct batch {
+    struct iovec iov[BATCH_IOV];
+    int niov;
+    int head;        // first iovec not completely sent
+    int big;         // a file or zerocopy payload follows the iovecs
+    size_t big_off;  // how far that one got
+    size_t bytes;    // everything the batch sends, the big payload included
+    unsigned long requests;
+
+    // frame headers for echoed requests
+    char hdrs[BATCH_IOV / 2][FRAME_HEADER_MAX];
+    int nhdrs;
+};
+
+// Requests are frames: an empty one asks for the payload, anything else
+// gets echoed back. Queue the answers to all complete requests in in,
+// -1 on a broken frame or one larger than max_request.
+int batch_fill(struct batch *b, struct inbuf *in, const struct payload *p,
+               int big_payload, size_t max_request);
+
+// one sendmsg() of the queued iovecs
+ssize_t batch_send(int sockfd, struct batch *b);
+
+// one TLS record of the queued iovecs, for when the kernel does not encrypt
+ssize_t batch_send_tls(struct tls_conn *t, struct batch *b);
+
+// n bytes of the queued iovecs went out
+void batch_consume(struct batch *b, size_t n);
+
+// anything left to send, iovecs or the big payload
+int batch_pending(const struct batch *b);
+void batch_reset(struct batch *b);
+
+// default high watermark of a connection's output queue (-q), reading
+// stops above it and resumes once the queue is down to a quarter
+#define OUTQ_HIGH_DEFAULT (1024 * 1024)
+
+// one batch of answers in a connection's output queue
+struct outbuf {
+    struct outbuf *next;
+    struct batch b;
+    char *data; // read buffer the echoes point into, once the connection reads on into another
+    size_t cap;
+};
+
+// Eine Verbindung darf weiterlesen, während ihre Antworten noch auf den
+// Socket warten: Die Antworten hängen als Kette in der Queue, und der
+// Lesepuffer, in den ihre Echos zeigen, wandert mit ihnen. Wächst die Queue
+// über die obere Marke, liest die Verbindung nichts mehr, bis sie unter die
+// untere gefallen ist. Ein langsamer Leser hält so weder den Worker auf,
+// noch kann er beliebig viel Speicher belegen.
+struct outq {
+    struct outbuf *head;
+    struct outbuf *tail;
+    struct outbuf *pin; // newest answers that point into the current read buffer
+    size_t bytes;       // queued and not sent yet
+    int paused;         // reading stopped at the high watermark
+};
+
+// queue a filled batch, the echoes in it point into the current read buffer
+void outq_add(struct outq *q, struct outbuf *o);
+
+// the oldest batch is sent, free it together with the read buffer it owns
+void outq_pop(struct outq *q, struct slab *batches, struct pool *pool);
+void outq_free(struct outq *q, struct slab *batches, struct pool *pool);
+
+// hand the read buffer to the answers that point into it and carry an
+// unfinished request over into a new one
+int outq_detach(struct outq *q, struct inbuf *in, size_t max_request, struct pool *pool);
+
+// whether the connection may read more, pausing at high and resuming at low;
+// returns -1 on the transition to paused, 0 while paused, 1 otherwise
+int outq_accepting(struct outq *q, size_t high, size_t low);
+
+// everything main() parsed from the command line
+struct server_config {
+    const char *port;
+    int nworkers;
+    size_t max_request;
+    enum backend {
+        BACKEND_EPOLL,
+        BACKEND_URING,
+        BACKEND_UDP,
+        BACKEND_CORO
+    } backend;
+    struct payload payload;
+    size_t out_high;    // output queue high watermark per connection
+    const char *admin;  // stats endpoint: a local port or a unix socket path, NULL for none
+    unsigned log_rate;  // connection log lines per second and worker, 0 for none
+    unsigned udp_batch; // datagrams per recvmmsg()/sendmmsg(), 1 for recvfrom()/sendto()
+    struct sock_tuning tune; // -o, set on the listeners and inherited by accepted sockets
+
+    // -T, in ns and 0 for none: accept to the first request, between
+    // requests, and an answer the client does not read
+    uint64_t handshake_timeout;
+    uint64_t idle_timeout;
+    uint64_t write_timeout;
+    uint64_t drain_timeout; // how long open connections may finish after SIGUSR2 or a handoff
+
+    const char *handoff; // -H: unix socket a restarted server takes the listeners over from
+    struct tls_ctx *tls; // -S, NULL for plaintext
+    struct admit *admit; // -A, shared by all workers; NULL to take every connection
+};
+
+#define HANDSHAKE_TIMEOUT_DEFAULT 10
+#define IDLE_TIMEOUT_DEFAULT 60
+#define WRITE_TIMEOUT_DEFAULT 30
+#define DRAIN_TIMEOUT_DEFAULT 30
+
+// which of them a connection's timer stands for
+enum deadline {
+    DEADLINE_NONE,
+    DEADLINE_HANDSHAKE,
+    DEADLINE_IDLE,
+    DEADLINE_WRITE
+};
+
+// a peer address, IPv4 or IPv6, without the bulk of a sockaddr_storage
+union peer_addr {
+    struct sockaddr sa;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+};
+
+// what the log ring carries (server_log.c)
+enum log_event {
+    LOG_ACCEPT,
+    LOG_CLOSE
+};
+
+struct log_record {
+    enum log_event event;
+    int fd;
+    unsigned long bytes;
+    union peer_addr addr;
+};
+
+#define LOG_SLOTS 1024
+
+// Loggen per printf() kostet im Event-Loop mehr als das Beantworten einer
+// Anfrage. Deshalb schreibt jeder Worker nur einen Eintrag in seinen eigenen
+// Ring, und ein anderer Thread macht daraus irgendwann Text. Ist der Ring
+// voll oder die Rate überschritten, fällt der Eintrag weg und wird gezählt.
+struct log_ring {
+    struct log_record slots[LOG_SLOTS];
+    unsigned head; // next slot the worker writes
+    unsigned tail; // next slot the log thread reads
+
+    // token bucket, refilled with rate tokens per second
+    unsigned rate;
+    double tokens;
+    uint64_t last_ns;
+
+    unsigned long dropped;
+};
+
+void log_ring_init(struct log_ring *r, unsigned rate);
+
+// queue one record, now is the caller's clock reading in ns
+void log_event(struct log_ring *r, uint64_t now, enum log_event event, int fd,
+               const union peer_addr *addr, unsigned long bytes);
+
+// print what the worker has queued, from any one other thread
+void log_drain(struct log_ring *r, FILE *out);
+
+// CLOCK_MONOTONIC in ns
+uint64_t now_ns(void);
+
+// get sockaddr, IPv4 or IPv6:
+void *get_in_addr(struct sockaddr *sa);
+
+// send the whole buffer, *len returns the number of bytes actually sent
+int sendall(int sockfd, char *buffer, unsigned long *len);
+
+// bind a SOCK_STREAM or SOCK_DGRAM socket to port, tune it and start listening
+// on stream sockets, with reuseport every worker can bind its own listener to the same port
+int get_listener_socket(const char *port, int socktype, int reuseport, const struct sock_tuning *tune);
+
+// one event loop thread with its own listener
+struct worker {
+    int id;
+    const struct server_config *cfg;
+    enum backend backend;
+    int cpu;      // core the worker is pinned to, -1 for none
+    int listener;
+    int wakefd;   // eventfd that kicks the loop out of epoll_wait()
+    int stop;
+    int draining; // stop accepting, return once the open connections are done
+    int done;     // the loop has returned
+    pthread_t thread;
+
+    unsigned long accepts;
+    unsigned long requests;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long zc_sends;  // MSG_ZEROCOPY sends completed
+    unsigned long zc_copied; // ... of which the kernel copied after all
+    unsigned long eagain_reads;
+    unsigned long eagain_writes;
+    unsigned long short_sends; // the socket took only part of a send
+    unsigned long nobufs;      // io_uring reads that found no provided buffer
+    unsigned long paused;      // connections that stopped reading at the high watermark
+    unsigned long recv_calls;  // UDP: receive syscalls, requests / recv_calls is the batching
+    unsigned long send_calls;  // UDP: send syscalls
+    unsigned long gso_sends;   // UDP: sends the kernel split into segments
+    unsigned long timeouts_handshake; // connections closed by each of the timeouts
+    unsigned long timeouts_idle;
+    unsigned long timeouts_write;
+    unsigned long tls_handshakes;   // TLS handshakes completed
+    unsigned long tls_ktls;         // ... after which the kernel took over the record encryption
+    unsigned long shed_rate;        // connections refused, their source was over its rate
+    unsigned long shed_full;        // ... the server had max connections open
+
+    struct histogram first_byte; // ns from accept to the first byte of an answer
+    struct histogram wheel_tick; // ns to advance the timing wheel and close what expired
+    struct log_ring *log;        // NULL unless -l asked for connection logging
+    struct wheel timers;         // the connections' deadlines, every TCP backend but fork
+
+    // the worker's connections, queued response batches and read buffers, see pool.h
+    struct slab conns;
+    struct slab batches;
+    struct pool bufs;
+} __attribute__((aligned(64))); // keep workers' counters on separate cache lines
+
+// start the configured event loops and wait for SIGINT/SIGTERM (server_workers.c)
+int run_workers(const struct server_config *cfg);
+
+// read the worker's wakeup eventfd empty, it keeps waking the loop otherwise
+void wake_clear(int fd);
+
+// ask -A about a connection just accepted: 0 to serve it, conn_admit_done()
+// when it closes; -1 when it was refused, counted and reset (server_workers.c)
+int conn_admit(struct worker *w, int fd, const struct sockaddr *addr);
+void conn_admit_done(struct worker *w);
+
+// close an accepted connection with a RST, nothing lingers in TIME_WAIT (server.c)
+void conn_shed(int fd);
+
+// the admin endpoint and the log thread (server_stats.c)
+struct stats_thread {
+    struct worker *workers;
+    int nworkers;
+    int listener; // -1 without an admin endpoint
+    const char *path; // unix socket to remove at the end
+    int wakefd;
+    int stop;
+    pthread_t thread;
+};
+
+// admin is a listener taken over from the previous process, -1 to open one
+int stats_start(struct stats_thread *st, const struct server_config *cfg,
+                struct worker *workers, int nworkers, int admin);
+void stats_stop(struct stats_thread *st);
+
+// every counter and histogram in the Prometheus text format
+void stats_write(FILE *out, struct worker *workers, int nworkers);
+
+// one worker's event loop (server_epoll.c)
+int serve_epoll(struct worker *w);
+
+// one worker's io_uring loop, -1 if the ring could not be set up (server_uring.c)
+int serve_uring(struct worker *w);
+
+// whether this binary and kernel can run the io_uring backend
+int uring_supported(void);
+
+// one worker's epoll loop with a coroutine per connection (server_coro.c)
+int serve_coro(struct worker *w);
+
+// default and largest number of datagrams moved per syscall (-u)
+#define UDP_BATCH_DEFAULT 64
+#define UDP_BATCH_MAX 1024
+
+// largest payload one datagram can answer with
+#define UDP_PAYLOAD_MAX 65507
+
+// one worker's datagram loop on its own SO_REUSEPORT socket (server_udp.c)
+int serve_udp(struct worker *w);
+
+// Beim Neustart bekommt der neue Prozess die Listener des alten über einen
+// Unix-Socket mit SCM_RIGHTS. Es sind dieselben Sockets im Kernel, samt
+// ihrer Warteschlange: Wer sich gerade verbindet, wartet dort einfach, bis
+// der neue Prozess accept() aufruft. Erst wenn der meldet, dass seine
+// Worker laufen, nimmt der alte keine Verbindungen mehr an, bedient die
+// offenen zu Ende und beendet sich.
+
+// listeners one handoff carries at most, one per worker
+#define HANDOFF_MAX 1024
+
+// what the new process got from the old one (server_handoff.c)
+struct handoff_fds {
+    int conn;  // to the old process until handoff_ready()
+    int n;
+    int fds[HANDOFF_MAX];
+    int admin; // the admin endpoint's listener, -1 for none
+};
+
+// take the listeners over from a server waiting on path:
+// 1 if there was one, 0 if nobody listens there, -1 on errors
+int handoff_take(const char *path, int socktype, struct handoff_fds *got);
+
+// our workers run, the old process may stop accepting and drain
+void handoff_ready(struct handoff_fds *got);
+
+// the old process's side, a thread waiting for the next restart on path
+struct handoff {
+    const char *path;
+    int listener;
+    int wakefd;
+    int stop;
+    int done;   // handed over, the path belongs to the new process now
+    int n;
+    int *fds;
+    int admin;
+    pthread_t thread;
+};
+
+// hand the workers' listeners and admin (-1 for none) to whoever connects to
+// path; once the new process is ready, SIGUSR2 tells the main thread to drain
+int handoff_start(struct handoff *h, const char *path, struct worker *workers, int nworkers, int admin);
+void handoff_stop(struct handoff *h);
+
+#endif
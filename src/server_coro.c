@@ -0,0 +1,302 @@
+/****************************************
+** server_coro.c - one coroutine per connection on the worker's epoll loop
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "server.h"
+#include "coro.h"
+
+// how many ready events one epoll_wait() call may return
+#define MAXEVENTS 64
+
+// coroutines per slab chunk
+#define CORO_CHUNK 256
+
+// answer batches per slab chunk, only connections in the middle of answering hold one
+#define BATCH_CHUNK 16
+
+// what a connection's coroutine starts with
+struct co_conn {
+    int fd;
+    struct worker *w;
+    union peer_addr addr;
+    uint64_t accepted_ns;
+};
+
+// the batch's iovecs with co_sendmsg(), which waits instead of returning EAGAIN
+static ssize_t co_batch_send(int fd, struct batch *b) {
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &b->iov[b->head];
+    msg.msg_iovlen = b->niov - b->head;
+    if ((n = co_sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+        return -1;
+    }
+    batch_consume(b, n);
+    return n;
+}
+
+// the file payload with sendfile(), waiting whenever the socket is full
+static int co_payload_send(int fd, const struct payload *p, unsigned long *len) {
+    unsigned issued = 0;
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < p->len) {
+        if ((n = payload_send(fd, p, sent, 0, &issued)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && co_wait(fd, EPOLLOUT) == 0) {
+                continue;
+            }
+            break;
+        }
+        if (n == 0) {
+            break; // the file got shorter under us
+        }
+        sent += n;
+    }
+    *len = sent;
+    return sent == p->len ? 0 : -1;
+}
+
+// Derselbe Ablauf wie handle_client() im Kindprozess, nur mit co_recv() und
+// co_sendmsg(). Was eine wartende Verbindung hält, ist eine Seite ihres
+// Stacks: Lese- und Antwortpuffer gibt sie zurück, bevor sie auf die nächste
+// Anfrage wartet, und holt sich erst wieder einen, wenn Daten da sind.
+static void co_handle_client(void *arg) {
+    struct co_conn conn = *(struct co_conn *) arg;
+    struct worker *w = conn.w;
+    const struct server_config *cfg = w->cfg;
+    const struct payload *payload = &cfg->payload;
+    int fd = conn.fd, big = payload->fd != -1;
+    struct inbuf in;
+    struct batch *out;
+    unsigned long total = 0, len;
+    enum deadline deadline;
+    ssize_t n;
+    char peek;
+
+    memset(&in, 0, sizeof in);
+
+    for (;;) {
+
+        // park without a read buffer until the next request shows up
+        inbuf_release(&in, &w->bufs);
+        deadline = conn.accepted_ns ? DEADLINE_HANDSHAKE : DEADLINE_IDLE;
+        co_timeout(conn.accepted_ns ? cfg->handshake_timeout : cfg->idle_timeout);
+        if (in.data == NULL && co_recv(fd, &peek, 1, MSG_PEEK) <= 0) {
+            break;
+        }
+        if (inbuf_reserve(&in, cfg->max_request, &w->bufs) == -1) {
+            break;
+        }
+        if ((n = co_recv(fd, in.data + in.len, in.cap - in.len, 0)) <= 0) {
+            break;
+        }
+        in.len += n;
+        COUNTER_ADD(w->bytes_in, n);
+
+        if ((out = slab_alloc(&w->batches)) == NULL) {
+            break;
+        }
+        batch_reset(out);
+
+        // every wait for the socket to take more must see some progress in time
+        deadline = DEADLINE_WRITE;
+        co_timeout(cfg->write_timeout);
+
+        // answer every complete request of this read, one sendmsg() per batch
+        for (;;) {
+            if (batch_fill(out, &in, payload, big, cfg->max_request) == -1) {
+                slab_free(&w->batches, out);
+                goto done;
+            }
+            if (!batch_pending(out)) {
+                break;
+            }
+            if (out->big && cfg->tune.cork) {
+                sockopt_cork(fd, 1);
+            }
+
+            while (out->head < out->niov) {
+                if ((n = co_batch_send(fd, out)) == -1) {
+                    slab_free(&w->batches, out);
+                    goto done;
+                }
+                total += n;
+            }
+            if (out->big) {
+                if (co_payload_send(fd, payload, &len) == -1) {
+                    slab_free(&w->batches, out);
+                    goto done;
+                }
+                total += len;
+            }
+            if (out->big && cfg->tune.cork) {
+                sockopt_cork(fd, 0);
+            }
+
+            if (conn.accepted_ns) {
+                hist_record(&w->first_byte, now_ns() - conn.accepted_ns);
+                conn.accepted_ns = 0;
+            }
+            COUNTER_ADD(w->requests, out->requests);
+            COUNTER_ADD(w->bytes_out, out->bytes);
+            batch_reset(out);
+        }
+        slab_free(&w->batches, out);
+    }
+
+done:
+    if (co_expired()) {
+        if (deadline == DEADLINE_HANDSHAKE) {
+            COUNTER_ADD(w->timeouts_handshake, 1);
+        } else if (deadline == DEADLINE_IDLE) {
+            COUNTER_ADD(w->timeouts_idle, 1);
+        } else {
+            COUNTER_ADD(w->timeouts_write, 1);
+        }
+    }
+    if (w->log != NULL) {
+        log_event(w->log, now_ns(), LOG_CLOSE, fd, &conn.addr, total);
+    }
+    close(fd);
+    inbuf_free(&in, &w->bufs);
+    conn_admit_done(w);
+}
+
+// accept everything that is waiting and give each connection its coroutine
+static void accept_all(struct coro_sched *s, struct worker *w) {
+    struct co_conn conn;
+    socklen_t sin_size;
+
+    for (;;) {
+        sin_size = sizeof conn.addr;
+        conn.fd = accept4(w->listener, &conn.addr.sa, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn.fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        COUNTER_ADD(w->accepts, 1);
+        if (conn_admit(w, conn.fd, &conn.addr.sa) == -1) {
+            continue;
+        }
+        conn.w = w;
+        conn.accepted_ns = now_ns();
+        if (w->log != NULL) {
+            log_event(w->log, conn.accepted_ns, LOG_ACCEPT, conn.fd, &conn.addr, 0);
+        }
+
+        // the coroutine copies conn before it first waits, the stack copy is enough
+        if (co_spawn(s, conn.fd, co_handle_client, &conn) == -1) {
+            perror("co_spawn");
+            close(conn.fd);
+            conn_admit_done(w);
+        }
+    }
+}
+
+int serve_coro(struct worker *w) {
+    struct epoll_event ev, events[MAXEVENTS];
+    struct coro_sched sched;
+    unsigned long armed;
+    uint64_t tick, start;
+    void *ptr;
+    int epfd, n, i, flags;
+
+    slab_init(&w->conns, sizeof(struct coro), CORO_CHUNK);
+    slab_init(&w->batches, sizeof(struct batch), BATCH_CHUNK);
+
+    flags = fcntl(w->listener, F_GETFL, 0);
+    if (flags == -1 || fcntl(w->listener, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return 1;
+    }
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+    co_sched_init(&sched, epfd, &w->conns, CORO_STACK_DEFAULT);
+    wheel_init(&w->timers, now_ns(), WHEEL_TICK_NS);
+    sched.wheel = &w->timers;
+
+    // the listener and the wakeup eventfd are the entries without a coroutine
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->listener, &ev) == -1) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->wakefd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->wakefd, &ev) == -1) {
+        perror("epoll_ctl");
+        return 1;
+    }
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+
+        // the listener is someone else's now, we only finish what we have
+        if (__atomic_load_n(&w->draining, __ATOMIC_RELAXED) && w->listener != -1) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, w->listener, NULL);
+            close(w->listener);
+            w->listener = -1;
+        }
+        if (w->listener == -1 && sched.live == 0) {
+            break;
+        }
+
+        n = epoll_wait(epfd, events, MAXEVENTS, wheel_timeout(&w->timers, now_ns()));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                accept_all(&sched, w);
+            } else if (ptr == &w->wakefd) {
+                wake_clear(w->wakefd);
+            } else {
+                co_event(ptr, events[i].events);
+            }
+        }
+
+        // timed out waits return ETIMEDOUT, the handlers close and count them
+        armed = w->timers.armed;
+        tick = w->timers.now;
+        start = now_ns();
+        co_expire(&sched);
+        if (armed != 0 && w->timers.now != tick) {
+            hist_record(&w->wheel_tick, now_ns() - start);
+        }
+    }
+
+    co_sched_destroy(&sched);
+    close(epfd);
+    return 0;
+}
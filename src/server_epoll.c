@@ -0,0 +1,546 @@
+/****************************************
+** server_epoll.c - per-worker epoll event loop
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include "server.h"
+
+// how many ready events one epoll_wait() call may return
+#define MAXEVENTS 64
+
+// connections per slab chunk
+#define CONN_CHUNK 256
+
+// queued response batches per slab chunk, only busy connections hold any
+#define BATCH_CHUNK 16
+
+// per-connection state machine: read requests, answer them, repeat
+struct conn {
+    int fd;
+    struct worker *w;
+
+    struct inbuf in;  // requests read but not answered yet
+    struct outq out;  // answers not completely sent yet
+    int eof;          // the client is done sending
+    int corked;       // TCP_CORK is on until the big payload is out
+
+    struct tls_conn *tls; // NULL for plaintext
+    int handshaken;
+    int plain;            // what goes to the socket goes out as it is, no TLS or kTLS
+
+    // MSG_ZEROCOPY sends issued and notifications received for them
+    int zerocopy;
+    unsigned zc_issued;
+    unsigned zc_done;
+
+    unsigned long sent;
+    uint64_t accepted_ns; // 0 once the first answer byte went out
+    union peer_addr addr;
+
+    struct timer timer;
+    enum deadline deadline; // what the timer is armed for
+    unsigned long mark;     // sent when it was armed
+};
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// n more bytes went out, the first ones of the connection end its time to first byte
+static void conn_sent(struct conn *c, size_t n) {
+    c->sent += n;
+    COUNTER_ADD(c->w->bytes_out, n);
+    if (c->accepted_ns) {
+        hist_record(&c->w->first_byte, now_ns() - c->accepted_ns);
+        c->accepted_ns = 0;
+    }
+}
+
+// push out queued answers as far as the socket takes them,
+// returns 1 when the queue is empty, 0 when the socket is full, -1 on error
+static int conn_flush(struct conn *c) {
+    struct worker *w = c->w;
+    const struct payload *p = &w->cfg->payload;
+    struct outbuf *o;
+    struct batch *b;
+    ssize_t n;
+
+    while ((o = c->out.head) != NULL) {
+        b = &o->b;
+
+        // with -o cork the payload's frame header waits for the body
+        if (b->big && w->cfg->tune.cork && !c->corked) {
+            sockopt_cork(c->fd, 1);
+            c->corked = 1;
+        }
+
+        while (b->head < b->niov) {
+            if ((n = c->plain ? batch_send(c->fd, b) : batch_send_tls(c->tls, b)) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    COUNTER_ADD(w->eagain_writes, 1);
+                    return 0;
+                }
+                return -1;
+            }
+            if (b->head < b->niov) {
+                COUNTER_ADD(w->short_sends, 1);
+            }
+            c->out.bytes -= n;
+            conn_sent(c, n);
+        }
+
+        // a file or zerocopy payload goes last, with sendfile() or MSG_ZEROCOPY
+        while (b->big && b->big_off < p->len) {
+            n = c->plain ? payload_send(c->fd, p, b->big_off, c->zerocopy, &c->zc_issued)
+                         : payload_send_tls(c->tls, p, b->big_off);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    COUNTER_ADD(w->eagain_writes, 1);
+                    return 0;
+                }
+                return -1;
+            }
+            if (n == 0) {
+                errno = EIO; // the file got shorter under us
+                return -1;
+            }
+            b->big_off += n;
+            c->out.bytes -= n;
+            conn_sent(c, n);
+        }
+        if (c->corked) {
+            sockopt_cork(c->fd, 0);
+            c->corked = 0;
+        }
+
+        COUNTER_ADD(w->requests, b->requests);
+        outq_pop(&c->out, &w->batches, &w->bufs);
+    }
+    return 1;
+}
+
+// queue the answers to everything buffered, -1 on a broken request
+static int conn_answer(struct conn *c) {
+    struct worker *w = c->w;
+    const struct server_config *cfg = w->cfg;
+    struct outbuf *o;
+
+    if ((o = slab_alloc(&w->batches)) == NULL) {
+        return -1;
+    }
+    batch_reset(&o->b);
+
+    if (batch_fill(&o->b, &c->in, &cfg->payload, c->zerocopy || cfg->payload.fd != -1,
+                   cfg->max_request) == -1) {
+        slab_free(&w->batches, o);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // only a partial request left, nothing to queue
+    if (!batch_pending(&o->b)) {
+        slab_free(&w->batches, o);
+        return 0;
+    }
+    outq_add(&c->out, o);
+    return 0;
+}
+
+// 1 once the TLS handshake is through, 0 to wait for the socket, -1 on errors
+static int conn_handshake(struct conn *c) {
+    int r;
+
+    if (c->handshaken) {
+        return 1;
+    }
+    if ((r = tls_handshake(c->tls)) != 1) {
+        return r;
+    }
+    c->handshaken = 1;
+    COUNTER_ADD(c->w->tls_handshakes, 1);
+
+    // from here on the kernel encrypts: writev(), sendfile() and cork as without TLS
+    if (tls_ktls_send(c->tls)) {
+        c->plain = 1;
+        COUNTER_ADD(c->w->tls_ktls, 1);
+    }
+    return 1;
+}
+
+// drive the connection as far as it goes without blocking,
+// returns 0 to wait for the next event, 1 when done, -1 on error
+static int conn_process(struct conn *c) {
+    struct worker *w = c->w;
+    const struct server_config *cfg = w->cfg;
+    size_t pos;
+    ssize_t n;
+    int r;
+
+    // the handshake runs on the loop like everything else, EAGAIN is just a wait
+    if (c->tls != NULL && (r = conn_handshake(c)) != 1) {
+        return r;
+    }
+
+    for (;;) {
+        // answers first, as far as the socket takes them
+        if (conn_flush(c) == -1) {
+            return -1;
+        }
+
+        // too much waiting for a slow reader: leave its requests in the
+        // socket until EPOLLOUT has brought the queue down again
+        if ((r = outq_accepting(&c->out, cfg->out_high, cfg->out_high / 4)) != 1) {
+            if (r == -1) {
+                COUNTER_ADD(w->paused, 1);
+            }
+            return 0;
+        }
+
+        // answer what is already buffered before reading more
+        if (c->in.pos < c->in.len) {
+            pos = c->in.pos;
+            if (conn_answer(c) == -1) {
+                return -1;
+            }
+            if (c->in.pos != pos) {
+                continue;
+            }
+        }
+
+        // all sent, but the kernel may still read from the payload: the
+        // MSG_ZEROCOPY notifications come in with EPOLLERR, then we close
+        if (c->eof) {
+            return c->out.head == NULL && c->zc_done >= c->zc_issued ? 1 : 0;
+        }
+
+        // queued echoes still point into the read buffer, they keep it
+        if (c->out.pin != NULL && outq_detach(&c->out, &c->in, cfg->max_request, &w->bufs) == -1) {
+            return -1;
+        }
+
+        // the buffer is only borrowed from the pool for the read
+        if (inbuf_reserve(&c->in, cfg->max_request, &w->bufs) == -1) {
+            return -1;
+        }
+
+        // Edge-triggered: wir lesen, bis recv() EAGAIN meldet, erst dann
+        // kommt wieder ein Event für diesen Socket.
+        n = c->tls != NULL ? tls_recv(c->tls, c->in.data + c->in.len, c->in.cap - c->in.len)
+                           : recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                COUNTER_ADD(w->eagain_reads, 1);
+                inbuf_release(&c->in, &w->bufs);
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            c->eof = 1;
+            continue;
+        }
+        c->in.len += n;
+        COUNTER_ADD(w->bytes_in, n);
+    }
+}
+
+// collect MSG_ZEROCOPY notifications, -1 if the socket has a real error
+static int conn_reap(struct conn *c) {
+    unsigned long copied = 0;
+    unsigned before = c->zc_done;
+    int err = 0;
+    socklen_t errlen = sizeof err;
+
+    if (payload_reap_zerocopy(c->fd, &c->zc_done, &copied) == -1) {
+        return -1;
+    }
+    COUNTER_ADD(c->w->zc_sends, c->zc_done - before);
+    COUNTER_ADD(c->w->zc_copied, copied);
+
+    // EPOLLERR is also how a failed connection reports itself
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Nach jedem Durchlauf von conn_process() steht fest, worauf die Verbindung
+// wartet: auf das Ende einer Antwort, die der Client nicht abholt, auf die
+// erste Anfrage oder auf die nächste. Die Frist beginnt neu, wenn sich die
+// Art ändert oder seit dem letzten Mal Bytes hinausgegangen sind; ein
+// Client, der eine Anfrage Byte für Byte tröpfeln lässt, verlängert sie nicht.
+static void conn_deadline(struct conn *c) {
+    const struct server_config *cfg = c->w->cfg;
+    enum deadline d;
+    uint64_t timeout;
+
+    if (c->out.head != NULL) {
+        d = DEADLINE_WRITE;
+        timeout = cfg->write_timeout;
+    } else if (c->accepted_ns) {
+        d = DEADLINE_HANDSHAKE;
+        timeout = cfg->handshake_timeout;
+    } else {
+        d = DEADLINE_IDLE;
+        timeout = cfg->idle_timeout;
+    }
+    if (d == c->deadline && c->sent == c->mark) {
+        return;
+    }
+    c->deadline = d;
+    c->mark = c->sent;
+    if (timeout == 0) {
+        timer_cancel(&c->w->timers, &c->timer);
+    } else {
+        timer_arm(&c->w->timers, &c->timer, now_ns(), timeout);
+    }
+}
+
+static void conn_close(struct conn *c) {
+    timer_cancel(&c->w->timers, &c->timer);
+    tls_conn_free(c->tls);
+    if (c->w->log != NULL) {
+        log_event(c->w->log, now_ns(), LOG_CLOSE, c->fd, &c->addr, c->sent);
+    }
+
+    // close() nimmt den Deskriptor auch aus dem epoll-Set heraus
+    close(c->fd);
+    outq_free(&c->out, &c->w->batches, &c->w->bufs);
+    inbuf_free(&c->in, &c->w->bufs);
+    conn_admit_done(c->w);
+    slab_free(&c->w->conns, c);
+}
+
+// accept everything that is waiting on the worker's listener
+static void accept_all(int epfd, struct worker *w) {
+    union peer_addr their_addr;
+    socklen_t sin_size;
+    struct epoll_event ev;
+    struct conn *c;
+    int new_fd;
+
+    // Edge-triggered heißt: epoll meldet den Listener nur einmal, wenn neue
+    // Verbindungen ankommen. Wir müssen deshalb so lange accept() aufrufen,
+    // bis EAGAIN kommt, sonst bleiben Verbindungen in der Warteschlange liegen.
+    for (;;) {
+        sin_size = sizeof their_addr;
+        new_fd = accept4(w->listener, &their_addr.sa, &sin_size,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        COUNTER_ADD(w->accepts, 1);
+        if (conn_admit(w, new_fd, &their_addr.sa) == -1) {
+            continue;
+        }
+
+        if ((c = slab_alloc(&w->conns)) == NULL) {
+            perror("slab_alloc");
+            close(new_fd);
+            conn_admit_done(w);
+            continue;
+        }
+        memset(c, 0, sizeof *c);
+        c->fd = new_fd;
+        c->w = w;
+        c->plain = w->cfg->tls == NULL;
+
+        // the kernel's TLS takes no MSG_ZEROCOPY, a TLS connection copies the payload
+        c->zerocopy = c->plain && w->cfg->payload.zerocopy &&
+                      payload_enable_zerocopy(&w->cfg->payload, new_fd) == 0;
+        if (!c->plain && (c->tls = tls_conn_new(w->cfg->tls, new_fd, 1)) == NULL) {
+            fprintf(stderr, "server: no TLS for this connection\n");
+            close(new_fd);
+            slab_free(&w->conns, c);
+            conn_admit_done(w);
+            continue;
+        }
+
+        c->addr = their_addr;
+        c->accepted_ns = now_ns();
+
+        // the log thread does the inet_ntop() and printf() for us
+        if (w->log != NULL) {
+            log_event(w->log, c->accepted_ns, LOG_ACCEPT, new_fd, &c->addr, 0);
+        }
+
+        // both directions edge-triggered, conn_process() works until EAGAIN anyway
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            conn_close(c);
+            continue;
+        }
+
+        // the first request is often there already
+        if (conn_process(c) != 0) {
+            conn_close(c);
+        } else {
+            conn_deadline(c);
+        }
+    }
+}
+
+// close every connection whose deadline has passed, all of a tick in one go
+static void expire_all(struct worker *w) {
+    uint64_t start = now_ns(), tick = w->timers.now;
+    unsigned long armed = w->timers.armed;
+    struct timer *t, *next;
+    struct conn *c;
+
+    t = wheel_advance(&w->timers, start);
+    for (; t != NULL; t = next) {
+        next = t->next;
+        c = (struct conn *) ((char *) t - offsetof(struct conn, timer));
+        if (c->deadline == DEADLINE_HANDSHAKE) {
+            COUNTER_ADD(w->timeouts_handshake, 1);
+        } else if (c->deadline == DEADLINE_IDLE) {
+            COUNTER_ADD(w->timeouts_idle, 1);
+        } else {
+            COUNTER_ADD(w->timeouts_write, 1);
+        }
+        conn_close(c);
+    }
+
+    // only ticks that had timers to look after count, not the jumps of an idle wheel
+    if (armed != 0 && w->timers.now != tick) {
+        hist_record(&w->wheel_tick, now_ns() - start);
+    }
+}
+
+int serve_epoll(struct worker *w) {
+    struct epoll_event ev, events[MAXEVENTS];
+    struct conn *c;
+    int epfd, n, i;
+
+    slab_init(&w->conns, sizeof(struct conn), CONN_CHUNK);
+    slab_init(&w->batches, sizeof(struct outbuf), BATCH_CHUNK);
+    wheel_init(&w->timers, now_ns(), WHEEL_TICK_NS);
+
+    if (set_nonblocking(w->listener) == -1) {
+        perror("fcntl");
+        return 1;
+    }
+
+    // epoll_create1() gibt Dir einen Deskriptor für eine Interessenliste im
+    // Kernel. Mit epoll_ctl() trägst Du dort die Sockets ein, die Dich
+    // interessieren, und epoll_wait() schläft so lange, bis mindestens einer
+    // davon bereit ist. Anders als bei select() oder poll() muss der Kernel
+    // dafür nicht bei jedem Aufruf die ganze Liste durchgehen.
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    // the listener and the wakeup eventfd are the entries without connection state
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->listener, &ev) == -1) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->wakefd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->wakefd, &ev) == -1) {
+        perror("epoll_ctl");
+        return 1;
+    }
+
+    // main event loop
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+
+        // the listener is someone else's now, we only finish what we have
+        if (__atomic_load_n(&w->draining, __ATOMIC_RELAXED) && w->listener != -1) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, w->listener, NULL);
+            close(w->listener);
+            w->listener = -1;
+        }
+        if (w->listener == -1 && COUNTER_GET(w->conns.in_use) == 0) {
+            break;
+        }
+        // sleep no longer than until the next tick with deadlines in it
+        n = epoll_wait(epfd, events, MAXEVENTS, wheel_timeout(&w->timers, now_ns()));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (c == NULL) {
+                accept_all(epfd, w);
+                continue;
+            }
+
+            // woken up to stop or drain, the top of the loop takes care of it
+            if ((void *) c == &w->wakefd) {
+                wake_clear(w->wakefd);
+                continue;
+            }
+
+            // MSG_ZEROCOPY notifications wait in the error queue
+            if ((events[i].events & EPOLLERR) && c->zerocopy) {
+                if (conn_reap(c) == -1) {
+                    conn_close(c);
+                    continue;
+                }
+                events[i].events &= ~EPOLLERR;
+            }
+
+            if (events[i].events & EPOLLERR) {
+                conn_close(c);
+                continue;
+            }
+
+            // a hangup shows up as EOF or an error inside conn_process()
+            if (conn_process(c) != 0) {
+                conn_close(c);
+            } else {
+                conn_deadline(c);
+            }
+        }
+
+        // after the events, a connection closed here must not show up in them any more
+        expire_all(w);
+    }
+
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,334 @@
+/****************************************
+** server_handoff.c - pass the listeners on to a restarted server
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+
+#define HANDOFF_MAGIC 0x484f4646 // "HOFF"
+
+// descriptors per message, the kernel takes at most 253 in one SCM_RIGHTS
+#define HANDOFF_CHUNK 64
+
+// how long the old process waits for the new one to get its workers going, in ms
+#define HANDOFF_READY_MS 10000
+
+// the first message, the descriptors follow in chunks
+struct handoff_hdr {
+    uint32_t magic;
+    int32_t n;        // worker listeners
+    int32_t admin;    // 1 if the admin listener comes after them
+    int32_t socktype; // SOCK_STREAM or SOCK_DGRAM
+};
+
+static int unix_addr(struct sockaddr_un *sun, const char *path) {
+    memset(sun, 0, sizeof *sun);
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof sun->sun_path) {
+        fprintf(stderr, "server: handoff socket path too long\n");
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+// n descriptors with one byte of data, a message without data carries no fds
+static int send_fds(int conn, const int *fds, int n) {
+    char byte = 0, buf[CMSG_SPACE(HANDOFF_CHUNK * sizeof(int))];
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof msg);
+    memset(buf, 0, sizeof buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+    while (sendmsg(conn, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the next chunk, returns how many descriptors it carried
+static int recv_fds(int conn, int *fds, int max) {
+    char byte, buf[CMSG_SPACE(HANDOFF_CHUNK * sizeof(int))];
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t r;
+    int n = 0;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof buf;
+
+    while ((r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    if (r <= 0) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (n > max) {
+                return -1;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        return -1;
+    }
+    return n;
+}
+
+int handoff_take(const char *path, int socktype, struct handoff_fds *got) {
+    struct sockaddr_un sun;
+    struct handoff_hdr hdr;
+    int fd, n, type, total, i;
+    socklen_t len = sizeof type;
+    ssize_t r;
+
+    got->conn = -1;
+    got->n = 0;
+    got->admin = -1;
+    if (unix_addr(&sun, path) == -1) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("handoff: socket");
+        return -1;
+    }
+
+    // a leftover socket file without a process behind it is a first start
+    if (connect(fd, (struct sockaddr *) &sun, sizeof sun) == -1) {
+        close(fd);
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            return 0;
+        }
+        perror("handoff: connect");
+        return -1;
+    }
+
+    while ((r = recv(fd, &hdr, sizeof hdr, MSG_WAITALL)) == -1 && errno == EINTR);
+    if (r != sizeof hdr || hdr.magic != HANDOFF_MAGIC || hdr.n < 1 || hdr.n > HANDOFF_MAX) {
+        fprintf(stderr, "server: no usable handoff from %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if (hdr.socktype != socktype) {
+        fprintf(stderr, "server: the running server has %s listeners\n",
+                hdr.socktype == SOCK_DGRAM ? "udp" : "tcp");
+        close(fd);
+        return -1;
+    }
+
+    total = hdr.n + (hdr.admin ? 1 : 0);
+    while (got->n < total) {
+        n = total - got->n < HANDOFF_CHUNK ? total - got->n : HANDOFF_CHUNK;
+        if ((n = recv_fds(fd, got->fds + got->n, n)) <= 0) {
+            fprintf(stderr, "server: handoff from %s broke off\n", path);
+            for (i = 0; i < got->n; i++) {
+                close(got->fds[i]);
+            }
+            got->n = 0;
+            close(fd);
+            return -1;
+        }
+        got->n += n;
+    }
+    if (hdr.admin) {
+        got->admin = got->fds[--got->n];
+    }
+
+    // trust, but check: what came over has to be the kind of socket we serve on
+    for (i = 0; i < got->n; i++) {
+        if (getsockopt(got->fds[i], SOL_SOCKET, SO_TYPE, &type, &len) == -1 || type != socktype) {
+            fprintf(stderr, "server: handoff from %s sent something else than listeners\n", path);
+            close(fd);
+            return -1;
+        }
+    }
+    got->conn = fd;
+    return 1;
+}
+
+void handoff_ready(struct handoff_fds *got) {
+    char byte = 1;
+
+    if (got->conn == -1) {
+        return;
+    }
+    if (send(got->conn, &byte, 1, MSG_NOSIGNAL) == -1) {
+        perror("handoff: send");
+    }
+    close(got->conn);
+    got->conn = -1;
+}
+
+// everything over one connection, 0 once the new process said it is ready
+static int handoff_give(struct handoff *h, int conn) {
+    struct handoff_hdr hdr;
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    struct pollfd pfd = {.fd = conn, .events = POLLIN};
+    int fds[HANDOFF_MAX + 1], total, sent, n, type;
+    char byte;
+
+    // only the same user gets our sockets
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != getuid()) {
+        fprintf(stderr, "server: handoff refused to uid %d\n", (int) cred.uid);
+        return -1;
+    }
+
+    len = sizeof type;
+    if (getsockopt(h->fds[0], SOL_SOCKET, SO_TYPE, &type, &len) == -1) {
+        return -1;
+    }
+    hdr.magic = HANDOFF_MAGIC;
+    hdr.n = h->n;
+    hdr.admin = h->admin != -1;
+    hdr.socktype = type;
+    if (send(conn, &hdr, sizeof hdr, MSG_NOSIGNAL) != sizeof hdr) {
+        return -1;
+    }
+
+    memcpy(fds, h->fds, h->n * sizeof *fds);
+    total = h->n;
+    if (h->admin != -1) {
+        fds[total++] = h->admin;
+    }
+    for (sent = 0; sent < total; sent += n) {
+        n = total - sent < HANDOFF_CHUNK ? total - sent : HANDOFF_CHUNK;
+        if (send_fds(conn, fds + sent, n) == -1) {
+            return -1;
+        }
+    }
+
+    // the new process may still fail to start, until it says so we keep accepting
+    if (poll(&pfd, 1, HANDOFF_READY_MS) != 1 || recv(conn, &byte, 1, 0) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *handoff_main(void *arg) {
+    struct handoff *h = arg;
+    struct pollfd pfd[2];
+    int conn;
+
+    pfd[0].fd = h->wakefd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = h->listener;
+    pfd[1].events = POLLIN;
+
+    while (!__atomic_load_n(&h->stop, __ATOMIC_RELAXED)) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (!(pfd[1].revents & POLLIN) ||
+            (conn = accept4(h->listener, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            continue;
+        }
+
+        if (handoff_give(h, conn) == 0) {
+            close(conn);
+            printf("server: listeners handed over, draining\n");
+            fflush(stdout);
+            __atomic_store_n(&h->done, 1, __ATOMIC_RELAXED);
+            kill(getpid(), SIGUSR2);
+            break;
+        }
+        close(conn);
+        fprintf(stderr, "server: handoff failed, still serving\n");
+    }
+    return NULL;
+}
+
+int handoff_start(struct handoff *h, const char *path, struct worker *workers, int nworkers, int admin) {
+    struct sockaddr_un sun;
+    int i;
+
+    memset(h, 0, sizeof *h);
+    h->path = path;
+    h->admin = admin;
+    h->n = nworkers;
+    if (unix_addr(&sun, path) == -1) {
+        return -1;
+    }
+    if ((h->fds = malloc(nworkers * sizeof *h->fds)) == NULL) {
+        fprintf(stderr, "server: out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < nworkers; i++) {
+        h->fds[i] = workers[i].listener;
+    }
+
+    // the previous process is done with the path, or it was left behind by one that died
+    unlink(path);
+    if ((h->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("handoff: socket");
+        return -1;
+    }
+    if (bind(h->listener, (struct sockaddr *) &sun, sizeof sun) == -1 || listen(h->listener, 1) == -1) {
+        perror("handoff: bind");
+        close(h->listener);
+        return -1;
+    }
+    if ((h->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    if ((errno = pthread_create(&h->thread, NULL, handoff_main, h)) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+void handoff_stop(struct handoff *h) {
+    uint64_t one = 1;
+
+    __atomic_store_n(&h->stop, 1, __ATOMIC_RELAXED);
+    if (write(h->wakefd, &one, sizeof one) == -1) {
+        perror("write");
+    }
+    pthread_join(h->thread, NULL);
+    close(h->wakefd);
+    close(h->listener);
+
+    // after a handoff the path is the new process's
+    if (!__atomic_load_n(&h->done, __ATOMIC_RELAXED)) {
+        unlink(h->path);
+    }
+    free(h->fds);
+}
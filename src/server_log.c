@@ -0,0 +1,83 @@
+/****************************************
+** server_log.c - asynchronous, rate-limited connection log
+****************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void log_ring_init(struct log_ring *r, unsigned rate) {
+    memset(r, 0, sizeof *r);
+    r->rate = rate;
+    r->tokens = rate;
+}
+
+void log_event(struct log_ring *r, uint64_t now, enum log_event event, int fd,
+               const union peer_addr *addr, unsigned long bytes) {
+    struct log_record *rec;
+    unsigned head = r->head;
+
+    // refill the bucket for the time since the last record, at most one second's worth
+    r->tokens += (now - r->last_ns) * 1e-9 * r->rate;
+    if (r->tokens > r->rate) {
+        r->tokens = r->rate;
+    }
+    r->last_ns = now;
+
+    if (r->tokens < 1 || head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_SLOTS) {
+        COUNTER_ADD(r->dropped, 1);
+        return;
+    }
+    r->tokens -= 1;
+
+    rec = &r->slots[head % LOG_SLOTS];
+    rec->event = event;
+    rec->fd = fd;
+    rec->bytes = bytes;
+    rec->addr = *addr;
+
+    // the record must be complete before the log thread sees the new head
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_drain(struct log_ring *r, FILE *out) {
+    unsigned tail = r->tail;
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    char s[INET6_ADDRSTRLEN];
+    struct log_record *rec;
+
+    for (; tail != head; tail++) {
+        rec = &r->slots[tail % LOG_SLOTS];
+
+        // inet_ntop() happens here, not in the worker
+        if (rec->addr.sa.sa_family == AF_INET6) {
+            inet_ntop(AF_INET6, &rec->addr.v6.sin6_addr, s, sizeof s);
+        } else if (rec->addr.sa.sa_family == AF_INET) {
+            inet_ntop(AF_INET, &rec->addr.v4.sin_addr, s, sizeof s);
+        } else {
+            strcpy(s, "?");
+        }
+
+        switch (rec->event) {
+            case LOG_ACCEPT:
+                fprintf(out, "server: got connection from %s\n", s);
+                break;
+            case LOG_CLOSE:
+                fprintf(out, "sent data...: %lu Bytes to %s\n", rec->bytes, s);
+                break;
+        }
+    }
+
+    // the slots are free for the worker again
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
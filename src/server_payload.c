@@ -0,0 +1,270 @@
+/****************************************
+** server_payload.c - what the server sends and how
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "server.h"
+#include "framing.h"
+
+// Mit MSG_ZEROCOPY kopiert send() die Daten nicht in den Kernel, sondern pinnt
+// die Seiten und schickt direkt aus unserem Speicher. Das Pinnen und die
+// Benachrichtigung danach kosten aber auch etwas, für kleine Sendungen lohnt
+// es sich nicht. Die Kernel-Doku nennt etwa 10 KB als Grenze.
+#define ZEROCOPY_MIN 16384
+
+// one sendfile() or send() call moves at most this much
+#define SEND_CHUNK (1 << 30)
+
+int payload_init(struct payload *p, const char *file, size_t blob_size, int copy) {
+    struct stat st;
+    size_t i, size;
+    char *data;
+
+    memset(p, 0, sizeof *p);
+    p->fd = -1;
+
+    if (file != NULL) {
+        if ((p->fd = open(file, O_RDONLY | O_CLOEXEC)) == -1 || fstat(p->fd, &st) == -1) {
+            perror(file);
+            return -1;
+        }
+        size = st.st_size;
+        p->hdr_len = frame_header(p->hdr, size);
+        p->len = p->hdr_len + size;
+        if (!copy) {
+            return 0;
+        }
+
+        // copy path: read the file once and serve it out of memory with send()
+        if ((data = malloc(p->len)) == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(data, p->hdr, p->hdr_len);
+        for (i = 0; i < size;) {
+            ssize_t n = pread(p->fd, data + p->hdr_len + i, size - i, i);
+            if (n <= 0) {
+                perror(file);
+                free(data);
+                return -1;
+            }
+            i += n;
+        }
+        close(p->fd);
+        p->fd = -1;
+        p->data = data;
+        return 0;
+    }
+
+    // header and content sit in one writable, page aligned buffer,
+    // so a single send() covers the frame and io_uring can register it
+    size = blob_size ? blob_size : strlen(GREETING);
+    p->hdr_len = frame_header(p->hdr, size);
+    p->len = p->hdr_len + size;
+    data = mmap(NULL, p->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    memcpy(data, p->hdr, p->hdr_len);
+    if (blob_size) {
+        for (i = 0; i < size; i++) {
+            data[p->hdr_len + i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+        }
+    } else {
+        memcpy(data + p->hdr_len, GREETING, size);
+    }
+    p->data = data;
+    p->zerocopy = !copy && p->len >= ZEROCOPY_MIN;
+
+    return 0;
+}
+
+int payload_enable_zerocopy(const struct payload *p, int sockfd) {
+    int yes = 1;
+
+    if (!p->zerocopy) {
+        return 0;
+    }
+    return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof yes);
+}
+
+ssize_t payload_send(int sockfd, const struct payload *p, size_t off, int zerocopy, unsigned *issued) {
+    size_t left = p->len - off;
+    off_t pos;
+
+    if (left > SEND_CHUNK) {
+        left = SEND_CHUNK;
+    }
+
+    // sendfile() schiebt die Daten direkt aus dem Page Cache in den Socket,
+    // sie kommen dabei nie im User-Space an. Nur der Frame-Header geht vorher
+    // mit send() raus, MSG_MORE hält ihn zurück bis die Daten hinterherkommen.
+    if (p->fd != -1) {
+        if (off < p->hdr_len) {
+            return send(sockfd, p->hdr + off, p->hdr_len - off, MSG_NOSIGNAL | MSG_MORE);
+        }
+        pos = off - p->hdr_len;
+        return sendfile(sockfd, p->fd, &pos, left);
+    }
+
+    // only successful MSG_ZEROCOPY sends get a notification number
+    if (zerocopy) {
+        ssize_t n = send(sockfd, p->data + off, left, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (n != -1) {
+            (*issued)++;
+            return n;
+        }
+        if (errno != ENOBUFS) {
+            return n;
+        }
+        // ENOBUFS: out of optmem for notifications, copy this one
+    }
+    return send(sockfd, p->data + off, left, MSG_NOSIGNAL);
+}
+
+int payload_reap_zerocopy(int sockfd, unsigned *done, unsigned long *copied) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    // Ist ein MSG_ZEROCOPY-Send fertig, legt der Kernel eine Nachricht in die
+    // Error-Queue des Sockets (epoll meldet dann EPOLLERR). Darin steht ein
+    // Bereich [ee_info, ee_data] von fertigen send()-Aufrufen, durchnummeriert
+    // ab 0. Erst danach dürfte man den Puffer wieder anfassen.
+    for (;;) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            *done += serr->ee_data - serr->ee_info + 1;
+
+            // the kernel fell back to copying, e.g. over loopback
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                *copied += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+    }
+}
+
+ssize_t payload_send_tls(struct tls_conn *t, const struct payload *p, size_t off) {
+    static __thread char record[TLS_RECORD_MAX];
+    size_t left = p->len - off, n = 0;
+    ssize_t r;
+
+    if (left > TLS_RECORD_MAX) {
+        left = TLS_RECORD_MAX;
+    }
+    if (p->fd == -1) {
+        return tls_send(t, p->data + off, left);
+    }
+
+    // Ohne kTLS muss die Datei doch durch den User-Space: pread() in einen
+    // Record-Puffer, SSL_write() verschlüsselt ihn. Nach EAGAIN liest der
+    // nächste Aufruf dieselben Bytes noch einmal, wie OpenSSL es verlangt.
+    if (off < p->hdr_len) {
+        n = p->hdr_len - off;
+        memcpy(record, p->hdr + off, n);
+    }
+    r = pread(p->fd, record + n, left - n, (off_t) (off + n - p->hdr_len));
+    if (r == -1 || n + (size_t) r == 0) {
+        return r == -1 ? -1 : 0;
+    }
+    return tls_send(t, record, n + (size_t) r);
+}
+
+int payload_sendall_tls(struct tls_conn *t, const struct payload *p, unsigned long *len) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < p->len) {
+        if ((n = payload_send_tls(t, p, sent)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (n == 0) {
+            break; // the file got shorter under us
+        }
+        sent += n;
+    }
+    *len = sent;
+    return sent == p->len ? 0 : -1;
+}
+
+int payload_sendall(int sockfd, const struct payload *p, unsigned long *len) {
+    unsigned done = 0, issued = 0;
+    unsigned long copied = 0;
+    struct pollfd pfd;
+    size_t sent = 0;
+    ssize_t n;
+    int zerocopy;
+
+    // today's copy path
+    if (p->fd == -1 && !p->zerocopy) {
+        *len = p->len;
+        return sendall(sockfd, (char *) p->data, len);
+    }
+
+    zerocopy = payload_enable_zerocopy(p, sockfd) == 0 && p->zerocopy;
+
+    while (sent < p->len) {
+        if ((n = payload_send(sockfd, p, sent, zerocopy, &issued)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (n == 0) {
+            break; // the file got shorter under us
+        }
+        sent += n;
+    }
+    *len = sent;
+
+    // wait for the notifications before the socket goes away
+    pfd.fd = sockfd;
+    pfd.events = 0;
+    while (done < issued && poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLERR)) {
+        if (payload_reap_zerocopy(sockfd, &done, &copied) == -1) {
+            break;
+        }
+    }
+
+    return sent == p->len ? 0 : -1;
+}
@@ -0,0 +1,262 @@
+/****************************************
+** server_requests.c - pipelined requests, batched responses
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "server.h"
+
+// how much a fresh connection gets to read into
+#define INBUF_INITIAL 16384
+
+int inbuf_reserve(struct inbuf *in, size_t max_request, struct pool *pool) {
+    size_t want, cap;
+    char *data;
+
+    // answered requests are gone, move a partial one to the front
+    if (in->pos > 0) {
+        memmove(in->data, in->data + in->pos, in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+    }
+
+    if (in->len < in->cap) {
+        return 0;
+    }
+
+    // a single request fills the whole buffer, grow up to what one frame may take
+    want = in->cap ? in->cap * 2 : INBUF_INITIAL;
+    if (want > max_request + FRAME_HEADER_MAX) {
+        want = max_request + FRAME_HEADER_MAX;
+    }
+    if (want <= in->cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // the next larger size class, the old buffer goes back to the pool
+    if ((data = pool_get(pool, want, &cap)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (in->data != NULL) {
+        memcpy(data, in->data, in->len);
+        pool_put(pool, in->data, in->cap);
+    }
+    in->data = data;
+    in->cap = cap;
+    return 0;
+}
+
+int inbuf_append(struct inbuf *in, const char *data, size_t n, size_t max_request, struct pool *pool) {
+    size_t chunk;
+
+    while (n > 0) {
+        if (inbuf_reserve(in, max_request, pool) == -1) {
+            return -1;
+        }
+        chunk = in->cap - in->len < n ? in->cap - in->len : n;
+        memcpy(in->data + in->len, data, chunk);
+        in->len += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+void inbuf_release(struct inbuf *in, struct pool *pool) {
+
+    // Eine Verbindung, die gerade nichts zu tun hat, hält keinen Puffer.
+    // Bei 100k meist stillen Verbindungen liegen so nur die Puffer der
+    // aktiven im Speicher, der Rest wartet in der Freiliste auf sie.
+    if (in->data != NULL && in->pos == in->len) {
+        inbuf_free(in, pool);
+    }
+}
+
+void inbuf_free(struct inbuf *in, struct pool *pool) {
+    pool_put(pool, in->data, in->cap);
+    memset(in, 0, sizeof *in);
+}
+
+static void batch_add(struct batch *b, const void *base, size_t len) {
+    b->iov[b->niov].iov_base = (void *) base;
+    b->iov[b->niov].iov_len = len;
+    b->niov++;
+    b->bytes += len;
+}
+
+int batch_fill(struct batch *b, struct inbuf *in, const struct payload *p,
+               int big_payload, size_t max_request) {
+    const char *data;
+    char *hdr;
+    size_t len;
+    ssize_t r;
+
+    // Alle kompletten Anfragen, die im Puffer liegen, werden auf einmal
+    // beantwortet. Die Antworten landen nur als Zeiger in einem iovec-Array:
+    // Der Payload zeigt auf den gemeinsamen Puffer, ein Echo direkt in den
+    // Lesepuffer. writev() schickt dann alles mit einem einzigen Aufruf.
+    while (b->niov + 2 <= BATCH_IOV && !b->big) {
+        r = frame_decode(in->data + in->pos, in->len - in->pos, max_request, &data, &len);
+        if (r == -1) {
+            return -1;
+        }
+        if (r == 0) {
+            break;
+        }
+        in->pos += r;
+        b->requests++;
+
+        if (len == 0) {
+            // empty request: the payload. Files and zerocopy buffers can't
+            // go through writev(), they follow once the iovecs are out.
+            if (big_payload) {
+                b->big = 1;
+                b->big_off = 0;
+                b->bytes += p->len;
+            } else {
+                batch_add(b, p->data, p->len);
+            }
+        } else {
+            // anything else comes back as it is
+            hdr = b->hdrs[b->nhdrs++];
+            batch_add(b, hdr, frame_header(hdr, len));
+            batch_add(b, data, len);
+        }
+    }
+
+    return 0;
+}
+
+int batch_pending(const struct batch *b) {
+    return b->head < b->niov || b->big;
+}
+
+ssize_t batch_send(int sockfd, struct batch *b) {
+    struct msghdr msg;
+    ssize_t n;
+
+    if (b->head == b->niov) {
+        return 0;
+    }
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &b->iov[b->head];
+    msg.msg_iovlen = b->niov - b->head;
+
+    // sendmsg() rather than writev() for MSG_NOSIGNAL
+    if ((n = sendmsg(sockfd, &msg, MSG_NOSIGNAL)) == -1) {
+        return -1;
+    }
+    batch_consume(b, n);
+
+    return n;
+}
+
+ssize_t batch_send_tls(struct tls_conn *t, struct batch *b) {
+    ssize_t n;
+
+    if (b->head == b->niov) {
+        return 0;
+    }
+
+    // the batch stays as it is until it went out, so a retry gathers the same bytes
+    if ((n = tls_sendv(t, &b->iov[b->head], b->niov - b->head)) == -1) {
+        return -1;
+    }
+    batch_consume(b, n);
+
+    return n;
+}
+
+void batch_consume(struct batch *b, size_t n) {
+
+    // skip what went out, a partly sent iovec gets trimmed
+    while (b->head < b->niov && n >= b->iov[b->head].iov_len) {
+        n -= b->iov[b->head].iov_len;
+        b->head++;
+    }
+    if (n > 0) {
+        b->iov[b->head].iov_base = (char *) b->iov[b->head].iov_base + n;
+        b->iov[b->head].iov_len -= n;
+    }
+}
+
+void batch_reset(struct batch *b) {
+    b->requests = 0;
+    b->bytes = 0;
+    b->niov = 0;
+    b->head = 0;
+    b->nhdrs = 0;
+    b->big = 0;
+    b->big_off = 0;
+}
+
+void outq_add(struct outq *q, struct outbuf *o) {
+    o->next = NULL;
+    o->data = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = o;
+    } else {
+        q->head = o;
+    }
+    q->tail = o;
+    q->bytes += o->b.bytes;
+
+    // payload answers point into the shared payload, only echoes need the read buffer
+    if (o->b.nhdrs > 0) {
+        q->pin = o;
+    }
+}
+
+void outq_pop(struct outq *q, struct slab *batches, struct pool *pool) {
+    struct outbuf *o = q->head;
+
+    if ((q->head = o->next) == NULL) {
+        q->tail = NULL;
+    }
+    if (q->pin == o) {
+        q->pin = NULL;
+    }
+    pool_put(pool, o->data, o->cap);
+    slab_free(batches, o);
+}
+
+void outq_free(struct outq *q, struct slab *batches, struct pool *pool) {
+    while (q->head != NULL) {
+        outq_pop(q, batches, pool);
+    }
+    q->bytes = 0;
+}
+
+int outq_detach(struct outq *q, struct inbuf *in, size_t max_request, struct pool *pool) {
+    struct inbuf rest;
+    int r = 0;
+
+    memset(&rest, 0, sizeof rest);
+    if (in->pos < in->len) {
+        r = inbuf_append(&rest, in->data + in->pos, in->len - in->pos, max_request, pool);
+    }
+    q->pin->data = in->data;
+    q->pin->cap = in->cap;
+    q->pin = NULL;
+    *in = rest;
+    return r;
+}
+
+int outq_accepting(struct outq *q, size_t high, size_t low) {
+    if (q->paused && q->bytes <= low) {
+        q->paused = 0;
+    } else if (!q->paused && q->bytes >= high) {
+        q->paused = 1;
+        return -1;
+    }
+    return !q->paused;
+}
@@ -0,0 +1,349 @@
+/****************************************
+** server_stats.c - admin endpoint and log thread
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+// how often the log rings are emptied, in ms
+#define LOG_INTERVAL 100
+
+// how long a scraper gets to take its answer, the log rings wait meanwhile
+#define ADMIN_SEND_MS 1000
+
+// one counter per worker, in the Prometheus text format
+#define PER_WORKER(name, help, type, field)                                         \
+    do {                                                                            \
+        fprintf(out, "# HELP server_%s %s\n# TYPE server_%s %s\n", name, help, name, type); \
+        for (i = 0; i < nworkers; i++) {                                            \
+            fprintf(out, "server_%s{worker=\"%d\"} %lu\n", name, workers[i].id,    \
+                    (unsigned long) (field));                                       \
+        }                                                                           \
+    } while (0)
+
+// one value for the whole server
+#define GLOBAL(name, help, type, value)                                             \
+    fprintf(out, "# HELP server_%s %s\n# TYPE server_%s %s\nserver_%s %lu\n",        \
+            name, help, name, type, name, (unsigned long) (value))
+
+// one histogram of every worker, merged into a summary in seconds
+static void summary(FILE *out, const char *name, const char *help, struct worker *workers, int nworkers,
+                    size_t offset) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    struct histogram *h;
+    unsigned q;
+    int i;
+
+    if ((h = malloc(sizeof *h)) == NULL) {
+        return;
+    }
+    hist_init(h);
+    for (i = 0; i < nworkers; i++) {
+        hist_merge(h, (const struct histogram *) ((const char *) &workers[i] + offset));
+    }
+    fprintf(out, "# HELP server_%s %s\n# TYPE server_%s summary\n", name, help, name);
+    for (q = 0; q < sizeof quantiles / sizeof quantiles[0]; q++) {
+        fprintf(out, "server_%s{quantile=\"%g\"} %.9f\n",
+                name, quantiles[q], hist_percentile(h, quantiles[q] * 100) / 1e9);
+    }
+    fprintf(out, "server_%s_sum %.9f\n", name, h->sum / 1e9);
+    fprintf(out, "server_%s_count %lu\n", name, (unsigned long) h->total);
+    free(h);
+}
+
+void stats_write(FILE *out, struct worker *workers, int nworkers) {
+    int i;
+
+    PER_WORKER("accepts_total", "Connections accepted.", "counter",
+               COUNTER_GET(workers[i].accepts));
+    PER_WORKER("connections", "Connections open right now.", "gauge",
+               COUNTER_GET(workers[i].conns.in_use));
+    PER_WORKER("requests_total", "Requests answered.", "counter",
+               COUNTER_GET(workers[i].requests));
+    PER_WORKER("bytes_in_total", "Bytes read from clients.", "counter",
+               COUNTER_GET(workers[i].bytes_in));
+    PER_WORKER("bytes_out_total", "Bytes sent to clients.", "counter",
+               COUNTER_GET(workers[i].bytes_out));
+    PER_WORKER("short_sends_total", "Sends the socket took only part of.", "counter",
+               COUNTER_GET(workers[i].short_sends));
+    PER_WORKER("eagain_reads_total", "Reads that found nothing to read.", "counter",
+               COUNTER_GET(workers[i].eagain_reads));
+    PER_WORKER("eagain_writes_total", "Sends that found the socket full.", "counter",
+               COUNTER_GET(workers[i].eagain_writes));
+    PER_WORKER("paused_total", "Times a connection stopped reading at the output queue's high watermark.",
+               "counter", COUNTER_GET(workers[i].paused));
+    PER_WORKER("nobufs_total", "io_uring reads that found no provided buffer.", "counter",
+               COUNTER_GET(workers[i].nobufs));
+    PER_WORKER("zerocopy_sends_total", "MSG_ZEROCOPY sends completed.", "counter",
+               COUNTER_GET(workers[i].zc_sends));
+    PER_WORKER("zerocopy_copied_total", "MSG_ZEROCOPY sends the kernel copied anyway.", "counter",
+               COUNTER_GET(workers[i].zc_copied));
+    PER_WORKER("recv_calls_total", "UDP receive syscalls.", "counter",
+               COUNTER_GET(workers[i].recv_calls));
+    PER_WORKER("send_calls_total", "UDP send syscalls.", "counter",
+               COUNTER_GET(workers[i].send_calls));
+    PER_WORKER("gso_sends_total", "UDP sends the kernel segmented (GSO).", "counter",
+               COUNTER_GET(workers[i].gso_sends));
+    PER_WORKER("buffer_bytes", "Read buffer bytes handed out.", "gauge",
+               COUNTER_GET(workers[i].bufs.in_use));
+    PER_WORKER("buffer_bytes_high_water", "Most read buffer bytes handed out at once.", "gauge",
+               COUNTER_GET(workers[i].bufs.high_water));
+    PER_WORKER("buffer_pool_hits_total", "Read buffers served from a free list.", "counter",
+               COUNTER_GET(workers[i].bufs.hits));
+    PER_WORKER("buffer_pool_misses_total", "Read buffers that needed malloc().", "counter",
+               COUNTER_GET(workers[i].bufs.misses));
+    PER_WORKER("log_dropped_total", "Connection log lines dropped by the rate limit or a full ring.", "counter",
+               workers[i].log ? COUNTER_GET(workers[i].log->dropped) : 0);
+
+    PER_WORKER("timeouts_handshake_total", "Connections closed without a first request in time.", "counter",
+               COUNTER_GET(workers[i].timeouts_handshake));
+    PER_WORKER("timeouts_idle_total", "Connections closed after sitting idle too long.", "counter",
+               COUNTER_GET(workers[i].timeouts_idle));
+    PER_WORKER("timeouts_write_total", "Connections closed because the client stopped reading.", "counter",
+               COUNTER_GET(workers[i].timeouts_write));
+
+    PER_WORKER("tls_handshakes_total", "TLS handshakes completed.", "counter",
+               COUNTER_GET(workers[i].tls_handshakes));
+    PER_WORKER("tls_ktls_total", "TLS connections whose records the kernel encrypts.", "counter",
+               COUNTER_GET(workers[i].tls_ktls));
+
+    PER_WORKER("shed_rate_total", "Connections refused because their source was over its rate.", "counter",
+               COUNTER_GET(workers[i].shed_rate));
+    PER_WORKER("shed_full_total", "Connections refused at the connection cap.", "counter",
+               COUNTER_GET(workers[i].shed_full));
+    if (nworkers > 0 && workers[0].cfg->admit != NULL) {
+        const struct admit *a = workers[0].cfg->admit;
+
+        GLOBAL("admitted_open", "Connections admitted and not closed yet, with a cap.", "gauge",
+               COUNTER_GET(a->open));
+        GLOBAL("admit_evicted_total", "Idle sources that gave up their slot to a new one.", "counter",
+               COUNTER_GET(a->evicted));
+        GLOBAL("admit_overflows_total", "Sources admitted untracked, their part of the table was full.", "counter",
+               COUNTER_GET(a->overflows));
+    }
+
+    summary(out, "first_byte_seconds", "From accept to the first byte of an answer.",
+            workers, nworkers, offsetof(struct worker, first_byte));
+    summary(out, "wheel_tick_seconds", "Advancing the timing wheel, closing what expired included.",
+            workers, nworkers, offsetof(struct worker, wheel_tick));
+}
+
+// "9100" listens on 127.0.0.1:9100, anything with a slash is a unix socket
+static int admin_listener(const char *where) {
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    int fd, yes = 1;
+
+    if (strchr(where, '/') != NULL) {
+        memset(&sun, 0, sizeof sun);
+        sun.sun_family = AF_UNIX;
+        if (strlen(where) >= sizeof sun.sun_path) {
+            fprintf(stderr, "server: admin socket path too long\n");
+            return -1;
+        }
+        strcpy(sun.sun_path, where);
+        unlink(where);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+            perror("admin: socket");
+            return -1;
+        }
+        if (bind(fd, (struct sockaddr *) &sun, sizeof sun) == -1) {
+            perror("admin: bind");
+            close(fd);
+            return -1;
+        }
+    } else {
+        // only reachable from this machine, the numbers are nobody else's business
+        memset(&sin, 0, sizeof sin);
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((uint16_t) atoi(where));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+            perror("admin: socket");
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        if (bind(fd, (struct sockaddr *) &sin, sizeof sin) == -1) {
+            perror("admin: bind");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 16) == -1) {
+        perror("admin: listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Anders als sendall() wartet das hier nicht ewig: Der Stats-Thread leert
+// auch die Log-Ringe, ein Scraper, der nie liest, würde sie volllaufen
+// lassen. Nach ADMIN_SEND_MS für die ganze Antwort geben wir auf.
+static int admin_send(int fd, const char *buf, size_t len, uint64_t deadline) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    uint64_t now;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            buf += n;
+            len -= (size_t) n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && (now = now_ns()) < deadline &&
+            poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000)) == 1) {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// one scrape: answer with the whole text, HTTP if it looked like HTTP
+static void admin_serve(struct stats_thread *st, int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char req[512], *text = NULL;
+    size_t len = 0;
+    uint64_t deadline = now_ns() + ADMIN_SEND_MS * 1000000ULL;
+    ssize_t r = 0;
+    FILE *out;
+
+    // curl and Prometheus send a request first, nc does not: wait a little for one
+    if (poll(&pfd, 1, 100) == 1) {
+        r = recv(fd, req, sizeof req - 1, 0);
+    }
+
+    if ((out = open_memstream(&text, &len)) == NULL) {
+        return;
+    }
+    stats_write(out, st->workers, st->nworkers);
+    fclose(out);
+
+    if (r > 4 && strncmp(req, "GET ", 4) == 0) {
+        char hdr[128];
+        int n = snprintf(hdr, sizeof hdr,
+                         "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n\r\n", len);
+
+        if (admin_send(fd, hdr, (size_t) n, deadline) == -1) {
+            free(text);
+            return;
+        }
+    }
+    admin_send(fd, text, len, deadline);
+    free(text);
+}
+
+static void *stats_main(void *arg) {
+    struct stats_thread *st = arg;
+    struct pollfd pfd[2];
+    int i, n, fd;
+
+    pfd[0].fd = st->wakefd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = st->listener;
+    pfd[1].events = POLLIN;
+
+    while (!__atomic_load_n(&st->stop, __ATOMIC_RELAXED)) {
+        n = poll(pfd, st->listener != -1 ? 2 : 1, LOG_INTERVAL);
+        if (n == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if (n > 0 && (pfd[1].revents & POLLIN)) {
+            if ((fd = accept4(st->listener, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+                admin_serve(st, fd);
+                close(fd);
+            }
+        }
+
+        for (i = 0; i < st->nworkers; i++) {
+            if (st->workers[i].log != NULL) {
+                log_drain(st->workers[i].log, stdout);
+            }
+        }
+        fflush(stdout);
+    }
+
+    // whatever the workers logged on their way out
+    for (i = 0; i < st->nworkers; i++) {
+        if (st->workers[i].log != NULL) {
+            log_drain(st->workers[i].log, stdout);
+        }
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+int stats_start(struct stats_thread *st, const struct server_config *cfg,
+                struct worker *workers, int nworkers, int admin) {
+    memset(st, 0, sizeof *st);
+    st->workers = workers;
+    st->nworkers = nworkers;
+    st->listener = admin;
+
+    if (cfg->admin != NULL && st->listener == -1 && (st->listener = admin_listener(cfg->admin)) == -1) {
+        return -1;
+    }
+
+    // after a restart both processes poll the same listener, only one gets the scrape
+    if (st->listener != -1 && fcntl(st->listener, F_SETFL, fcntl(st->listener, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    if (cfg->admin != NULL && strchr(cfg->admin, '/') != NULL) {
+        st->path = cfg->admin;
+    }
+    if ((st->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    if ((errno = pthread_create(&st->thread, NULL, stats_main, st)) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+void stats_stop(struct stats_thread *st) {
+    uint64_t one = 1;
+
+    __atomic_store_n(&st->stop, 1, __ATOMIC_RELAXED);
+    if (write(st->wakefd, &one, sizeof one) == -1) {
+        perror("write");
+    }
+    pthread_join(st->thread, NULL);
+    close(st->wakefd);
+    if (st->listener != -1) {
+        close(st->listener);
+    }
+    if (st->path != NULL) {
+        unlink(st->path);
+    }
+}
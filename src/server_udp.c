@@ -0,0 +1,333 @@
+/****************************************
+** server_udp.c - datagram mode with recvmmsg()/sendmmsg()
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "server.h"
+
+// largest datagram, and also the most GRO glues together into one
+#define UDP_BUF 65536
+
+// room for the one UDP_GRO or UDP_SEGMENT value a message carries
+#define UDP_CMSG CMSG_SPACE(sizeof(int))
+
+// Ein Datagramm ist eine Anfrage, Framing braucht es dafür nicht: Ein leeres
+// Datagramm fragt nach dem Payload, alles andere kommt unverändert zurück.
+// Statt eines recvfrom() und sendto() pro Paket holt recvmmsg() bis zu
+// udp_batch Datagramme mit einem Aufruf ab, und sendmmsg() schickt alle
+// Antworten darauf zusammen zurück. Mit UDP_GRO darf der Kernel außerdem
+// mehrere gleich große Datagramme desselben Absenders zu einem Puffer
+// zusammenkleben; wir schicken sie als einen Puffer mit UDP_SEGMENT zurück,
+// und erst der Kernel schneidet ihn wieder in einzelne Datagramme.
+struct udp_loop {
+    struct worker *w;
+    int fd;
+    unsigned batch;
+    int gro;       // the socket takes GRO trains, read their size also after GSO turned it off
+    int gso;       // UDP_SEGMENT works, cleared on the first failure
+
+    char *bufs;    // batch buffers of UDP_BUF bytes from the worker's pool
+    size_t cap;
+    struct mmsghdr *in;
+    struct mmsghdr *out;
+    struct iovec *iov_in;
+    struct iovec *iov_out;
+    union peer_addr *addr;
+    char (*ctl_in)[UDP_CMSG];
+    char (*ctl_out)[UDP_CMSG];
+};
+
+// the segment size GRO glued the datagrams of msg together at, 0 for a single datagram
+static int gro_size(const struct msghdr *msg) {
+    struct cmsghdr *cm;
+    int size;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR((struct msghdr *) msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&size, CMSG_DATA(cm), sizeof size);
+            return size;
+        }
+    }
+    return 0;
+}
+
+static int udp_setup(struct udp_loop *u, struct worker *w) {
+    unsigned n = w->cfg->udp_batch;
+    int yes = 1;
+
+    memset(u, 0, sizeof *u);
+    u->w = w;
+    u->fd = w->listener;
+    u->batch = n;
+
+    // one datagram at a time is the plain recvfrom()/sendto() baseline, without GRO
+    if (n > 1) {
+        u->gro = setsockopt(u->fd, SOL_UDP, UDP_GRO, &yes, sizeof yes) == 0;
+        u->gso = 1;
+    }
+
+    u->bufs = pool_get(&w->bufs, (size_t) n * UDP_BUF, &u->cap);
+    u->in = calloc(n, sizeof *u->in);
+    u->out = calloc(n, sizeof *u->out);
+    u->iov_in = calloc(n, sizeof *u->iov_in);
+    u->iov_out = calloc(n, sizeof *u->iov_out);
+    u->addr = calloc(n, sizeof *u->addr);
+    u->ctl_in = calloc(n, sizeof *u->ctl_in);
+    u->ctl_out = calloc(n, sizeof *u->ctl_out);
+    if (u->bufs == NULL || u->in == NULL || u->out == NULL || u->iov_in == NULL ||
+        u->iov_out == NULL || u->addr == NULL || u->ctl_in == NULL || u->ctl_out == NULL) {
+        fprintf(stderr, "worker %d: out of memory\n", w->id);
+        return -1;
+    }
+    return 0;
+}
+
+static void udp_teardown(struct udp_loop *u) {
+    pool_put(&u->w->bufs, u->bufs, u->cap);
+    free(u->in);
+    free(u->out);
+    free(u->iov_in);
+    free(u->iov_out);
+    free(u->addr);
+    free(u->ctl_in);
+    free(u->ctl_out);
+}
+
+// turn received message i into its answer, out[i]
+static void udp_answer(struct udp_loop *u, unsigned i) {
+    const struct payload *p = &u->w->cfg->payload;
+    struct msghdr *in = &u->in[i].msg_hdr, *out = &u->out[i].msg_hdr;
+    size_t len = u->in[i].msg_len;
+    int seg = u->gro ? gro_size(in) : 0;
+    struct cmsghdr *cm;
+    uint16_t gso;
+
+    memset(out, 0, sizeof *out);
+    out->msg_name = &u->addr[i];
+    out->msg_namelen = in->msg_namelen;
+    out->msg_iov = &u->iov_out[i];
+    out->msg_iovlen = 1;
+
+    COUNTER_ADD(u->w->bytes_in, len);
+    if (len == 0) {
+        u->iov_out[i].iov_base = (char *) p->data + p->hdr_len;
+        u->iov_out[i].iov_len = p->len - p->hdr_len;
+        COUNTER_ADD(u->w->requests, 1);
+    } else {
+        u->iov_out[i].iov_base = u->iov_in[i].iov_base;
+        u->iov_out[i].iov_len = len;
+
+        // a GRO train goes back as one GSO send, cut at the same size; without
+        // GSO udp_send() splits it, the segment size tells it where
+        if (seg > 0 && (size_t) seg < len) {
+            gso = (uint16_t) seg;
+            out->msg_control = u->ctl_out[i];
+            out->msg_controllen = CMSG_SPACE(sizeof gso);
+            cm = CMSG_FIRSTHDR(out);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof gso);
+            memcpy(CMSG_DATA(cm), &gso, sizeof gso);
+            if (u->gso) {
+                COUNTER_ADD(u->w->gso_sends, 1);
+            }
+        }
+        COUNTER_ADD(u->w->requests, seg > 0 ? (len + seg - 1) / seg : 1);
+    }
+    COUNTER_ADD(u->w->bytes_out, u->iov_out[i].iov_len);
+}
+
+// send a GRO train that was meant for GSO as the datagrams it was glued from
+static void udp_send_train(struct udp_loop *u, const struct msghdr *msg) {
+    const char *data = msg->msg_iov->iov_base;
+    size_t len = msg->msg_iov->iov_len, off, n;
+    uint16_t seg;
+
+    memcpy(&seg, CMSG_DATA(CMSG_FIRSTHDR((struct msghdr *) msg)), sizeof seg);
+    for (off = 0; off < len; off += n) {
+        n = len - off < seg ? len - off : seg;
+        COUNTER_ADD(u->w->send_calls, 1);
+        if (sendto(u->fd, data + off, n, 0, msg->msg_name, msg->msg_namelen) == -1 && errno == EINTR) {
+            n = 0;
+        }
+    }
+}
+
+// send n answers, the socket blocks while its send buffer is full
+static void udp_send(struct udp_loop *u, unsigned n) {
+    unsigned done = 0, end;
+    int r, no = 0;
+
+    while (done < n) {
+        // without GSO a train goes out datagram by datagram, everything up to the next in one call
+        if (!u->gso && u->out[done].msg_hdr.msg_controllen) {
+            udp_send_train(u, &u->out[done].msg_hdr);
+            done++;
+            continue;
+        }
+        for (end = done + 1; end < n && (u->gso || !u->out[end].msg_hdr.msg_controllen); end++);
+
+        r = sendmmsg(u->fd, u->out + done, end - done, 0);
+        COUNTER_ADD(u->w->send_calls, 1);
+        if (r > 0) {
+            done += r;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+
+        // A kernel or route without GSO refuses the segmented send: from now
+        // on trains go back one datagram at a time, this one included. GRO
+        // goes off too, only trains still queued need splitting then.
+        if (u->out[done].msg_hdr.msg_controllen && (errno == EIO || errno == EINVAL)) {
+            fprintf(stderr, "worker %d: UDP GSO not available, sending single datagrams\n", u->w->id);
+            u->gso = 0;
+            setsockopt(u->fd, SOL_UDP, UDP_GRO, &no, sizeof no);
+            continue;
+        }
+
+        // a peer that went away is not our problem, the others still get answers
+        if (errno != ECONNREFUSED && errno != EHOSTUNREACH) {
+            perror("sendmmsg");
+        }
+        done++;
+    }
+}
+
+// read everything that is queued, one recvmmsg() per batch
+static int udp_drain(struct udp_loop *u) {
+    unsigned i;
+    int n;
+
+    while (!__atomic_load_n(&u->w->stop, __ATOMIC_RELAXED)) {
+
+        // recvmmsg() overwrites the lengths, every round starts from scratch
+        for (i = 0; i < u->batch; i++) {
+            struct msghdr *m = &u->in[i].msg_hdr;
+
+            u->iov_in[i].iov_base = u->bufs + (size_t) i * UDP_BUF;
+            u->iov_in[i].iov_len = UDP_BUF;
+            m->msg_name = &u->addr[i];
+            m->msg_namelen = sizeof u->addr[i];
+            m->msg_iov = &u->iov_in[i];
+            m->msg_iovlen = 1;
+            m->msg_control = u->gro ? u->ctl_in[i] : NULL;
+            m->msg_controllen = u->gro ? sizeof u->ctl_in[i] : 0;
+            m->msg_flags = 0;
+        }
+
+        n = recvmmsg(u->fd, u->in, u->batch, MSG_DONTWAIT, NULL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                COUNTER_ADD(u->w->eagain_reads, 1);
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvmmsg");
+            return -1;
+        }
+        COUNTER_ADD(u->w->recv_calls, 1);
+
+        for (i = 0; i < (unsigned) n; i++) {
+            udp_answer(u, i);
+        }
+        udp_send(u, n);
+    }
+    return 0;
+}
+
+// the one-syscall-per-packet baseline that -u 1 measures against
+static int udp_drain_single(struct udp_loop *u) {
+    const struct payload *p = &u->w->cfg->payload;
+    union peer_addr addr;
+    socklen_t addrlen;
+    const char *reply;
+    size_t len;
+    ssize_t n;
+
+    while (!__atomic_load_n(&u->w->stop, __ATOMIC_RELAXED)) {
+        addrlen = sizeof addr;
+        n = recvfrom(u->fd, u->bufs, UDP_BUF, MSG_DONTWAIT, &addr.sa, &addrlen);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                COUNTER_ADD(u->w->eagain_reads, 1);
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvfrom");
+            return -1;
+        }
+        COUNTER_ADD(u->w->recv_calls, 1);
+        COUNTER_ADD(u->w->bytes_in, n);
+        COUNTER_ADD(u->w->requests, 1);
+
+        if (n == 0) {
+            reply = p->data + p->hdr_len;
+            len = p->len - p->hdr_len;
+        } else {
+            reply = u->bufs;
+            len = n;
+        }
+        while ((n = sendto(u->fd, reply, len, 0, &addr.sa, addrlen)) == -1 && errno == EINTR);
+        COUNTER_ADD(u->w->send_calls, 1);
+        if (n == -1 && errno != ECONNREFUSED && errno != EHOSTUNREACH) {
+            perror("sendto");
+        }
+        if (n > 0) {
+            COUNTER_ADD(u->w->bytes_out, n);
+        }
+    }
+    return 0;
+}
+
+int serve_udp(struct worker *w) {
+    struct udp_loop u;
+    struct pollfd pfd[2];
+    int rv = 0;
+
+    if (udp_setup(&u, w) == -1) {
+        udp_teardown(&u);
+        return 1;
+    }
+
+    pfd[0].fd = u.fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = w->wakefd;
+    pfd[1].events = POLLIN;
+
+    // sleep in poll() until there are datagrams, then read until there are none
+    // without connections there is nothing to drain, the next process reads on
+    while (rv == 0 && !__atomic_load_n(&w->stop, __ATOMIC_RELAXED) &&
+           !__atomic_load_n(&w->draining, __ATOMIC_RELAXED)) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            rv = 1;
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            rv = (u.batch > 1 ? udp_drain(&u) : udp_drain_single(&u)) == -1;
+        }
+    }
+
+    udp_teardown(&u);
+    return rv;
+}
@@ -0,0 +1,784 @@
+/****************************************
+** server_uring.c - per-worker io_uring event loop
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// submission queue size, completions get twice as many slots
+#define RING_ENTRIES 256
+
+// user_data of the requests that have no connection behind them
+#define UDATA_ACCEPT  1
+#define UDATA_WAKE    2
+#define UDATA_PROVIDE 3
+#define UDATA_CANCEL  4
+
+// a timeout carries its deadline in ns below this bit, no pointer has it set
+#define UDATA_TIMEOUT (1ULL << 63)
+
+// low bits of a connection's user_data tell which request completed
+#define OP_RECV  0
+#define OP_SEND  1
+#define OP_CLOSE 2
+#define OP_MASK  3
+
+// Es gibt hier kein liburing, wir reden direkt mit dem Kernel. io_uring_setup()
+// legt zwei Ringpuffer an, die wir uns per mmap() in den Speicher holen:
+// In die Submission Queue (SQ) schreiben wir Aufträge (accept, write, close...),
+// aus der Completion Queue (CQ) lesen wir die Ergebnisse. Ein einziger
+// io_uring_enter() reicht dann für beliebig viele Aufträge auf einmal.
+struct ring {
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+};
+
+// connections and response batches per slab chunk
+#define CONN_CHUNK  256
+#define BATCH_CHUNK 16
+
+// Statt jeder Verbindung für ihr recv() einen eigenen Puffer mitzugeben, der
+// dann die ganze Zeit beim Kernel liegt, bekommt der Kernel einen Vorrat an
+// Puffern (IORING_OP_PROVIDE_BUFFERS). Erst wenn wirklich Daten ankommen,
+// nimmt er sich einen davon, und wir geben ihn zurück, sobald alles darin
+// beantwortet ist. Eine wartende Verbindung hält so gar keinen Puffer.
+#define RECV_BUFS     256
+#define RECV_BUF_SIZE 16384
+#define RECV_GROUP    0
+
+// per-connection state: requests read, answers not completely sent yet
+struct uconn {
+    int fd;
+    struct inbuf in;
+    int bid;            // provided buffer in.data points into, -1 if it is ours
+    struct batch *out;  // NULL while there is nothing to send
+    struct msghdr msg;
+    int eof;
+    struct uconn *next; // waiting for a provided buffer
+
+    unsigned long sent;
+    uint64_t accepted_ns; // 0 once the first answer byte went out
+    union peer_addr addr; // only filled in for the log
+
+    struct timer timer;
+    enum deadline deadline; // what the timer is armed for
+    unsigned long mark;     // sent when it was armed
+};
+
+// everything one worker's loop works with
+struct uloop {
+    struct ring r;
+    struct worker *w;
+    int fixed;             // the payload is a registered buffer
+    char *bufs;            // provided buffers, NULL when the kernel can't take them
+    struct uconn *waiting; // reads that found no provided buffer
+
+    struct __kernel_timespec ts; // of the timeout request queued last
+    uint64_t timeout_ns;         // when it fires, 0 while none is pending
+};
+
+// one write request moves at most this much, sqe->len is 32 bits
+#define WRITE_CHUNK (1U << 30)
+
+static int ring_setup(struct ring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof *r);
+    memset(&p, 0, sizeof p);
+
+    if ((r->fd = (int) syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+        return -1;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels map both rings with a single mmap()
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_size);
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ptr != r->sq_ptr) {
+            munmap(r->cq_ptr, r->cq_size);
+        }
+        munmap(r->sq_ptr, r->sq_size);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+
+    r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void ring_teardown(struct ring *r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+// hand all queued requests to the kernel, optionally waiting for one completion
+static int ring_submit(struct ring *r, unsigned wait_nr) {
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int n;
+
+    for (;;) {
+        n = (int) syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr, flags, NULL, 0);
+        if (n >= 0) {
+            break;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    // without SQPOLL the kernel consumes the queue inside io_uring_enter()
+    r->to_submit -= (unsigned) n;
+    return n;
+}
+
+static struct io_uring_sqe *ring_get_sqe(struct ring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    // queue full: flush it and carry on
+    if (r->to_submit == r->sq_entries && ring_submit(r, 0) == -1) {
+        return NULL;
+    }
+
+    tail = *r->sq_tail;
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    r->sq_array[idx] = idx;
+
+    // the kernel must see the filled-in entry before the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+
+    return sqe;
+}
+
+// multishot accept: one request, one completion per accepted connection
+static void queue_accept(struct ring *r, int listener, int multishot) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = UDATA_ACCEPT;
+}
+
+// take back a request still pending in the kernel, by its user_data
+static void queue_cancel(struct ring *r, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = UDATA_CANCEL;
+}
+
+// wake the loop after ms even without completions, for the next tick with deadlines;
+// a later timeout still pending is taken back, only one wakes us
+static void queue_timeout(struct uloop *l, int ms, uint64_t due) {
+    struct io_uring_sqe *sqe;
+
+    if (l->timeout_ns != 0 && (sqe = ring_get_sqe(&l->r)) != NULL) {
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = UDATA_TIMEOUT | l->timeout_ns;
+        sqe->user_data = UDATA_CANCEL;
+    }
+    if ((sqe = ring_get_sqe(&l->r)) == NULL) {
+        return;
+    }
+    l->ts.tv_sec = ms / 1000;
+    l->ts.tv_nsec = (long long) (ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &l->ts;
+    sqe->len = 1;
+    sqe->user_data = UDATA_TIMEOUT | due;
+    l->timeout_ns = due;
+}
+
+static void queue_wake(struct ring *r, int wakefd, uint64_t *buf) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakefd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = sizeof *buf;
+    sqe->user_data = UDATA_WAKE;
+}
+
+// hand provided buffers to the kernel, n of them starting with bid
+static void queue_provide(struct uloop *l, unsigned bid, unsigned n) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&l->r);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int) n;
+    sqe->addr = (uintptr_t) (l->bufs + (size_t) bid * RECV_BUF_SIZE);
+    sqe->len = RECV_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = UDATA_PROVIDE;
+}
+
+// the next read of requests
+static void queue_recv(struct uloop *l, struct uconn *c) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&l->r);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->user_data = (uintptr_t) c | OP_RECV;
+
+    // nothing buffered: the kernel picks a provided buffer once data is there
+    if (c->in.data == NULL) {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_GROUP;
+        sqe->len = RECV_BUF_SIZE;
+        return;
+    }
+
+    // a partial request reads on into its own buffer
+    sqe->addr = (uintptr_t) (c->in.data + c->in.len);
+    sqe->len = c->in.cap - c->in.len;
+}
+
+// send what is left of the batched answers. A lone payload comes out of the
+// registered buffer, everything else goes as one sendmsg() over the iovecs.
+static void queue_send(struct uloop *l, struct uconn *c) {
+    const struct payload *p = &l->w->cfg->payload;
+    struct io_uring_sqe *sqe = ring_get_sqe(&l->r);
+    struct iovec *iov = &c->out->iov[c->out->head];
+    const char *base = iov->iov_base;
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->fd = c->fd;
+    sqe->user_data = (uintptr_t) c | OP_SEND;
+
+    if (l->fixed && c->out->niov - c->out->head == 1 && base >= p->data && base < p->data + p->len) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+        sqe->addr = (uintptr_t) base;
+        sqe->len = iov->iov_len > WRITE_CHUNK ? WRITE_CHUNK : (unsigned) iov->iov_len;
+        return;
+    }
+
+    memset(&c->msg, 0, sizeof c->msg);
+    c->msg.msg_iov = iov;
+    c->msg.msg_iovlen = c->out->niov - c->out->head;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uintptr_t) &c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+// a provided buffer is free again, the first waiting read may have it
+static void give_back(struct uloop *l, unsigned bid) {
+    struct uconn *c;
+
+    queue_provide(l, bid, 1);
+    if ((c = l->waiting) != NULL) {
+        l->waiting = c->next;
+        queue_recv(l, c);
+    }
+}
+
+// hand the read buffer back once every request in it is answered,
+// an unfinished one moves out of a provided buffer into a pool buffer
+static int conn_release_buffer(struct uloop *l, struct uconn *c) {
+    struct worker *w = l->w;
+    struct inbuf rest;
+    int r = 0;
+
+    if (c->bid == -1) {
+        inbuf_release(&c->in, &w->bufs);
+        return 0;
+    }
+
+    memset(&rest, 0, sizeof rest);
+    if (c->in.pos < c->in.len) {
+        r = inbuf_append(&rest, c->in.data + c->in.pos, c->in.len - c->in.pos,
+                         w->cfg->max_request, &w->bufs);
+    }
+    give_back(l, (unsigned) c->bid);
+    c->bid = -1;
+    c->in = rest;
+    return r;
+}
+
+static void conn_free(struct uloop *l, struct uconn *c) {
+    struct worker *w = l->w;
+
+    if (w->log != NULL) {
+        log_event(w->log, now_ns(), LOG_CLOSE, c->fd, &c->addr, c->sent);
+    }
+    if (c->bid != -1) {
+        give_back(l, (unsigned) c->bid);
+    } else {
+        inbuf_free(&c->in, &w->bufs);
+    }
+    if (c->out != NULL) {
+        slab_free(&w->batches, c->out);
+    }
+    conn_admit_done(w);
+    slab_free(&w->conns, c);
+}
+
+static void queue_close(struct uloop *l, struct uconn *c) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&l->r);
+
+    timer_cancel(&l->w->timers, &c->timer);
+    if (sqe == NULL) {
+        close(c->fd);
+        conn_free(l, c);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    sqe->user_data = (uintptr_t) c | OP_CLOSE;
+}
+
+// the same deadlines as the epoll loop, armed whenever a request goes to the kernel
+static void conn_deadline(struct uloop *l, struct uconn *c) {
+    const struct server_config *cfg = l->w->cfg;
+    enum deadline d;
+    uint64_t timeout;
+
+    if (c->out != NULL && batch_pending(c->out)) {
+        d = DEADLINE_WRITE;
+        timeout = cfg->write_timeout;
+    } else if (c->accepted_ns) {
+        d = DEADLINE_HANDSHAKE;
+        timeout = cfg->handshake_timeout;
+    } else {
+        d = DEADLINE_IDLE;
+        timeout = cfg->idle_timeout;
+    }
+    if (d == c->deadline && c->sent == c->mark) {
+        return;
+    }
+    c->deadline = d;
+    c->mark = c->sent;
+    if (timeout == 0) {
+        timer_cancel(&l->w->timers, &c->timer);
+    } else {
+        timer_arm(&l->w->timers, &c->timer, now_ns(), timeout);
+    }
+}
+
+// after a read or a finished send: answer buffered requests or read more
+static void conn_advance(struct uloop *l, struct uconn *c) {
+    struct worker *w = l->w;
+    const struct server_config *cfg = w->cfg;
+
+    if (c->in.pos < c->in.len) {
+        if (c->out == NULL) {
+            if ((c->out = slab_alloc(&w->batches)) == NULL) {
+                queue_close(l, c);
+                return;
+            }
+            batch_reset(c->out);
+        }
+        if (batch_fill(c->out, &c->in, &cfg->payload, 0, cfg->max_request) == -1) {
+            queue_close(l, c);
+            return;
+        }
+        if (batch_pending(c->out)) {
+            conn_deadline(l, c);
+            queue_send(l, c);
+            return;
+        }
+    }
+
+    if (c->out != NULL) {
+        slab_free(&w->batches, c->out);
+        c->out = NULL;
+    }
+    if (conn_release_buffer(l, c) == -1 || c->eof) {
+        queue_close(l, c);
+        return;
+    }
+
+    // a partial request, or no provided buffers: the read brings its own buffer
+    if ((c->in.data != NULL || l->bufs == NULL) &&
+        inbuf_reserve(&c->in, cfg->max_request, &w->bufs) == -1) {
+        queue_close(l, c);
+        return;
+    }
+    conn_deadline(l, c);
+    queue_recv(l, c);
+}
+
+// Eine Verbindung, deren Frist abgelaufen ist, hat fast immer ein recv oder
+// send beim Kernel liegen, das noch auf sie zeigt. Freigeben dürfen wir sie
+// erst, wenn es zurückkommt. shutdown() sorgt dafür, dass das sofort
+// passiert: recv liefert 0, send einen Fehler, und der gewohnte Weg über
+// queue_close() räumt auf. Nur wer auf einen Puffer wartet, hat nichts offen.
+static void expire_all(struct uloop *l) {
+    struct worker *w = l->w;
+    uint64_t start = now_ns(), tick = w->timers.now;
+    unsigned long armed = w->timers.armed;
+    struct timer *t, *next;
+    struct uconn *c, **pp;
+
+    t = wheel_advance(&w->timers, start);
+    for (; t != NULL; t = next) {
+        next = t->next;
+        c = (struct uconn *) ((char *) t - offsetof(struct uconn, timer));
+        if (c->deadline == DEADLINE_HANDSHAKE) {
+            COUNTER_ADD(w->timeouts_handshake, 1);
+        } else if (c->deadline == DEADLINE_IDLE) {
+            COUNTER_ADD(w->timeouts_idle, 1);
+        } else {
+            COUNTER_ADD(w->timeouts_write, 1);
+        }
+
+        for (pp = &l->waiting; *pp != NULL && *pp != c; pp = &(*pp)->next);
+        if (*pp != NULL) {
+            *pp = c->next;
+            queue_close(l, c);
+        } else {
+            shutdown(c->fd, SHUT_RDWR);
+        }
+    }
+
+    // only ticks that had timers to look after count, not the jumps of an idle wheel
+    if (armed != 0 && w->timers.now != tick) {
+        hist_record(&w->wheel_tick, now_ns() - start);
+    }
+}
+
+// Give the kernel the provided buffers and wait for its answer: kernels
+// before 5.7 don't know the request, then every read brings its own buffer.
+static void setup_recv_buffers(struct uloop *l) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int res;
+
+    l->bufs = mmap(NULL, (size_t) RECV_BUFS * RECV_BUF_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (l->bufs == MAP_FAILED) {
+        l->bufs = NULL;
+        return;
+    }
+
+    queue_provide(l, 0, RECV_BUFS);
+    if (ring_submit(&l->r, 1) == -1) {
+        perror("io_uring_enter");
+    }
+
+    res = -1;
+    head = *l->r.cq_head;
+    if (head != __atomic_load_n(l->r.cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &l->r.cqes[head & *l->r.cq_mask];
+        res = cqe->res;
+        __atomic_store_n(l->r.cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    if (res < 0) {
+        munmap(l->bufs, (size_t) RECV_BUFS * RECV_BUF_SIZE);
+        l->bufs = NULL;
+    }
+}
+
+int uring_supported(void) {
+    struct ring r;
+
+    if (ring_setup(&r, 4) == -1) {
+        return 0;
+    }
+    ring_teardown(&r);
+    return 1;
+}
+
+int serve_uring(struct worker *w) {
+    const struct payload *p = &w->cfg->payload;
+    struct uloop l;
+    struct io_uring_cqe *cqe;
+    struct iovec iov;
+    struct uconn *c;
+    union peer_addr peer;
+    uint64_t wakebuf;
+    unsigned head;
+    int multishot = 1;
+    int draining = 0;
+    int res, ms;
+
+    memset(&l, 0, sizeof l);
+    l.w = w;
+    l.fixed = 1;
+
+    if (ring_setup(&l.r, RING_ENTRIES) == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    slab_init(&w->conns, sizeof(struct uconn), CONN_CHUNK);
+    slab_init(&w->batches, sizeof(struct batch), BATCH_CHUNK);
+    wheel_init(&w->timers, now_ns(), WHEEL_TICK_NS);
+
+    // Registrierte Puffer pinnt der Kernel einmal beim Registrieren, statt die
+    // Seiten bei jedem einzelnen write() wieder neu nachzuschlagen. Der Payload
+    // ist für alle Verbindungen gleich, also reicht ein einziger Puffer.
+    iov.iov_base = (void *) p->data;
+    iov.iov_len = p->len;
+    if (syscall(__NR_io_uring_register, l.r.fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+        // usually RLIMIT_MEMLOCK or a read-only -c copy, plain sends still work
+        l.fixed = 0;
+    }
+
+    setup_recv_buffers(&l);
+
+    queue_accept(&l.r, w->listener, multishot);
+    queue_wake(&l.r, w->wakefd, &wakebuf);
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+        if (draining && COUNTER_GET(w->conns.in_use) == 0) {
+            break;
+        }
+
+        // sleep no longer than until the next tick with deadlines in it;
+        // one timeout is pending at a time unless a deadline comes sooner
+        if ((ms = wheel_timeout(&w->timers, now_ns())) >= 0) {
+            uint64_t due = now_ns() + (uint64_t) ms * 1000000;
+
+            if (l.timeout_ns == 0 || due < l.timeout_ns) {
+                queue_timeout(&l, ms, due);
+            }
+        }
+
+        // everything queued while handling the last batch goes out here,
+        // together with the wait for the next completions
+        if (ring_submit(&l.r, 1) == -1) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        head = *l.r.cq_head;
+        while (head != __atomic_load_n(l.r.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &l.r.cqes[head & *l.r.cq_mask];
+            res = cqe->res;
+
+            if (cqe->user_data == UDATA_ACCEPT) {
+                if (res >= 0) {
+                    COUNTER_ADD(w->accepts, 1);
+
+                    // the multishot accept has no address for us, one getpeername() when someone asks for it
+                    memset(&peer, 0, sizeof peer);
+                    if (w->log != NULL || w->cfg->admit != NULL) {
+                        socklen_t len = sizeof peer;
+
+                        getpeername(res, &peer.sa, &len);
+                    }
+                    if (conn_admit(w, res, &peer.sa) == -1) {
+                        // refused and closed already
+                    } else if ((c = slab_alloc(&w->conns)) == NULL) {
+                        close(res);
+                        conn_admit_done(w);
+                    } else {
+                        memset(c, 0, sizeof *c);
+                        c->fd = res;
+                        c->bid = -1;
+                        c->accepted_ns = now_ns();
+                        c->addr = peer;
+                        if (w->log != NULL) {
+                            log_event(w->log, c->accepted_ns, LOG_ACCEPT, res, &c->addr, 0);
+                        }
+                        conn_advance(&l, c);
+                    }
+                } else if (res == -EINVAL && multishot) {
+                    // kernels before 5.19 know accept only as one-shot
+                    multishot = 0;
+                } else if (res != -ECANCELED) {
+                    fprintf(stderr, "accept: %s\n", strerror(-res));
+                }
+
+                // a multishot accept ends when the kernel drops IORING_CQE_F_MORE
+                if (!(cqe->flags & IORING_CQE_F_MORE) && !draining) {
+                    queue_accept(&l.r, w->listener, multishot);
+                }
+            } else if (cqe->user_data == UDATA_WAKE) {
+                // the loop condition looks at w->stop, a drain takes the accept back
+                if (__atomic_load_n(&w->draining, __ATOMIC_RELAXED) && !draining) {
+                    draining = 1;
+                    queue_cancel(&l.r, UDATA_ACCEPT);
+                }
+                queue_wake(&l.r, w->wakefd, &wakebuf);
+            } else if (cqe->user_data & UDATA_TIMEOUT) {
+                // only the current one clears it, a removed or older one is stale
+                if ((cqe->user_data & ~UDATA_TIMEOUT) == l.timeout_ns) {
+                    l.timeout_ns = 0;
+                }
+            } else if (cqe->user_data == UDATA_CANCEL) {
+                // the accept's or timeout's own completion says -ECANCELED
+            } else if (cqe->user_data == UDATA_PROVIDE) {
+                if (res < 0) {
+                    fprintf(stderr, "provide buffers: %s\n", strerror(-res));
+                }
+            } else {
+                c = (struct uconn *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+
+                switch (cqe->user_data & OP_MASK) {
+                    case OP_CLOSE:
+                        conn_free(&l, c);
+                        break;
+                    case OP_RECV:
+                        // all provided buffers are busy, wait until one comes back
+                        if (res == -ENOBUFS) {
+                            COUNTER_ADD(w->nobufs, 1);
+                            c->next = l.waiting;
+                            l.waiting = c;
+                            break;
+                        }
+                        if (res < 0) {
+                            queue_close(&l, c);
+                            break;
+                        }
+                        if (cqe->flags & IORING_CQE_F_BUFFER) {
+                            c->bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                            c->in.data = l.bufs + (size_t) c->bid * RECV_BUF_SIZE;
+                            c->in.cap = RECV_BUF_SIZE;
+                        }
+                        if (res == 0) {
+                            c->eof = 1;
+                        }
+                        c->in.len += res;
+                        COUNTER_ADD(w->bytes_in, res);
+                        conn_advance(&l, c);
+                        break;
+                    case OP_SEND:
+                        if (res <= 0) {
+                            queue_close(&l, c);
+                            break;
+                        }
+                        batch_consume(c->out, res);
+                        c->sent += res;
+                        COUNTER_ADD(w->bytes_out, res);
+                        if (c->accepted_ns) {
+                            hist_record(&w->first_byte, now_ns() - c->accepted_ns);
+                            c->accepted_ns = 0;
+                        }
+                        if (c->out->head < c->out->niov) {
+                            COUNTER_ADD(w->short_sends, 1);
+                            conn_deadline(&l, c);
+                            queue_send(&l, c);
+                            break;
+                        }
+                        COUNTER_ADD(w->requests, c->out->requests);
+                        batch_reset(c->out);
+                        conn_advance(&l, c);
+                        break;
+                }
+            }
+
+            head++;
+        }
+        __atomic_store_n(l.r.cq_head, head, __ATOMIC_RELEASE);
+
+        // after the completions, a connection closed there must not show up in them any more
+        expire_all(&l);
+    }
+
+    ring_teardown(&l.r);
+    if (l.bufs != NULL) {
+        munmap(l.bufs, (size_t) RECV_BUFS * RECV_BUF_SIZE);
+    }
+    return 0;
+}
+
+#else
+
+int uring_supported(void) {
+    return 0;
+}
+
+int serve_uring(struct worker *w) {
+    (void) w;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,365 @@
+/****************************************
+** server_workers.c - one pinned event loop per core
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    cpu_set_t set;
+
+    // pin the thread so its listener, connections and caches stay on one core
+    if (w->cpu != -1) {
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+            fprintf(stderr, "worker %d: could not pin to cpu %d\n", w->id, w->cpu);
+        }
+    }
+
+    if (w->backend == BACKEND_UDP) {
+        serve_udp(w);
+    } else if (w->backend == BACKEND_CORO) {
+        serve_coro(w);
+    } else if (w->backend != BACKEND_URING || serve_uring(w) == -1) {
+        serve_epoll(w);
+    }
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void wake_clear(int fd) {
+    uint64_t n;
+
+    if (read(fd, &n, sizeof n) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+}
+
+int conn_admit(struct worker *w, int fd, const struct sockaddr *addr) {
+    const struct server_config *cfg = w->cfg;
+
+    if (cfg->admit == NULL) {
+        return 0;
+    }
+    switch (admit_check(cfg->admit, addr, now_ns())) {
+        case ADMIT_OK:
+            return 0;
+        case ADMIT_RATE:
+            COUNTER_ADD(w->shed_rate, 1);
+            break;
+        case ADMIT_FULL:
+            COUNTER_ADD(w->shed_full, 1);
+            break;
+    }
+    conn_shed(fd);
+    return -1;
+}
+
+void conn_admit_done(struct worker *w) {
+    if (w->cfg->admit != NULL) {
+        admit_release(w->cfg->admit);
+    }
+}
+
+// how often the main thread looks whether the workers have drained, in us
+#define DRAIN_POLL_US 10000
+
+// stop accepting and give the open connections until timeout to finish
+static void drain_workers(struct worker *workers, int nworkers, uint64_t timeout) {
+    uint64_t start = now_ns(), one = 1;
+    unsigned long open = 0;
+    int i, done;
+
+    for (i = 0; i < nworkers; i++) {
+        open += COUNTER_GET(workers[i].conns.in_use);
+        __atomic_store_n(&workers[i].draining, 1, __ATOMIC_RELAXED);
+        if (write(workers[i].wakefd, &one, sizeof one) == -1) {
+            perror("write");
+        }
+    }
+    printf("server: draining %lu connections\n", open);
+    fflush(stdout);
+
+    for (;;) {
+        for (done = 0, open = 0, i = 0; i < nworkers; i++) {
+            done += __atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE);
+            open += COUNTER_GET(workers[i].conns.in_use);
+        }
+        if (done == nworkers) {
+            printf("server: drained in %.2f s\n", (now_ns() - start) / 1e9);
+            return;
+        }
+        if (now_ns() - start >= timeout) {
+            printf("server: drain deadline passed, cutting off %lu connections\n", open);
+            return;
+        }
+        usleep(DRAIN_POLL_US);
+    }
+}
+
+static void print_counters(struct worker *workers, int nworkers) {
+    unsigned long accepts = 0, bytes_out = 0, zc_sends = 0, zc_copied = 0;
+    unsigned long requests = 0, recv_calls = 0, send_calls = 0, gso_sends = 0;
+    unsigned long handshake = 0, idle = 0, write = 0, tls = 0, ktls = 0, shed_rate = 0, shed_full = 0;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        struct slab *conns = &workers[i].conns;
+        struct pool *bufs = &workers[i].bufs;
+        unsigned long a = COUNTER_GET(workers[i].accepts);
+        unsigned long b = COUNTER_GET(workers[i].bytes_out);
+
+        printf("worker %d (cpu %d): %lu accepts, %lu bytes out\n",
+               workers[i].id, workers[i].cpu, a, b);
+        printf("  conns: %lu open, high water %lu, %lu hits, %lu misses\n",
+               COUNTER_GET(conns->in_use), COUNTER_GET(conns->high_water),
+               COUNTER_GET(conns->hits), COUNTER_GET(conns->misses));
+        printf("  buffers: %lu KiB out, high water %lu KiB, %lu hits, %lu misses\n",
+               COUNTER_GET(bufs->in_use) >> 10, COUNTER_GET(bufs->high_water) >> 10,
+               COUNTER_GET(bufs->hits), COUNTER_GET(bufs->misses));
+        accepts += a;
+        bytes_out += b;
+        zc_sends += COUNTER_GET(workers[i].zc_sends);
+        zc_copied += COUNTER_GET(workers[i].zc_copied);
+        requests += COUNTER_GET(workers[i].requests);
+        recv_calls += COUNTER_GET(workers[i].recv_calls);
+        send_calls += COUNTER_GET(workers[i].send_calls);
+        gso_sends += COUNTER_GET(workers[i].gso_sends);
+        handshake += COUNTER_GET(workers[i].timeouts_handshake);
+        idle += COUNTER_GET(workers[i].timeouts_idle);
+        write += COUNTER_GET(workers[i].timeouts_write);
+        tls += COUNTER_GET(workers[i].tls_handshakes);
+        ktls += COUNTER_GET(workers[i].tls_ktls);
+        shed_rate += COUNTER_GET(workers[i].shed_rate);
+        shed_full += COUNTER_GET(workers[i].shed_full);
+    }
+    printf("total: %lu accepts, %lu bytes out\n", accepts, bytes_out);
+    if (recv_calls) {
+        printf("udp: %lu datagrams in %lu receive and %lu send calls (%.1f per receive), %lu GSO sends\n",
+               requests, recv_calls, send_calls, (double) requests / recv_calls, gso_sends);
+    }
+    if (handshake + idle + write) {
+        printf("timeouts: %lu handshake, %lu idle, %lu write\n", handshake, idle, write);
+    }
+    if (tls) {
+        printf("tls: %lu handshakes, %lu with kTLS\n", tls, ktls);
+    }
+    if (shed_rate + shed_full) {
+        printf("admission: %lu refused over their source's rate, %lu at the connection cap\n",
+               shed_rate, shed_full);
+    }
+    if (zc_sends) {
+        printf("zerocopy: %lu sends completed, %lu of them copied by the kernel\n",
+               zc_sends, zc_copied);
+    }
+    fflush(stdout);
+}
+
+int run_workers(const struct server_config *cfg) {
+    enum backend backend = cfg->backend;
+    int nworkers = cfg->nworkers;
+    int socktype = backend == BACKEND_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    struct worker *workers;
+    struct stats_thread stats;
+    struct handoff_fds *taken = NULL;
+    struct handoff handoff;
+    sigset_t mask;
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    uint64_t one = 1;
+    int i, sig, rv;
+
+    // SIGINT/SIGTERM stop the server, SIGUSR1 prints the counters, SIGUSR2
+    // drains it. They are blocked before the threads start so only sigwait()
+    // below sees them.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // we handle broken pipes through send()'s return value
+    signal(SIGPIPE, SIG_IGN);
+
+    if (backend == BACKEND_URING && !uring_supported()) {
+        fprintf(stderr, "server: io_uring not available, falling back to epoll\n");
+        backend = BACKEND_EPOLL;
+    }
+    if (backend == BACKEND_URING && cfg->payload.fd != -1) {
+        fprintf(stderr, "server: io_uring serves in-memory payloads only, falling back to epoll\n");
+        backend = BACKEND_EPOLL;
+    }
+
+    if (backend == BACKEND_UDP &&
+        (cfg->payload.data == NULL || cfg->payload.len - cfg->payload.hdr_len > UDP_PAYLOAD_MAX)) {
+        fprintf(stderr, "server: udp answers with an in-memory payload of at most %d bytes\n",
+                UDP_PAYLOAD_MAX);
+        return 1;
+    }
+
+    // a running server hands us its listeners, as many workers as it had
+    if (cfg->handoff != NULL) {
+        if ((taken = malloc(sizeof *taken)) == NULL) {
+            fprintf(stderr, "server: out of memory\n");
+            return 1;
+        }
+        if ((rv = handoff_take(cfg->handoff, socktype, taken)) == -1) {
+            free(taken);
+            return 1;
+        }
+        if (rv == 0) {
+            free(taken);
+            taken = NULL;
+        } else {
+            printf("server: took over %d listener%s\n", taken->n, taken->n > 1 ? "s" : "");
+            if (taken->n != nworkers) {
+                printf("server: running %d workers like the previous server, not %d\n", taken->n, nworkers);
+                nworkers = taken->n;
+            }
+        }
+    }
+
+    // Unter taskset oder in einem cpuset darf der Prozess nur auf einen Teil
+    // der Kerne. Gepinnt wird auf die, die uns die Affinitätsmaske erlaubt,
+    // Worker i auf den i-ten davon; sonst landen Worker auf fremden Kernen.
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &allowed)) {
+                cpus[ncpus++] = i;
+            }
+        }
+    }
+    if (ncpus == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (ncpus = 0; ncpus < (online < 1 ? 1 : online) && ncpus < CPU_SETSIZE; ncpus++) {
+            cpus[ncpus] = ncpus;
+        }
+    }
+
+    if (posix_memalign((void **) &workers, 64, nworkers * sizeof *workers) != 0) {
+        fprintf(stderr, "server: out of memory\n");
+        return 1;
+    }
+    memset(workers, 0, nworkers * sizeof *workers);
+
+    // every worker gets its own SO_REUSEPORT listener, the kernel
+    // spreads incoming connections over them by hashing the 4-tuple
+    for (i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+
+        w->id = i;
+        w->cfg = cfg;
+        pool_init(&w->bufs, POOL_CACHE_DEFAULT);
+        hist_init(&w->first_byte);
+        hist_init(&w->wheel_tick);
+        if (cfg->log_rate) {
+            if ((w->log = malloc(sizeof *w->log)) == NULL) {
+                fprintf(stderr, "server: out of memory\n");
+                return 1;
+            }
+            log_ring_init(w->log, cfg->log_rate);
+        }
+        w->backend = backend;
+        w->cpu = nworkers > 1 ? cpus[i % ncpus] : -1;
+        if (taken != NULL) {
+            w->listener = taken->fds[i];
+        } else if ((w->listener = get_listener_socket(cfg->port, socktype, nworkers > 1, &cfg->tune)) == -1) {
+            return 1;
+        }
+        if ((w->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+            perror("eventfd");
+            return 1;
+        }
+    }
+
+    printf("server: waiting for %s (%s, %d worker%s)...\n",
+           backend == BACKEND_UDP ? "datagrams" : "connections",
+           backend == BACKEND_UDP ? "udp" : backend == BACKEND_URING ? "io_uring" :
+           backend == BACKEND_CORO ? "coroutines" : "epoll",
+           nworkers, nworkers > 1 ? "s" : "");
+    fflush(stdout);
+
+    if (stats_start(&stats, cfg, workers, nworkers, taken != NULL ? taken->admin : -1) == -1) {
+        return 1;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if ((errno = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    // only now the old process stops accepting, and we wait for the next restart
+    if (taken != NULL) {
+        handoff_ready(taken);
+        free(taken);
+    }
+    if (cfg->handoff != NULL && handoff_start(&handoff, cfg->handoff, workers, nworkers, stats.listener) == -1) {
+        return 1;
+    }
+
+    for (;;) {
+        if (sigwait(&mask, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            print_counters(workers, nworkers);
+            continue;
+        }
+        break;
+    }
+
+    if (cfg->handoff != NULL) {
+        handoff_stop(&handoff);
+
+        // the admin socket's path now leads to the new process
+        if (handoff.done) {
+            stats.path = NULL;
+        }
+    }
+    if (sig == SIGUSR2) {
+        drain_workers(workers, nworkers, cfg->drain_timeout);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        __atomic_store_n(&workers[i].stop, 1, __ATOMIC_RELAXED);
+        if (write(workers[i].wakefd, &one, sizeof one) == -1) {
+            perror("write");
+        }
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].listener != -1) {
+            close(workers[i].listener);
+        }
+        close(workers[i].wakefd);
+    }
+    stats_stop(&stats);
+
+    print_counters(workers, nworkers);
+    for (i = 0; i < nworkers; i++) {
+        slab_destroy(&workers[i].conns);
+        slab_destroy(&workers[i].batches);
+        pool_destroy(&workers[i].bufs);
+        free(workers[i].log);
+    }
+    free(workers);
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/****************************************
+** sockopt.c - socket tuning shared by server and client
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "sockopt.h"
+
+// every knob -o knows, bare is the value a name without "=" stands for,
+// min the smallest value it takes
+static const struct knob {
+    const char *name;
+    size_t off;
+    int bare;
+    int min;
+} knobs[] = {
+    {"backlog",  offsetof(struct sock_tuning, backlog),      0,   1},
+    {"fastopen", offsetof(struct sock_tuning, fastopen),     256, 0},
+    {"defer",    offsetof(struct sock_tuning, defer_accept), 1,   0},
+    {"nodelay",  offsetof(struct sock_tuning, nodelay),      1,   0},
+    {"cork",     offsetof(struct sock_tuning, cork),         1,   0},
+    {"busypoll", offsetof(struct sock_tuning, busy_poll),    50,  0},
+    {"sndbuf",   offsetof(struct sock_tuning, sndbuf),       0,   0},
+    {"rcvbuf",   offsetof(struct sock_tuning, rcvbuf),       0,   0},
+};
+
+#define NKNOBS (sizeof knobs / sizeof knobs[0])
+
+// "256k" -> 262144, -1 on garbage
+static long parse_value(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if (end == s || n < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'm': case 'M':
+            n <<= 10; // fall through
+        case 'k': case 'K':
+            n <<= 10;
+            end++;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+int sockopt_parse(struct sock_tuning *t, const char *spec) {
+    char *copy, *item, *save, *eq;
+    long value;
+    size_t i;
+    int rv = 0;
+
+    if ((copy = strdup(spec)) == NULL) {
+        return -1;
+    }
+    for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if ((eq = strchr(item, '=')) != NULL) {
+            *eq++ = '\0';
+        }
+        for (i = 0; i < NKNOBS && strcmp(knobs[i].name, item) != 0; i++);
+
+        if (i == NKNOBS) {
+            fprintf(stderr, "sockopt: unknown option %s\n", item);
+            rv = -1;
+            break;
+        }
+        value = eq != NULL ? parse_value(eq) : knobs[i].bare;
+        if (value < 0 || value > 0x7fffffff || (eq == NULL && knobs[i].bare == 0)) {
+            fprintf(stderr, "sockopt: %s needs a value\n", item);
+            rv = -1;
+            break;
+        }
+        if (value < knobs[i].min) {
+            fprintf(stderr, "sockopt: %s must be at least %d\n", item, knobs[i].min);
+            rv = -1;
+            break;
+        }
+        *(int *) ((char *) t + knobs[i].off) = (int) value;
+    }
+    free(copy);
+    return rv;
+}
+
+// one setsockopt(), complaining but not giving up when the kernel says no
+static int set(int fd, int level, int name, const char *what, int value) {
+    if (setsockopt(fd, level, name, &value, sizeof value) == -1) {
+        fprintf(stderr, "sockopt: %s: %s\n", what, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// what listeners and clients have in common
+static int set_common(int fd, int tcp, const struct sock_tuning *t) {
+    int rv = 0;
+
+    // Die Puffer müssen vor connect() bzw. listen() stehen, danach ist der
+    // Window-Scale-Faktor ausgehandelt und ein größerer Puffer bringt nichts mehr.
+    if (t->sndbuf && set(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", t->sndbuf) == -1) {
+        rv = -1;
+    }
+    if (t->rcvbuf && set(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", t->rcvbuf) == -1) {
+        rv = -1;
+    }
+    if (t->busy_poll && set(fd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", t->busy_poll) == -1) {
+        rv = -1;
+    }
+    if (tcp && t->nodelay && set(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
+
+int sockopt_listener(int fd, int socktype, const struct sock_tuning *t) {
+    int tcp = socktype == SOCK_STREAM;
+    int rv = set_common(fd, tcp, t);
+
+    // Mit TCP Fast Open darf schon das SYN die erste Anfrage tragen, wenn der
+    // Client ein Cookie von einer früheren Verbindung hat: Der Server
+    // antwortet, ohne auf das letzte ACK des Handshakes zu warten. Der Wert
+    // begrenzt, wie viele solcher halb offenen Verbindungen warten dürfen.
+    if (tcp && t->fastopen && set(fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", t->fastopen) == -1) {
+        rv = -1;
+    }
+
+    // accept() meldet die Verbindung erst, wenn Daten da sind
+    if (tcp && t->defer_accept &&
+        set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", t->defer_accept) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
+
+int sockopt_client(int fd, int socktype, const struct sock_tuning *t) {
+    return set_common(fd, socktype == SOCK_STREAM, t);
+}
+
+int sockopt_cork(int fd, int on) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+}
+
+void sockopt_describe(const struct sock_tuning *t, char *buf, size_t len) {
+    size_t i, n = 0;
+    int value;
+
+    buf[0] = '\0';
+    for (i = 0; i < NKNOBS && n < len; i++) {
+        value = *(const int *) ((const char *) t + knobs[i].off);
+        if (value) {
+            n += snprintf(buf + n, len - n, "%s%s=%d", n ? "," : "", knobs[i].name, value);
+        }
+    }
+}
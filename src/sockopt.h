@@ -0,0 +1,39 @@
+/****************************************
+** sockopt.h - socket tuning shared by server and client
+****************************************/
+
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <stddef.h>
+
+// what -o asked for, 0 leaves the kernel's default alone
+struct sock_tuning {
+    int backlog;      // listen() queue, the kernel caps it at net.core.somaxconn
+    int fastopen;     // server: TFO queue length, client: the first request rides on the SYN
+    int defer_accept; // seconds a listener may sit on a connection until its first data
+    int nodelay;      // TCP_NODELAY
+    int cork;         // hold a frame header back until the sendfile()/zerocopy body follows
+    int busy_poll;    // SO_BUSY_POLL in us
+    int sndbuf;       // SO_SNDBUF and SO_RCVBUF, setting them turns autotuning off
+    int rcvbuf;
+};
+
+// "backlog=4096,fastopen=256,defer=1,nodelay,cork,busypoll=50,sndbuf=256k,rcvbuf=256k",
+// one -o may set any of them, -1 on something unknown
+int sockopt_parse(struct sock_tuning *t, const char *spec);
+
+// before listen(): accepted connections inherit everything but the
+// listener-only options from here, so the workers need no syscalls per accept
+int sockopt_listener(int fd, int socktype, const struct sock_tuning *t);
+
+// before connect()
+int sockopt_client(int fd, int socktype, const struct sock_tuning *t);
+
+// TCP_CORK on or off, the uncork pushes out whatever waited
+int sockopt_cork(int fd, int on);
+
+// one line of what is set, for the startup banner
+void sockopt_describe(const struct sock_tuning *t, char *buf, size_t len);
+
+#endif
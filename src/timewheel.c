@@ -0,0 +1,133 @@
+/****************************************
+** timewheel.c - hierarchical timing wheel for connection timeouts
+****************************************/
+
+#include <string.h>
+
+#include "timewheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+// the farthest a timer can be from now
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+void wheel_init(struct wheel *w, uint64_t now_ns, uint64_t tick_ns) {
+    memset(w, 0, sizeof *w);
+    w->tick_ns = tick_ns;
+    w->start_ns = now_ns;
+}
+
+// hang t into the slot its expiry falls into, seen from the current tick
+static void wheel_insert(struct wheel *w, struct timer *t) {
+    uint64_t delta;
+    struct timer **slot;
+    int level;
+
+    if (t->expires < w->now) {
+        t->expires = w->now;
+    }
+    delta = t->expires - w->now;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        t->expires = w->now + delta;
+    }
+
+    // the lowest level whose range still covers delta
+    for (level = 0; level < WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_BITS * (level + 1)); level++);
+    slot = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+void timer_arm(struct wheel *w, struct timer *t, uint64_t now_ns, uint64_t timeout_ns) {
+    uint64_t expires = (now_ns + timeout_ns - w->start_ns + w->tick_ns - 1) / w->tick_ns;
+
+    // pushed back within the same tick, which is most re-arms under load
+    if (timer_armed(t)) {
+        if (t->expires == expires) {
+            return;
+        }
+        timer_cancel(w, t);
+    }
+    t->expires = expires;
+    wheel_insert(w, t);
+    w->armed++;
+}
+
+void timer_cancel(struct wheel *w, struct timer *t) {
+    if (!timer_armed(t)) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    w->armed--;
+}
+
+// a higher level slot came up: its timers move down to where they belong now
+static void wheel_cascade(struct wheel *w, int level, unsigned index) {
+    struct timer *t = w->slots[level][index], *next;
+
+    w->slots[level][index] = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        wheel_insert(w, t);
+    }
+}
+
+struct timer *wheel_advance(struct wheel *w, uint64_t now_ns) {
+    struct timer *expired = NULL, **tail = &expired, *t;
+    uint64_t target = (now_ns - w->start_ns) / w->tick_ns;
+    unsigned index, up;
+    int level;
+
+    while (w->now <= target) {
+
+        // nothing to look after, the clock may jump
+        if (w->armed == 0) {
+            w->now = target + 1;
+            break;
+        }
+
+        // at the start of every round of a level, the next one up cascades
+        index = w->now & WHEEL_MASK;
+        for (level = 1; index == 0 && level < WHEEL_LEVELS; level++) {
+            up = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            wheel_cascade(w, level, up);
+            index = up;
+        }
+
+        // the whole slot expires in one go
+        index = w->now & WHEEL_MASK;
+        for (t = w->slots[0][index]; t != NULL; t = t->next) {
+            t->pprev = NULL;
+            w->armed--;
+            *tail = t;
+            tail = &t->next;
+        }
+        w->slots[0][index] = NULL;
+        w->now++;
+    }
+    return expired;
+}
+
+int wheel_timeout(const struct wheel *w, uint64_t now_ns) {
+    uint64_t tick, next;
+
+    if (w->armed == 0) {
+        return -1;
+    }
+
+    // the next occupied slot of this round, or the cascade at its end
+    for (tick = w->now; (tick & WHEEL_MASK) != 0 && w->slots[0][tick & WHEEL_MASK] == NULL; tick++);
+    next = w->start_ns + tick * w->tick_ns;
+    return next <= now_ns ? 0 : (int) ((next - now_ns + 999999) / 1000000);
+}
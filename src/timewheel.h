@@ -0,0 +1,64 @@
+/****************************************
+** timewheel.h - hierarchical timing wheel for connection timeouts
+****************************************/
+
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// four levels of 64 slots: 64 ticks, 4096, 262144 and 16.7M ticks
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+// a tick of 10 ms reaches 46 hours on the top level, longer timeouts are cut there
+#define WHEEL_TICK_NS (10 * 1000000ULL)
+
+// Eine Zeitschaltuhr mit Zeigern statt eines Heaps: Jeder Timer hängt in
+// einer Liste an dem Slot, in dem er abläuft. Scharf machen und abbrechen
+// ist deshalb O(1), egal ob eine Million Verbindungen einen Timeout haben.
+// Was weiter in der Zukunft liegt, als die unterste Ebene reicht, wartet
+// grob einsortiert auf einer höheren Ebene und rutscht nach unten, sobald
+// die darunter einmal herum ist.
+
+// embedded in whatever can time out, no allocation per timer
+struct timer {
+    struct timer *next;
+    struct timer **pprev; // NULL while not armed
+    uint64_t expires;     // tick
+};
+
+struct wheel {
+    uint64_t tick_ns;
+    uint64_t start_ns;
+    uint64_t now;         // the next tick to run
+    unsigned long armed;
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init(struct wheel *w, uint64_t now_ns, uint64_t tick_ns);
+
+static inline void timer_init(struct timer *t) {
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static inline int timer_armed(const struct timer *t) {
+    return t->pprev != NULL;
+}
+
+// (re)arm t to fire timeout_ns after now_ns, rounded up to a tick; the wheel
+// may lag behind now_ns, the expiry is taken from the clock, not from it
+void timer_arm(struct wheel *w, struct timer *t, uint64_t now_ns, uint64_t timeout_ns);
+void timer_cancel(struct wheel *w, struct timer *t);
+
+// run every tick up to now_ns and return the timers that expired, disarmed
+// and linked through next; take t->next before handling t, it may be re-armed
+struct timer *wheel_advance(struct wheel *w, uint64_t now_ns);
+
+// ms until the next tick with work for epoll_wait(), -1 while nothing is armed
+int wheel_timeout(const struct wheel *w, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,286 @@
+/****************************************
+** tls.c - TLS over OpenSSL, with kTLS when the kernel has it
+****************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tls.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct tls_ctx {
+    SSL_CTX *ssl;
+};
+
+struct tls_conn {
+    SSL *ssl;
+    int ready;     // the handshake is done
+    int ktls_send; // ... and the kernel took over the sending side
+};
+
+// one record's worth of gathered iovecs, per thread
+static __thread char scratch[TLS_RECORD_MAX];
+
+static struct tls_ctx *ctx_new(const SSL_METHOD *method) {
+    struct tls_ctx *ctx;
+
+    if ((ctx = malloc(sizeof *ctx)) == NULL) {
+        fprintf(stderr, "tls: out of memory\n");
+        return NULL;
+    }
+    if ((ctx->ssl = SSL_CTX_new(method)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx->ssl, TLS1_2_VERSION);
+
+    // a peer that just closes is the end of the stream, not an attack
+    SSL_CTX_set_options(ctx->ssl, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+
+    // partial writes from wherever the data is now, buffers only while in use
+    SSL_CTX_set_mode(ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                               SSL_MODE_RELEASE_BUFFERS);
+    return ctx;
+}
+
+struct tls_ctx *tls_server_ctx(const char *cert, const char *key, int ktls) {
+    struct tls_ctx *ctx;
+
+    if ((ctx = ctx_new(TLS_server_method())) == NULL) {
+        return NULL;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx->ssl, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx->ssl, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx->ssl) != 1) {
+        fprintf(stderr, "tls: cannot use %s and %s\n", cert, key);
+        ERR_print_errors_fp(stderr);
+        tls_ctx_free(ctx);
+        return NULL;
+    }
+
+    // TLS 1.3 sends its session tickets after the handshake, through the
+    // socket behind our back; nobody resumes here, so none at all
+    SSL_CTX_set_num_tickets(ctx->ssl, 0);
+    SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_OFF);
+    if (ktls) {
+        SSL_CTX_set_options(ctx->ssl, SSL_OP_ENABLE_KTLS);
+    }
+    return ctx;
+}
+
+struct tls_ctx *tls_client_ctx(void) {
+    struct tls_ctx *ctx;
+
+    if ((ctx = ctx_new(TLS_client_method())) == NULL) {
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx->ssl, SSL_VERIFY_NONE, NULL);
+    return ctx;
+}
+
+void tls_ctx_free(struct tls_ctx *ctx) {
+    if (ctx != NULL) {
+        SSL_CTX_free(ctx->ssl);
+        free(ctx);
+    }
+}
+
+struct tls_conn *tls_conn_new(struct tls_ctx *ctx, int fd, int server) {
+    struct tls_conn *t;
+
+    if ((t = calloc(1, sizeof *t)) == NULL) {
+        return NULL;
+    }
+    if ((t->ssl = SSL_new(ctx->ssl)) == NULL || SSL_set_fd(t->ssl, fd) != 1) {
+        ERR_clear_error();
+        SSL_free(t->ssl);
+        free(t);
+        return NULL;
+    }
+    if (server) {
+        SSL_set_accept_state(t->ssl);
+    } else {
+        SSL_set_connect_state(t->ssl);
+    }
+    return t;
+}
+
+void tls_conn_free(struct tls_conn *t) {
+    if (t == NULL) {
+        return;
+    }
+
+    // one try at close_notify, whether the peer answers does not matter
+    if (t->ready) {
+        SSL_set_quiet_shutdown(t->ssl, 0);
+        SSL_shutdown(t->ssl);
+    }
+    ERR_clear_error();
+    SSL_free(t->ssl);
+    free(t);
+}
+
+// what an SSL_* return value means for the caller, in errno terms
+static ssize_t io_result(struct tls_conn *t, int r) {
+    switch (SSL_get_error(t->ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            // errno says what the socket did
+            ERR_clear_error();
+            if (errno == 0) {
+                errno = EPIPE;
+            }
+            return -1;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+    }
+}
+
+int tls_handshake(struct tls_conn *t) {
+    int r;
+
+    if (t->ready) {
+        return 1;
+    }
+    errno = 0;
+    if ((r = SSL_do_handshake(t->ssl)) != 1) {
+        return io_result(t, r) == -1 && errno == EAGAIN ? 0 : -1;
+    }
+    t->ready = 1;
+    t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    return 1;
+}
+
+int tls_ktls_send(const struct tls_conn *t) {
+    return t->ktls_send;
+}
+
+ssize_t tls_recv(struct tls_conn *t, void *buf, size_t len) {
+    size_t n;
+    int r;
+
+    errno = 0;
+    if ((r = SSL_read_ex(t->ssl, buf, len, &n)) != 1) {
+        return io_result(t, r);
+    }
+    return (ssize_t) n;
+}
+
+ssize_t tls_send(struct tls_conn *t, const void *buf, size_t len) {
+    size_t n;
+    int r;
+
+    errno = 0;
+    if ((r = SSL_write_ex(t->ssl, buf, len, &n)) != 1) {
+        return io_result(t, r);
+    }
+    return (ssize_t) n;
+}
+
+ssize_t tls_sendv(struct tls_conn *t, const struct iovec *iov, int iovcnt) {
+    size_t len = 0, part;
+    int i;
+
+    // a single iovec needs no copy, small ones would each become a record
+    if (iovcnt == 1) {
+        return tls_send(t, iov[0].iov_base, iov[0].iov_len);
+    }
+    for (i = 0; i < iovcnt && len < sizeof scratch; i++) {
+        part = iov[i].iov_len < sizeof scratch - len ? iov[i].iov_len : sizeof scratch - len;
+        memcpy(scratch + len, iov[i].iov_base, part);
+        len += part;
+    }
+    return tls_send(t, scratch, len);
+}
+
+void tls_describe(const struct tls_conn *t, char *buf, size_t len) {
+    snprintf(buf, len, "%s %s%s", SSL_get_version(t->ssl), SSL_get_cipher_name(t->ssl),
+             t->ktls_send ? " kTLS" : "");
+}
+
+#else
+
+// built without OpenSSL: nothing to set up, so nothing else ever gets called
+
+struct tls_ctx *tls_server_ctx(const char *cert, const char *key, int ktls) {
+    (void) cert;
+    (void) key;
+    (void) ktls;
+    fprintf(stderr, "tls: built without OpenSSL\n");
+    return NULL;
+}
+
+struct tls_ctx *tls_client_ctx(void) {
+    fprintf(stderr, "tls: built without OpenSSL\n");
+    return NULL;
+}
+
+void tls_ctx_free(struct tls_ctx *ctx) {
+    (void) ctx;
+}
+
+struct tls_conn *tls_conn_new(struct tls_ctx *ctx, int fd, int server) {
+    (void) ctx;
+    (void) fd;
+    (void) server;
+    return NULL;
+}
+
+void tls_conn_free(struct tls_conn *t) {
+    (void) t;
+}
+
+int tls_handshake(struct tls_conn *t) {
+    (void) t;
+    return -1;
+}
+
+int tls_ktls_send(const struct tls_conn *t) {
+    (void) t;
+    return 0;
+}
+
+ssize_t tls_recv(struct tls_conn *t, void *buf, size_t len) {
+    (void) t;
+    (void) buf;
+    (void) len;
+    errno = EIO;
+    return -1;
+}
+
+ssize_t tls_send(struct tls_conn *t, const void *buf, size_t len) {
+    (void) t;
+    (void) buf;
+    (void) len;
+    errno = EIO;
+    return -1;
+}
+
+ssize_t tls_sendv(struct tls_conn *t, const struct iovec *iov, int iovcnt) {
+    (void) t;
+    (void) iov;
+    (void) iovcnt;
+    errno = EIO;
+    return -1;
+}
+
+void tls_describe(const struct tls_conn *t, char *buf, size_t len) {
+    (void) t;
+    snprintf(buf, len, "plaintext");
+}
+
+#endif
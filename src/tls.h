@@ -0,0 +1,58 @@
+/****************************************
+** tls.h - TLS over OpenSSL, with kTLS when the kernel has it
+****************************************/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Den Handshake macht OpenSSL, danach kann der Kernel das Verschlüsseln der
+// Records übernehmen (kTLS, setsockopt(TCP_ULP, "tls")). Ab dann ist der
+// Socket für send(), writev() und sendfile() wieder ein ganz normaler
+// Socket: Die Daten gehen im Klartext hinein und verschlüsselt hinaus, der
+// Zero-Copy-Weg bleibt erhalten. Ohne kTLS geht jedes Byte durch SSL_write().
+
+// the most plaintext one record takes, user space TLS writes at most this per call
+#define TLS_RECORD_MAX 16384
+
+struct tls_ctx;
+struct tls_conn;
+
+// the server's certificate chain and key in PEM, ktls 0 keeps the record
+// encryption in user space even where the kernel could do it; NULL on errors
+struct tls_ctx *tls_server_ctx(const char *cert, const char *key, int ktls);
+
+// a client that takes any certificate, the test certs are self-signed
+struct tls_ctx *tls_client_ctx(void);
+
+void tls_ctx_free(struct tls_ctx *ctx);
+
+// TLS on a connected socket, blocking or not; server picks the side
+struct tls_conn *tls_conn_new(struct tls_ctx *ctx, int fd, int server);
+
+// send close_notify if the handshake got through and free everything but the fd
+void tls_conn_free(struct tls_conn *t);
+
+// drive the handshake: 1 once it is done, 0 to call again when the socket
+// is ready, -1 when it failed
+int tls_handshake(struct tls_conn *t);
+
+// after the handshake: the kernel encrypts, plain send()/sendfile() on the fd are fine
+int tls_ktls_send(const struct tls_conn *t);
+
+// recv()/send() through TLS: -1 with EAGAIN when the socket is not ready,
+// -1 with EIO on a TLS error, 0 from tls_recv() at the end of the stream
+ssize_t tls_recv(struct tls_conn *t, void *buf, size_t len);
+ssize_t tls_send(struct tls_conn *t, const void *buf, size_t len);
+
+// up to TLS_RECORD_MAX bytes of the iovecs as one record; a retry after
+// EAGAIN has to pass the same bytes again, more may follow them
+ssize_t tls_sendv(struct tls_conn *t, const struct iovec *iov, int iovcnt);
+
+// "TLSv1.3 TLS_AES_256_GCM_SHA384 kTLS" for logs
+void tls_describe(const struct tls_conn *t, char *buf, size_t len);
+
+#endif